@@ -0,0 +1,33 @@
+#!/bin/bash
+# run the same benchmark against rproxy once per I/O backend
+#
+# usage: ./compare_backends.sh [benchmark options]
+#   RPROXY   path of the rproxy binary (default ../build/rproxy)
+#   BACKENDS backends to compare       (default "epoll uring")
+#   WARMUP   seconds to wait for rproxy to listen (default 1)
+
+RPROXY=${RPROXY:-../build/rproxy}
+BACKENDS=${BACKENDS:-"epoll uring"}
+WARMUP=${WARMUP:-1}
+ARGS=${@:-"-c 50 -n 100000 -k"}
+
+if [ ! -x "$RPROXY" ]; then
+    echo "rproxy binary not found: $RPROXY" >&2
+    exit 1
+fi
+if [ ! -x ./benchmark ]; then
+    make || exit 1
+fi
+
+for backend in $BACKENDS; do
+    RPROXY_BACKEND=$backend "$RPROXY" > /dev/null 2>&1 &
+    pid=$!
+    sleep "$WARMUP"
+
+    result=$(./benchmark $ARGS 2>&1 | grep -E "requests per second|milliseconds used")
+    kill "$pid" 2> /dev/null
+    wait "$pid" 2> /dev/null
+
+    echo "[$backend]"
+    echo "$result"
+done
@@ -0,0 +1,156 @@
+/* lookup cost and key movement of the consistent hashing tables.
+ *
+ * hash_bench [-b <backends>] [-k <keys>] [-s <table size>]
+ * -b <backends> Backends in the set (default 16)
+ * -k <keys> Keys looked up and compared (default 1000000)
+ * -s <table size> Maglev table size, a prime (default 65537)
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "consistent_hash.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+static std::vector<proxy::Backend> makeBackends(uint32_t n)
+{
+    std::vector<proxy::Backend> backends;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        auto ip = "10.0." + std::to_string(i / 256) + "." + std::to_string(i % 256);
+        backends.emplace_back(i, reactor::InetAddr(ip, 8080), 1);
+    }
+
+    return backends;
+}
+
+// what each key maps to, as a backend id
+template <typename Table>
+static std::vector<uint32_t> assign(Table const & table, std::vector<proxy::Backend> const & backends,
+        std::vector<uint64_t> const & keys)
+{
+    std::vector<uint32_t> ids(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        ids[i] = backends[table.lookup(keys[i])].id_;
+
+    return ids;
+}
+
+template <typename Table>
+static double lookupNs(Table const & table, std::vector<uint64_t> const & keys)
+{
+    // summed so the lookups are not optimized away
+    uint64_t sum = 0;
+    auto start = Clock::now();
+    for (auto key : keys)
+        sum += table.lookup(key);
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    if (sum == 1)
+        printf(" ");
+
+    return static_cast<double>(ns) / keys.size();
+}
+
+template <typename Table>
+static void report(char const * name, std::vector<proxy::Backend> const & backends,
+        std::vector<uint64_t> const & keys, uint32_t size)
+{
+    auto build = [size](Table & table, std::vector<proxy::Backend> const & set) {
+        auto start = Clock::now();
+        table.build(set, size);
+        return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+    };
+
+    Table before;
+    auto build_us = build(before, backends);
+    auto ns = lookupNs(before, keys);
+
+    // spread: the busiest backend against the fair share
+    std::vector<size_t> load(backends.size(), 0);
+    auto old_ids = assign(before, backends, keys);
+    for (auto id : old_ids)
+        load[id]++;
+    auto fair = static_cast<double>(keys.size()) / backends.size();
+    auto peak = *std::max_element(load.begin(), load.end()) / fair;
+
+    // one backend leaves: its keys have to move, ideally nothing else does
+    auto removed = backends.size() / 2;
+    auto rest = backends;
+    rest.erase(rest.begin() + removed);
+    Table after;
+    build(after, rest);
+    auto new_ids = assign(after, rest, keys);
+
+    size_t moved = 0, needless = 0;
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        if (old_ids[i] == new_ids[i])
+            continue;
+        moved++;
+        if (old_ids[i] != backends[removed].id_)
+            needless++;
+    }
+
+    printf("%-8s build %6lld us, lookup %6.2f ns, peak load %.3f of fair, "
+           "on removal %.2f%% moved (ideal %.2f%%), %.2f%% of them needlessly\n",
+            name, static_cast<long long>(build_us), ns, peak,
+            100.0 * moved / keys.size(), 100.0 / backends.size(),
+            moved ? 100.0 * needless / moved : 0.0);
+}
+
+// the ring has no table size
+struct Ring : proxy::KetamaRing
+{
+    void build(std::vector<proxy::Backend> const & backends, uint32_t)
+    {
+        proxy::KetamaRing::build(backends);
+    }
+};
+
+int main(int argc, char ** argv)
+{
+    uint32_t n = 16;
+    size_t count = 1000000;
+    uint32_t size = proxy::MaglevTable::DEFAULT_SIZE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:k:s:")) != -1)
+    {
+        switch (opt) {
+            case 'b': n = static_cast<uint32_t>(atoi(optarg)); break;
+            case 'k': count = static_cast<size_t>(atol(optarg)); break;
+            case 's': size = static_cast<uint32_t>(atoi(optarg)); break;
+            default:
+                fprintf(stderr, "usage: %s [-b backends] [-k keys] [-s table size]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (n < 2 || n > proxy::MAX_BACKENDS)
+    {
+        fprintf(stderr, "backends between 2 and %u\n", proxy::MAX_BACKENDS);
+        return 1;
+    }
+
+    // client ips, hashed as the balancer does it
+    std::vector<uint64_t> keys(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        auto ip = std::to_string(i >> 24 & 0xff) + "." + std::to_string(i >> 16 & 0xff)
+                + "." + std::to_string(i >> 8 & 0xff) + "." + std::to_string(i & 0xff);
+        keys[i] = proxy::hashKey(ip);
+    }
+
+    auto backends = makeBackends(n);
+    printf("%u backends, %zu keys, maglev table %u\n", n, count, size);
+    report<proxy::MaglevTable>("maglev", backends, keys, size);
+    report<Ring>("ketama", backends, keys, size);
+
+    return 0;
+}
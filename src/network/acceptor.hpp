@@ -1,7 +1,11 @@
 #pragma once
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <sys/socket.h>
+
 #include <stdexcept>
+#include <vector>
 
 #include "pub_sub.hpp"
 #include "stream_socket.hpp"
@@ -11,12 +15,28 @@ namespace reactor {
 class Acceptor : public ::pubsub::Publisher
 {
 public:
-    Acceptor(int serverfd)
+    // connections taken per acceptBatch() call
+    static const size_t ACCEPT_BATCH = 64;
+
+    // a connection and its peer, as accept4() gave them
+    struct Accepted
+    {
+        Accepted(int fd, InetAddr const & peer)
+            : fd_(fd)
+            , peer_(peer)
+        {}
+
+        int         fd_;
+        InetAddr    peer_;
+    };
+
+public:
+    Acceptor(int serverfd, int backlog = SOMAXCONN)
         : id_(::pubsub::ID::pub_id())
         , server_(serverfd)
         , center_(::pubsub::PubSubCenter::instance())
     {
-        StreamSocket::listen(server_);
+        StreamSocket::listen(server_, backlog);
         center_->registerPub(id_, this);
     }
 
@@ -34,24 +54,61 @@ public:
 
     int accept()
     {
-        int sockfd = accept(server_);
+        sockaddr_storage peer;
+        int sockfd = accept(server_, peer);
 
         if (sockfd < 0)
             throw std::runtime_error("can not accept connection");
 
-        auto && addr = StreamSocket::getPeerAddr(sockfd);
-
         // std::shared_ptr<::pubsub::Context> ctx = std::make_shared<context::AcceptContext>(::pubsub::ACCEPTED, sockfd);
         // center_->notifySubscriber(id_, ::pubsub::ACCEPTED, ctx);
 
         return sockfd;
     }
 
+    /**
+     * @brief take up to `max` pending connections off a nonblocking
+     * listening socket and append them to `accepted`, with the peer
+     * accept4() reported.
+     *
+     * @return size_t   number of connections taken, less than `max`
+     *                  once the backlog is drained
+     */
+    size_t acceptBatch(std::vector<Accepted> & accepted, size_t max = ACCEPT_BATCH)
+    {
+        size_t n = 0;
+        sockaddr_storage peer;
+        while (n < max)
+        {
+            socklen_t len = sizeof(peer);
+            int sockfd = accept(server_, peer, &len);
+            if (sockfd >= 0)
+            {
+                accepted.emplace_back(sockfd,
+                        InetAddr(reinterpret_cast<sockaddr const *>(&peer), len));
+                n++;
+                continue;
+            }
+
+            // the peer gave up while queued, the next one may be fine
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            // EAGAIN once drained, EMFILE/ENFILE leave the rest queued
+            // for the next readiness event
+            break;
+        }
+
+        return n;
+    }
+
 private:
-    int accept(int fd) {
-        socklen_t addrLen;
-        struct sockaddr_in clientAddr;
-        return ::accept(fd, (struct sockaddr *) &clientAddr, &addrLen);
+    // the connection is nonblocking from the start, no fcntl() later.
+    // the peer comes along, no getpeername() later either
+    int accept(int fd, sockaddr_storage & peer, socklen_t * len = nullptr) {
+        socklen_t size = sizeof(peer);
+        return ::accept4(fd, reinterpret_cast<sockaddr *>(&peer), len ? len : &size,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
     }
 
 public:
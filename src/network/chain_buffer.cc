@@ -0,0 +1,342 @@
+#include <new>
+#include <stdexcept>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "chain_buffer.hpp"
+
+namespace reactor {
+
+ChainBuffer::ChainBuffer() noexcept
+    : slices_()
+    , readable_(0)
+    {}
+
+ChainBuffer::ChainBuffer(ChainBuffer && buf) noexcept
+    : slices_(std::move(buf.slices_))
+    , readable_(buf.readable_)
+{
+    buf.readable_ = 0;
+}
+
+ChainBuffer & ChainBuffer::operator=(ChainBuffer && buf) noexcept
+{
+    if (this != &buf)
+    {
+        retrieveAll();
+        slices_ = std::move(buf.slices_);
+        std::swap(readable_, buf.readable_);
+    }
+
+    return *this;
+}
+
+ChainBuffer::~ChainBuffer()
+{
+    retrieveAll();
+}
+
+size_t ChainBuffer::readableBytes() const noexcept
+{
+    return readable_;
+}
+
+bool ChainBuffer::empty() const noexcept
+{
+    return readable_ == 0;
+}
+
+size_t ChainBuffer::capacity() const noexcept
+{
+    size_t total = 0;
+    for (size_t i = 0; i < slices_.size(); i++)
+        total += slices_[i].block_->chunk_;
+
+    return total;
+}
+
+size_t ChainBuffer::overhead() const noexcept
+{
+    return slices_.heapBytes();
+}
+
+void ChainBuffer::append(void const * data, size_t len)
+{
+    if (!data && len > 0)
+        throw std::logic_error("invalid pointer.");
+
+    auto src = static_cast<char const *>(data);
+    while (len > 0)
+    {
+        auto space = tailSpace();
+        if (space == 0)
+        {
+            slices_.push_back(Slice{ newBlock(len), 0, 0 });
+            space = slices_.back().block_->capacity_;
+        }
+
+        auto & tail = slices_.back();
+        auto n = len < space ? len : space;
+        ::memcpy(tail.block_->data() + tail.end_, src, n);
+        tail.end_ += n;
+        tail.block_->used_ = tail.end_;
+
+        src += n;
+        len -= n;
+        readable_ += n;
+    }
+}
+
+void ChainBuffer::splice(ChainBuffer & buf)
+{
+    if (&buf == this)
+        return;
+
+    for (size_t i = 0; i < buf.slices_.size(); i++)
+        slices_.push_back(buf.slices_[i]);
+    readable_ += buf.readable_;
+
+    buf.slices_.clear();
+    buf.readable_ = 0;
+}
+
+void ChainBuffer::share(ChainBuffer const & buf)
+{
+    if (&buf == this)
+        return;
+
+    for (size_t i = 0; i < buf.slices_.size(); i++)
+    {
+        auto const & slice = buf.slices_[i];
+        ref(slice.block_);
+        slices_.push_back(slice);
+    }
+    readable_ += buf.readable_;
+}
+
+void ChainBuffer::share(ChainBuffer const & buf, size_t len)
+{
+    if (&buf == this)
+        return;
+
+    if (len > buf.readable_)
+        throw std::logic_error("no such size for buffer");
+
+    for (size_t i = 0; i < buf.slices_.size(); i++)
+    {
+        if (len == 0)
+            break;
+
+        auto const & slice = buf.slices_[i];
+        auto size = slice.end_ - slice.begin_;
+        auto part = len < size ? len : size;
+        ref(slice.block_);
+        slices_.push_back(Slice{ slice.block_, slice.begin_, slice.begin_ + part });
+        readable_ += part;
+        len -= part;
+    }
+}
+
+void ChainBuffer::retrieve(size_t len)
+{
+    if (len > readable_)
+        throw std::logic_error("no such size for buffer");
+
+    readable_ -= len;
+    while (len > 0)
+    {
+        auto & head = slices_.front();
+        auto size = head.end_ - head.begin_;
+        if (len < size)
+        {
+            head.begin_ += len;
+            break;
+        }
+
+        len -= size;
+        unref(head.block_);
+        slices_.pop_front();
+    }
+}
+
+void ChainBuffer::retrieveAll() noexcept
+{
+    for (size_t i = 0; i < slices_.size(); i++)
+        unref(slices_[i].block_);
+
+    slices_.clear();
+    readable_ = 0;
+}
+
+std::string ChainBuffer::retrieveAllAsString()
+{
+    std::string result;
+    result.reserve(readable_);
+    for (size_t i = 0; i < slices_.size(); i++)
+    {
+        auto const & slice = slices_[i];
+        result.append(slice.block_->data() + slice.begin_, slice.end_ - slice.begin_);
+    }
+
+    retrieveAll();
+    return result;
+}
+
+int ChainBuffer::peek(struct iovec * iov, int max) const noexcept
+{
+    int cnt = 0;
+    for (size_t i = 0; i < slices_.size(); i++)
+    {
+        if (cnt == max)
+            break;
+
+        auto const & slice = slices_[i];
+        if (slice.end_ == slice.begin_)
+            continue;
+
+        iov[cnt].iov_base = slice.block_->data() + slice.begin_;
+        iov[cnt].iov_len = slice.end_ - slice.begin_;
+        cnt++;
+    }
+
+    return cnt;
+}
+
+ssize_t ChainBuffer::readFd(int fd)
+{
+    struct iovec vec[2];
+    int cnt = 0;
+
+    auto space = tailSpace();
+    if (space > 0)
+    {
+        auto & tail = slices_.back();
+        vec[cnt].iov_base = tail.block_->data() + tail.end_;
+        vec[cnt].iov_len = space;
+        cnt++;
+    }
+
+    // only borrow a fresh block if the tail can not take a full read
+    Block * extra = nullptr;
+    if (space < BLOCK_SIZE / 2)
+    {
+        extra = newBlock(0);
+        vec[cnt].iov_base = extra->data();
+        vec[cnt].iov_len = extra->capacity_;
+        cnt++;
+    }
+
+    auto n = ::readv(fd, vec, cnt);
+    size_t left = n > 0 ? static_cast<size_t>(n) : 0;
+
+    if (space > 0 && left > 0)
+    {
+        auto & tail = slices_.back();
+        auto used = left < space ? left : space;
+        tail.end_ += used;
+        tail.block_->used_ = tail.end_;
+        readable_ += used;
+        left -= used;
+    }
+
+    if (extra)
+    {
+        if (left > 0)
+        {
+            extra->used_ = left;
+            slices_.push_back(Slice{ extra, 0, left });
+            readable_ += left;
+        }
+        else
+        {
+            unref(extra);
+        }
+    }
+
+    return n;
+}
+
+ssize_t ChainBuffer::writeFd(int fd)
+{
+    struct iovec iov[MAX_IOV];
+    auto cnt = peek(iov, MAX_IOV);
+    if (cnt == 0)
+        return 0;
+
+    return consumed(::writev(fd, iov, cnt));
+}
+
+ssize_t ChainBuffer::sendTo(int fd, int flags)
+{
+    struct iovec iov[MAX_IOV];
+    auto cnt = peek(iov, MAX_IOV);
+    if (cnt == 0)
+        return 0;
+
+    struct msghdr msg;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+
+    return consumed(::sendmsg(fd, &msg, flags));
+}
+
+ChainBuffer::Block * ChainBuffer::newBlock(size_t len)
+{
+    // the header lives at the front of the chunk, blocks stay within
+    // the pooled size classes
+    len += sizeof(Block);
+    if (len < BLOCK_SIZE)
+        len = BLOCK_SIZE;
+    if (len > ChunkPool::LARGE)
+        len = ChunkPool::LARGE;
+
+    size_t chunk = 0;
+    char * mem = ChunkPool::local().acquire(len, chunk);
+    auto block = ::new (mem) Block;
+    block->refs_.store(1, std::memory_order_relaxed);
+    block->chunk_ = chunk;
+    block->capacity_ = chunk - sizeof(Block);
+    block->used_ = 0;
+
+    return block;
+}
+
+void ChainBuffer::ref(Block * block) noexcept
+{
+    block->refs_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ChainBuffer::unref(Block * block) noexcept
+{
+    if (block->refs_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    auto chunk = block->chunk_;
+    block->~Block();
+    ChunkPool::local().release(reinterpret_cast<char *>(block), chunk);
+}
+
+size_t ChainBuffer::tailSpace() const noexcept
+{
+    if (slices_.empty())
+        return 0;
+
+    // a shared block or one that was written past this slice is frozen
+    auto const & tail = slices_.back();
+    if (tail.end_ != tail.block_->used_
+            || tail.block_->refs_.load(std::memory_order_acquire) != 1)
+        return 0;
+
+    return tail.block_->capacity_ - tail.end_;
+}
+
+ssize_t ChainBuffer::consumed(ssize_t n)
+{
+    if (n > 0)
+        retrieve(static_cast<size_t>(n));
+
+    return n;
+}
+
+} // namespace reactor
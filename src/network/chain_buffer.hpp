@@ -0,0 +1,124 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+#include "chunk_pool.hpp"
+#include "small_ring.hpp"
+
+namespace reactor {
+
+/**
+ * @brief segmented buffer made of refcounted blocks borrowed from the
+ * ChunkPool. it is filled with readv() and drained with writev() or
+ * sendmsg() straight from the blocks, so there is no compaction copy.
+ * blocks can be moved (splice) or shared (share) between buffers,
+ * e.g. from a client connection to its backend, without memcpy.
+ */
+class ChainBuffer
+{
+public:
+    static const size_t BLOCK_SIZE = ChunkPool::MEDIUM;
+    static const int MAX_IOV = 64;
+    // slices kept without an allocation
+    static const size_t INLINE_SLICES = 4;
+
+public:
+    ChainBuffer() noexcept;
+    // copying would silently share blocks, use share() instead
+    ChainBuffer(const ChainBuffer &) = delete;
+    ChainBuffer & operator=(const ChainBuffer &) = delete;
+    ChainBuffer(ChainBuffer && buf) noexcept;
+    ChainBuffer & operator=(ChainBuffer && buf) noexcept;
+    ~ChainBuffer();
+
+    size_t readableBytes() const noexcept;
+
+    bool empty() const noexcept;
+
+    // bytes of block storage referenced by this buffer
+    size_t capacity() const noexcept;
+
+    // bytes of the slice list, once it outgrew its inline room
+    size_t overhead() const noexcept;
+
+    void append(void const * data, size_t len);
+
+    /**
+     * @brief move every block of `buf` to the tail of this buffer.
+     * `buf` is left empty.
+     */
+    void splice(ChainBuffer & buf);
+
+    /**
+     * @brief reference the blocks of `buf` at the tail of this buffer.
+     * both buffers see the same bytes, the blocks are returned to the
+     * pool once the last reference is gone.
+     */
+    void share(ChainBuffer const & buf);
+
+    // same, limited to the first `len` readable bytes of `buf`
+    void share(ChainBuffer const & buf, size_t len);
+
+    void retrieve(size_t len);
+
+    void retrieveAll() noexcept;
+
+    std::string retrieveAllAsString();
+
+    /**
+     * @brief describe the readable bytes without consuming them.
+     *
+     * @return int  number of iovec filled, at most `max`
+     */
+    int peek(struct iovec * iov, int max) const noexcept;
+
+    // readv() into the free tail space plus one fresh block
+    ssize_t readFd(int fd);
+
+    // writev() from the head, consumes what was written
+    ssize_t writeFd(int fd);
+
+    // sendmsg() from the head, consumes what was sent
+    ssize_t sendTo(int fd, int flags);
+
+private:
+    struct Block
+    {
+        std::atomic<unsigned>   refs_;
+        size_t                  chunk_;     // size of the pooled chunk
+        size_t                  capacity_;  // usable data bytes
+        size_t                  used_;      // write watermark
+
+        char * data() noexcept { return reinterpret_cast<char *>(this + 1); }
+    };
+
+    struct Slice
+    {
+        Block * block_;
+        size_t  begin_;
+        size_t  end_;
+    };
+
+private:
+    static Block * newBlock(size_t len);
+
+    static void ref(Block * block) noexcept;
+
+    static void unref(Block * block) noexcept;
+
+    // free space that directly follows the tail slice, if it can grow
+    size_t tailSpace() const noexcept;
+
+    ssize_t consumed(ssize_t n);
+
+private:
+    SmallRing<Slice, INLINE_SLICES>     slices_;
+    size_t                              readable_;
+};
+
+} // namespace reactor
@@ -6,6 +6,7 @@ namespace reactor {
 Channel::Channel(int fd, std::shared_ptr<Demultiplex> dmp) noexcept
     : leave_(false)
     , socket_(fd)
+    , events_(Demultiplex::DefaultEvents)
     , dmp_ptr_(dmp)
     {}
 
@@ -22,15 +23,19 @@ std::shared_ptr<Demultiplex> Channel::dmp() noexcept
     return dmp_ptr_;
 }
 
+uint32_t Channel::events() const noexcept
+{
+    return events_;
+}
+
 void Channel::leave()
 {
     leave_ = true;
-    auto del = new context::DmpDeleteContext(::pubsub::DMPDELETE);
-    del->fd_ = socket_;
-    std::shared_ptr<::pubsub::Context> ctx(del);
+    context::DmpDeleteContext del(::pubsub::DMPDELETE);
+    del.fd_ = socket_;
     // FIXME: ? Is it really not necessary to notify subscribers (TcpServer)
     // to remove TcpConnection object cached in it?
-    dmp_ptr_->demultiplexRemove(ctx);
+    dmp_ptr_->demultiplexRemove(del);
 }
 
 bool Channel::isLeave() noexcept
@@ -38,37 +43,37 @@ bool Channel::isLeave() noexcept
     return leave_;
 }
 
-void Channel::enableRead(std::shared_ptr<::pubsub::Context> ctx)
+void Channel::enableRead()
+{
+    events_ |= Demultiplex::READABLE;
+    update();
+}
+
+void Channel::enableWrite()
 {
-    auto dmp_ctx = std::dynamic_pointer_cast<context::DmpModifyContext>(ctx);
-    dmp_ctx->fd_ = socket_;
-    dmp_ctx->events_ |= Demultiplex::READABLE;
-    dmp_ptr_->demultiplexModify(ctx);
+    events_ |= Demultiplex::WRITABLE;
+    update();
 }
 
-void Channel::enableWrite(std::shared_ptr<::pubsub::Context> ctx)
+void Channel::disableRead()
 {
-    auto dmp_ctx = std::dynamic_pointer_cast<context::DmpModifyContext>(ctx);
-    dmp_ctx->fd_ = socket_;
-    dmp_ctx->events_ |= Demultiplex::WRITABLE;
-    dmp_ptr_->demultiplexModify(ctx);
+    events_ &= (~Demultiplex::READABLE);
+    update();
 }
 
-void Channel::disableRead(std::shared_ptr<::pubsub::Context> ctx)
+void Channel::disableWrite()
 {
-    auto dmp_ctx = std::dynamic_pointer_cast<context::DmpModifyContext>(ctx);
-    dmp_ctx->fd_ = socket_;
-    dmp_ctx->events_ &= (~Demultiplex::READABLE);
-    dmp_ptr_->demultiplexModify(ctx);
+    // events_ &= (~Demultiplex::WRITABLE);
+    events_ = Demultiplex::DefaultEvents;
+    update();
 }
 
-void Channel::disableWrite(std::shared_ptr<::pubsub::Context> ctx)
+void Channel::update()
 {
-    auto dmp_ctx = std::dynamic_pointer_cast<context::DmpModifyContext>(ctx);
-    dmp_ctx->fd_ = socket_;
-    // dmp_ctx->events_ &= (~Demultiplex::WRITABLE);
-    dmp_ctx->events_ = Demultiplex::DefaultEvents;
-    dmp_ptr_->demultiplexModify(ctx);
+    context::DmpModifyContext modify(::pubsub::DMPMODIFY);
+    modify.fd_ = socket_;
+    modify.events_ = events_;
+    dmp_ptr_->demultiplexModify(modify);
 }
 
-} // namespace reactor
\ No newline at end of file
+} // namespace reactor
@@ -19,23 +19,30 @@ public:
 
     std::shared_ptr<Demultiplex> dmp() noexcept;
 
+    // the events currently monitored by the demultiplexer
+    uint32_t events() const noexcept;
+
     void leave();
 
     bool isLeave() noexcept;
 
-    void enableRead(std::shared_ptr<::pubsub::Context> ctx);
+    void enableRead();
+
+    void enableWrite();
 
-    void enableWrite(std::shared_ptr<::pubsub::Context> ctx);
+    void disableRead();
 
-    void disableRead(std::shared_ptr<::pubsub::Context> ctx);
+    void disableWrite();
 
-    void disableWrite(std::shared_ptr<::pubsub::Context> ctx);
+private:
+    void update();
 
 private:
     bool                        leave_;
     int                         socket_;
+    uint32_t                    events_;
     // Demultiplex *               dmp_;
     std::shared_ptr<Demultiplex>    dmp_ptr_;
 };
 
-} // namespace reactor
\ No newline at end of file
+} // namespace reactor
@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <mutex>
+
+#include "chunk_pool.hpp"
+
+namespace reactor {
+
+namespace {
+
+// the live pools, and what the ones already gone left behind
+struct Registry
+{
+    Registry()
+        : mx_()
+        , pools_()
+        , in_use_(0)
+        , hits_(0)
+        , misses_(0)
+    {}
+
+    std::mutex                      mx_;
+    std::vector<ChunkPool const *>  pools_;
+    int64_t                         in_use_;
+    int64_t                         hits_;
+    int64_t                         misses_;
+};
+
+Registry & registry()
+{
+    static Registry reg;
+    return reg;
+}
+
+// only the owning thread writes a pool's counters, a plain store does
+void add(std::atomic<int64_t> & counter, int64_t delta) noexcept
+{
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+} // namespace
+
+ChunkPool::ChunkPool()
+    : free_()
+    , counters_()
+{
+    auto & reg = registry();
+    std::lock_guard<std::mutex> guard(reg.mx_);
+    reg.pools_.push_back(this);
+}
+
+ChunkPool::~ChunkPool()
+{
+    for (size_t cls = 0; cls < CLASSES; cls++)
+    {
+        for (auto chunk : free_[cls])
+            delete [] chunk;
+    }
+
+    // chunks it handed out may live on in other threads' buffers
+    auto & reg = registry();
+    std::lock_guard<std::mutex> guard(reg.mx_);
+    reg.pools_.erase(std::find(reg.pools_.begin(), reg.pools_.end(), this));
+    reg.in_use_ += counters_.in_use_.load(std::memory_order_relaxed);
+    reg.hits_ += counters_.hits_.load(std::memory_order_relaxed);
+    reg.misses_ += counters_.misses_.load(std::memory_order_relaxed);
+}
+
+ChunkPool & ChunkPool::local()
+{
+    static thread_local ChunkPool pool;
+    return pool;
+}
+
+char * ChunkPool::acquire(size_t len, size_t & capacity)
+{
+    int cls = classOf(len);
+    if (cls < 0)
+    {
+        capacity = len;
+        add(counters_.misses_, 1);
+        add(counters_.in_use_, capacity);
+        return new char[capacity];
+    }
+
+    capacity = classSize(cls);
+    char * chunk = nullptr;
+    auto & list = free_[cls];
+    if (!list.empty())
+    {
+        chunk = list.back();
+        list.pop_back();
+        add(counters_.cached_, -static_cast<int64_t>(capacity));
+        add(counters_.hits_, 1);
+    }
+    else
+    {
+        chunk = new char[capacity];
+        add(counters_.misses_, 1);
+    }
+    add(counters_.in_use_, capacity);
+
+    return chunk;
+}
+
+void ChunkPool::release(char * chunk, size_t capacity) noexcept
+{
+    if (!chunk)
+        return;
+
+    add(counters_.in_use_, -static_cast<int64_t>(capacity));
+
+    int cls = classOf(capacity);
+    if (cls < 0 || classSize(cls) != capacity
+            || free_[cls].size() * capacity >= MAX_CACHED)
+    {
+        delete [] chunk;
+        return;
+    }
+
+    try {
+        free_[cls].push_back(chunk);
+        add(counters_.cached_, capacity);
+    } catch (...) {
+        delete [] chunk;
+    }
+}
+
+ChunkPool::Stats ChunkPool::stats() noexcept
+{
+    auto & reg = registry();
+    std::lock_guard<std::mutex> guard(reg.mx_);
+    auto in_use = reg.in_use_;
+    int64_t cached = 0;
+    auto hits = reg.hits_;
+    auto misses = reg.misses_;
+    for (auto pool : reg.pools_)
+    {
+        auto const & counters = pool->counters_;
+        in_use += counters.in_use_.load(std::memory_order_relaxed);
+        cached += counters.cached_.load(std::memory_order_relaxed);
+        hits += counters.hits_.load(std::memory_order_relaxed);
+        misses += counters.misses_.load(std::memory_order_relaxed);
+    }
+
+    // the pools are read one after another, a chunk moving between
+    // two of them meanwhile can be missed
+    Stats s;
+    s.bytes_in_use_ = static_cast<size_t>(std::max<int64_t>(in_use, 0));
+    s.bytes_cached_ = static_cast<size_t>(cached);
+    s.hits_         = static_cast<size_t>(hits);
+    s.misses_       = static_cast<size_t>(misses);
+
+    return s;
+}
+
+int ChunkPool::classOf(size_t len) noexcept
+{
+    if (len <= SMALL)
+        return 0;
+    if (len <= MEDIUM)
+        return 1;
+    if (len <= LARGE)
+        return 2;
+
+    return -1;
+}
+
+size_t ChunkPool::classSize(int cls) noexcept
+{
+    static const size_t sizes[CLASSES] = { SMALL, MEDIUM, LARGE };
+    return sizes[cls];
+}
+
+} // namespace reactor
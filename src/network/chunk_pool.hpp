@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace reactor {
+
+/**
+ * @brief size-classed pool of raw buffer chunks (4K/16K/64K).
+ * each thread owns its own freelists, so acquire/release take no lock.
+ * a chunk released on another thread simply joins that thread's cache.
+ * requests above the largest class are served straight from the heap.
+ * the counters are kept per pool too and only summed by stats().
+ */
+class ChunkPool
+{
+public:
+    static const size_t SMALL   = 4 * 1024;
+    static const size_t MEDIUM  = 16 * 1024;
+    static const size_t LARGE   = 64 * 1024;
+    static const size_t CLASSES = 3;
+
+    // bytes kept per size class once chunks are released
+    static const size_t MAX_CACHED = 4 * 1024 * 1024;
+
+    struct Stats
+    {
+        size_t bytes_in_use_;   // held by buffers right now
+        size_t bytes_cached_;   // parked in freelists
+        size_t hits_;
+        size_t misses_;
+    };
+
+public:
+    ChunkPool();
+    ChunkPool(const ChunkPool &) = delete;
+    ChunkPool & operator=(const ChunkPool &) = delete;
+    ~ChunkPool();
+
+    // pool of the calling thread
+    static ChunkPool & local();
+
+    /**
+     * @brief smallest chunk that holds `len` bytes.
+     *
+     * @param len       required bytes
+     * @param capacity  real size of the returned chunk
+     */
+    char * acquire(size_t len, size_t & capacity);
+
+    void release(char * chunk, size_t capacity) noexcept;
+
+    // process-wide counters over every thread's pool
+    static Stats stats() noexcept;
+
+private:
+    // only the owning thread writes them, stats() reads them from anywhere
+    struct Counters
+    {
+        Counters()
+            : in_use_(0)
+            , cached_(0)
+            , hits_(0)
+            , misses_(0)
+        {}
+
+        // less than zero once chunks of other threads are released here
+        std::atomic<int64_t>    in_use_;
+        std::atomic<int64_t>    cached_;
+        std::atomic<int64_t>    hits_;
+        std::atomic<int64_t>    misses_;
+    };
+
+private:
+    static int classOf(size_t len) noexcept;
+
+    static size_t classSize(int cls) noexcept;
+
+private:
+    std::vector<char *> free_[CLASSES];
+    Counters            counters_;
+};
+
+} // namespace reactor
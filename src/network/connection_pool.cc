@@ -0,0 +1,47 @@
+#include "connection_pool.hpp"
+
+namespace reactor {
+
+ConnectionPool::ConnectionPool(size_t slab_size)
+    : conns_(slab_size)
+    , hits_(0)
+    , misses_(0)
+    , in_use_(0)
+    {}
+
+ConnectionPool::TcpConnectionPtr ConnectionPool::acquire(int fd, std::shared_ptr<Demultiplex> dmp,
+        InetAddr const & peer)
+{
+    auto conn = conns_.acquire(fd, std::move(dmp), peer);
+    publish();
+    return TcpConnectionPtr(conn, Deleter(this));
+}
+
+void ConnectionPool::release(TcpConnection * conn)
+{
+    if (!conn)
+        return;
+
+    conns_.release(conn);
+    publish();
+}
+
+PoolStats ConnectionPool::connectionStats() const noexcept
+{
+    PoolStats stats;
+    stats.hits_   = hits_.load(std::memory_order_relaxed);
+    stats.misses_ = misses_.load(std::memory_order_relaxed);
+    stats.in_use_ = in_use_.load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+void ConnectionPool::publish() noexcept
+{
+    auto stats = conns_.stats();
+    hits_.store(stats.hits_, std::memory_order_relaxed);
+    misses_.store(stats.misses_, std::memory_order_relaxed);
+    in_use_.store(stats.in_use_, std::memory_order_relaxed);
+}
+
+} // namespace reactor
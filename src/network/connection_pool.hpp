@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include "object_pool.hpp"
+#include "tcp_connection.hpp"
+
+namespace reactor {
+
+/**
+ * @brief per-loop pool of TcpConnection objects. connections come
+ * from a slab, their buffers borrow storage from the ChunkPool only
+ * while data is queued, so connection churn does not go through
+ * malloc/free once the pools are warm. only the owning loop thread
+ * acquires and releases, connectionStats() may be read from anywhere.
+ */
+class ConnectionPool
+{
+public:
+    struct Deleter
+    {
+        Deleter(ConnectionPool * pool = nullptr) noexcept
+            : pool_(pool)
+        {}
+
+        void operator()(TcpConnection * conn) const
+        {
+            pool_->release(conn);
+        }
+
+        ConnectionPool * pool_;
+    };
+
+    using TcpConnectionPtr = std::unique_ptr<TcpConnection, Deleter>;
+
+    static const size_t SLAB_SIZE = 64;
+
+public:
+    ConnectionPool(size_t slab_size = SLAB_SIZE);
+    ConnectionPool(const ConnectionPool &) = delete;
+    ConnectionPool & operator=(const ConnectionPool &) = delete;
+    ~ConnectionPool() = default;
+
+    TcpConnectionPtr acquire(int fd, std::shared_ptr<Demultiplex> dmp,
+            InetAddr const & peer = InetAddr());
+
+    PoolStats connectionStats() const noexcept;
+
+private:
+    void release(TcpConnection * conn);
+
+    // snapshot of conns_ stats for readers on other threads
+    void publish() noexcept;
+
+private:
+    ObjectPool<TcpConnection>   conns_;
+    std::atomic<size_t>         hits_;
+    std::atomic<size_t>         misses_;
+    std::atomic<size_t>         in_use_;
+};
+
+} // namespace reactor
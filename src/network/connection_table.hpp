@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "connection_pool.hpp"
+
+namespace reactor {
+
+/**
+ * @brief the connections owned by one loop, indexed by fd. fds are
+ * small dense integers, so a lookup is an array index. only the owning
+ * loop thread touches it, there is no lock.
+ */
+class ConnectionTable
+{
+public:
+    using TcpConnectionPtr = ConnectionPool::TcpConnectionPtr;
+
+    static const size_t INITIAL_SLOTS = 1024;
+
+public:
+    ConnectionTable()
+        : slots_(INITIAL_SLOTS)
+        , size_(0)
+    {}
+    ConnectionTable(const ConnectionTable &) = delete;
+    ConnectionTable & operator=(const ConnectionTable &) = delete;
+    ~ConnectionTable() = default;
+
+    TcpConnection * find(int fd) const noexcept
+    {
+        if (fd < 0 || static_cast<size_t>(fd) >= slots_.size())
+            return nullptr;
+
+        return slots_[fd].get();
+    }
+
+    // false if fd is taken already, conn is dropped then
+    bool insert(int fd, TcpConnectionPtr conn)
+    {
+        if (fd < 0)
+            return false;
+
+        if (static_cast<size_t>(fd) >= slots_.size())
+            slots_.resize(std::max(static_cast<size_t>(fd) + 1, slots_.size() * 2));
+
+        if (slots_[fd])
+            return false;
+
+        slots_[fd] = std::move(conn);
+        size_++;
+
+        return true;
+    }
+
+    TcpConnectionPtr take(int fd) noexcept
+    {
+        if (!find(fd))
+            return TcpConnectionPtr();
+
+        size_--;
+        return std::move(slots_[fd]);
+    }
+
+    template<typename F>
+    void forEach(F f) const
+    {
+        for (auto const & slot : slots_)
+        {
+            if (slot)
+                f(*slot);
+        }
+    }
+
+    size_t size() const noexcept { return size_; }
+
+private:
+    std::vector<TcpConnectionPtr>   slots_;
+    size_t                          size_;
+};
+
+} // namespace reactor
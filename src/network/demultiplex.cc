@@ -1,31 +1,83 @@
-#include <stdexcept>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
+#include <stdexcept>
+#include <string>
+
+#ifdef Debug
+#   include <iostream>
+#endif
+
 #include "demultiplex.hpp"
-#include "nw_ctx.hpp"
-#include "stream_socket.hpp"
+#include "epoll_poller.hpp"
+#include "uring_poller.hpp"
 
 namespace reactor {
 
-Demultiplex::Demultiplex()
+Demultiplex::Demultiplex(Backend backend)
     : id_(::pubsub::ID::pub_id())
-    , dmpfd_(-1)
+    , backend_(backend)
+    , poller_()
     , notify_(true)
     , center_(::pubsub::PubSubCenter::instance())
+    , wait_ctx_(::pubsub::DMPWAIT)
+    , wakeup_fd_(-1)
+    , wakeup_pending_(false)
+    , loop_thread_()
+    , tasks_(TASK_QUEUE_SIZE)
+    , timers_()
+    , budget_()
+    , deferred_()
+    , serving_()
+    , is_deferred_()
+    , register_handlers_()
+    , modify_handlers_()
+    , delete_handlers_()
+    , wait_handlers_()
 {
-    if ((dmpfd_ = ::epoll_create(MAX_SIZE)) < 0)
-        throw std::runtime_error("can not create epoll instance");
+    wait_ctx_.dmp_ = this;
+    wait_ctx_.resp_events_.reserve(EVENT_SIZE);
+
+    if (backend_ == URING)
+    {
+        try {
+            poller_.reset(new UringPoller);
+        } catch (std::exception & e) {
+#ifdef Debug
+            std::cout << "io_uring unavailable, " << e.what()
+                      << ", falling back to epoll\n";
+#endif
+            backend_ = EPOLL;
+        }
+    }
+    if (backend_ == EPOLL)
+        poller_.reset(new EpollPoller);
+
+    wakeup_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd_ == -1)
+        throw std::runtime_error(std::string("eventfd error: ") + ::strerror(errno));
+    poller_->add(wakeup_fd_, READABLE);
 
     center_->registerPub(id_, this);
 }
 
 Demultiplex::~Demultiplex() 
 {
-    if (dmpfd_ != -1)
-    {
-        ::close(dmpfd_);
-        center_->unRegisterPub(id_);
-    }
+    center_->unRegisterPub(id_);
+    poller_->remove(wakeup_fd_);
+    ::close(wakeup_fd_);
+}
+
+Demultiplex::Backend Demultiplex::defaultBackend()
+{
+    char const * name = ::getenv("RPROXY_BACKEND");
+    if (name && (::strcmp(name, "uring") == 0 || ::strcmp(name, "io_uring") == 0))
+        return URING;
+
+    return EPOLL;
 }
 
 void Demultiplex::enableNotify(bool enabled)
@@ -51,73 +103,244 @@ std::shared_ptr<::pubsub::PubSubCenter> Demultiplex::center() noexcept
 
 int Demultiplex::demultiplexRegister(int sockfd, bool notify)
 {
-    StreamSocket::setNonBlocking(sockfd);
+    return demultiplexRegister(sockfd, InetAddr(), notify);
+}
 
-    auto regiser_ctx = new context::DmpRegisterContext(::pubsub::DMPREGISTER);
-    regiser_ctx->fd_ = sockfd;
-    regiser_ctx->events_ = DefaultEvents;
-    if (notify_ || (!notify_ && notify))
-        regiser_ctx->dmp_ptr_ = shared_from_this();
+int Demultiplex::demultiplexRegister(int sockfd, InetAddr const & peer, bool notify)
+{
+    if (notifiable(notify))
+    {
+        context::DmpRegisterContext ctx(::pubsub::DMPREGISTER);
+        ctx.fd_ = sockfd;
+        ctx.events_ = DefaultEvents;
+        ctx.dmp_ptr_ = shared_from_this();
+        ctx.peer_ = peer;
+        register_handlers_.dispatch(ctx);
+    }
 
-    std::shared_ptr<::pubsub::Context> ctx(regiser_ctx);
+    return poller_->add(sockfd, DefaultEvents);
+}
 
-    if (notify_ || (!notify_ && notify))
-        center_->notifySubscriber(id_, ::pubsub::DMPREGISTER, ctx);
+int Demultiplex::demultiplexListen(int sockfd)
+{
+    return poller_->add(sockfd, READABLE);
+}
 
-    struct epoll_event event;
-    event.data.fd = sockfd;
-    event.events = DefaultEvents;
+int Demultiplex::demultiplexWatch(int fd, uint32_t events)
+{
+    auto ret = poller_->add(fd, events);
+    if (ret == -1 && errno == EEXIST)
+        ret = poller_->modify(fd, events);
 
-    return ::epoll_ctl(dmpfd_, EPOLL_CTL_ADD, event.data.fd, &event);
+    return ret;
 }
 
-int Demultiplex::demultiplexModify(std::shared_ptr<::pubsub::Context> ctx, bool notify)
+int Demultiplex::demultiplexModify(context::DmpModifyContext & ctx, bool notify)
 {
-    ctx->event_type_ = ::pubsub::DMPMODIFY;
-    auto ptr = std::dynamic_pointer_cast<context::DmpModifyContext>(ctx);
+    ctx.event_type_ = ::pubsub::DMPMODIFY;
 
-    if (notify_ || (!notify_ && notify))
-        center_->notifySubscriber(id_, ::pubsub::DMPMODIFY, ctx);
+    if (notifiable(notify))
+        modify_handlers_.dispatch(ctx);
 
-    struct epoll_event event;
-    event.data.fd = ptr->fd_;
-    event.events = ptr->events_;
+    return poller_->modify(ctx.fd_, ctx.events_);
+}
 
-    return ::epoll_ctl(dmpfd_, EPOLL_CTL_MOD, ptr->fd_, &event);
+int Demultiplex::demultiplexRemove(context::DmpDeleteContext & ctx, bool notify)
+{
+    ctx.event_type_ = ::pubsub::DMPDELETE;
+    ctx.dmp_ = this;
+
+    // a later connection on the same fd starts with a clean slate
+    if (static_cast<size_t>(ctx.fd_) < is_deferred_.size())
+        is_deferred_[ctx.fd_] = false;
+
+    if (notifiable(notify))
+        delete_handlers_.dispatch(ctx);
+
+    return poller_->remove(ctx.fd_);
 }
 
-int Demultiplex::demultiplexRemove(std::shared_ptr<::pubsub::Context> ctx, bool notify)
+void Demultiplex::demultiplexWait(bool notify)
 {
-    ctx->event_type_ = ::pubsub::DMPDELETE;
-    auto ptr = std::dynamic_pointer_cast<context::DmpDeleteContext>(ctx);
+    // capacity was reserved up front, so this never allocates
+    auto & resp = wait_ctx_.resp_events_;
+    resp.clear();
+
+    if (loop_thread_.load(std::memory_order_relaxed) != std::this_thread::get_id())
+        loop_thread_.store(std::this_thread::get_id(), std::memory_order_relaxed);
+
+    // the earliest timer bounds the wait, deferred fds do not wait at all
+    auto resp_count = poller_->wait(resp, EVENT_SIZE, deferred_.empty()
+            ? timers_.timeout(TimerQueue::Clock::now()) : 0);
+    auto woken = resp_count > 0 && takeWakeup(resp);
+    if (!deferred_.empty())
+        takeDeferred(resp);
+    if (!resp.empty() && notifiable(notify))
+        wait_handlers_.dispatch(wait_ctx_);
 
-    if (notify_ || (!notify_ && notify))
-        center_->notifySubscriber(id_, ::pubsub::DMPDELETE, ctx);
+    poller_->afterDispatch();
 
-    return ::epoll_ctl(dmpfd_, EPOLL_CTL_DEL, ptr->fd_, nullptr);
+    if (woken)
+        runTasks();
+
+    timers_.expire(TimerQueue::Clock::now());
 }
 
-void Demultiplex::demultiplexWait(std::shared_ptr<::pubsub::Context> ctx, bool notify)
+bool Demultiplex::post(Task task)
 {
-    auto dmpCtx = std::dynamic_pointer_cast<context::DmpWaitContext>(ctx);
+    if (!tasks_.push(std::move(task)))
+        return false;
 
-    static const int EVENT_SIZE = 1024;
-    struct epoll_event eps[EVENT_SIZE];
+    wakeup();
 
-    auto resp_count = ::epoll_wait(dmpfd_, eps, EVENT_SIZE, -1);
-    if (resp_count <= 0)
-        return;
+    return true;
+}
+
+bool Demultiplex::runInLoop(Task task)
+{
+    if (isInLoopThread())
+    {
+        task();
+        return true;
+    }
+
+    return post(std::move(task));
+}
+
+bool Demultiplex::isInLoopThread() const noexcept
+{
+    return loop_thread_.load(std::memory_order_relaxed) == std::this_thread::get_id();
+}
+
+Demultiplex::TimerId Demultiplex::runAfter(std::chrono::milliseconds delay, Task task)
+{
+    return timers_.add(TimerQueue::Clock::now() + delay, std::move(task));
+}
+
+Demultiplex::TimerId Demultiplex::runEvery(std::chrono::milliseconds interval, Task task)
+{
+    return timers_.add(TimerQueue::Clock::now() + interval, std::move(task), interval);
+}
+
+bool Demultiplex::cancel(TimerId id)
+{
+    return timers_.cancel(id);
+}
+
+bool Demultiplex::takeWakeup(std::vector<context::DmpWaitContext::resp> & resp)
+{
+    for (size_t i = 0; i < resp.size(); i++)
+    {
+        if (resp[i].fd == wakeup_fd_)
+        {
+            resp[i] = resp.back();
+            resp.pop_back();
+            return true;
+        }
+    }
 
-    std::vector<context::DmpWaitContext::resp> resp(resp_count);
-    for (int i = 0; i < resp_count; i++)
+    return false;
+}
+
+void Demultiplex::takeDeferred(std::vector<context::DmpWaitContext::resp> & resp)
+{
+    // a readiness event covers a deferred fd, it keeps its place no
+    // longer. completions say nothing about what is left to read
+    for (auto const & r : resp)
     {
-        resp[i].fd = eps[i].data.fd;
-        resp[i].events = eps[i].events;
+        if ((r.events & (READABLE | CLOSABLE))
+                && !(r.events & (ACCEPTED | RECEIVED | SENT | SPLICED))
+                && r.fd >= 0 && static_cast<size_t>(r.fd) < is_deferred_.size())
+            is_deferred_[r.fd] = false;
     }
-    
-    dmpCtx->resp_events_ = std::move(resp);
-    if (notify_ || (!notify_ && notify))
-        center_->notifySubscriber(id_, ::pubsub::DMPWAIT, dmpCtx);
+
+    // whatever is deferred while these are handled waits for the next round,
+    // as does what does not fit into the reserved batch, in its order
+    serving_.swap(deferred_);
+    auto room = resp.capacity() - resp.size();
+    for (auto fd : serving_)
+    {
+        if (!is_deferred_[fd])
+            continue;
+        if (room == 0)
+        {
+            deferred_.push_back(fd);
+            continue;
+        }
+
+        room--;
+        is_deferred_[fd] = false;
+        context::DmpWaitContext::resp r;
+        r.fd = fd;
+        r.events = READABLE | DEFERRED;
+        r.res = 0;
+        r.data = nullptr;
+        r.buf = 0;
+        resp.push_back(r);
+    }
+    serving_.clear();
+}
+
+void Demultiplex::defer(int fd)
+{
+    if (fd < 0)
+        return;
+
+    if (static_cast<size_t>(fd) >= is_deferred_.size())
+        is_deferred_.resize(fd + 1);
+    if (is_deferred_[fd])
+        return;
+
+    is_deferred_[fd] = true;
+    deferred_.push_back(fd);
+}
+
+void Demultiplex::runTasks()
+{
+    uint64_t count;
+    while (::read(wakeup_fd_, &count, sizeof(count)) == -1 && errno == EINTR)
+        ;
+    // re-armed before draining, a task queued from here on writes again
+    wakeup_pending_.exchange(false, std::memory_order_acq_rel);
+
+    // bounded, tasks queued while running wait for the next round
+    Task task;
+    for (size_t i = 0; i < tasks_.capacity() && tasks_.pop(task); i++)
+        task();
+
+    if (!tasks_.empty())
+        wakeup();
+}
+
+void Demultiplex::wakeup()
+{
+    // one wakeup covers every task queued until the loop drains them
+    if (wakeup_pending_.exchange(true, std::memory_order_acq_rel))
+        return;
+
+    uint64_t one = 1;
+    while (::write(wakeup_fd_, &one, sizeof(one)) == -1 && errno == EINTR)
+        ;
+}
+
+int Demultiplex::acceptMultishot(int fd)
+{
+    return poller_->acceptMultishot(fd);
+}
+
+int Demultiplex::recvMultishot(int fd)
+{
+    return poller_->recvMultishot(fd);
+}
+
+int Demultiplex::sendReceived(int fd, context::DmpWaitContext::resp const & received)
+{
+    return poller_->sendReceived(fd, received);
+}
+
+int Demultiplex::spliceLinked(int in_fd, int out_fd, int pipe_r, int pipe_w, size_t len)
+{
+    return poller_->spliceLinked(in_fd, out_fd, pipe_r, pipe_w, len);
 }
 
-} // namespace reactor
\ No newline at end of file
+} // namespace reactor
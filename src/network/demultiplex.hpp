@@ -3,7 +3,19 @@
 #include <stddef.h>
 #include <sys/epoll.h>
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "dispatcher.hpp"
+#include "nw_ctx.hpp"
+#include "poller.hpp"
 #include "pub_sub.hpp"
+#include "queue.hpp"
+#include "timer_queue.hpp"
 
 namespace reactor {
 
@@ -18,11 +30,52 @@ public:
         CLOSABLE = EPOLLERR | EPOLLHUP | EPOLLRDHUP
     };
 
-    static const size_t MAX_SIZE = 1024;
+    // completions reported by the io_uring backend, `res` carries the result
+    enum CompletionT : uint32_t
+    {
+        ACCEPTED = 1u << 24,    // res is the accepted fd
+        RECEIVED = 1u << 25,    // res bytes at `data`
+        SENT     = 1u << 26,
+        SPLICED  = 1u << 27,
+        // with READABLE: reported again by defer(), no new edge came
+        DEFERRED = 1u << 28
+    };
+
+    /**
+     * @brief what one readiness event of a connection may read before
+     * the others on the loop get their turn. edge-triggered, so whoever
+     * stops at it has to defer() the fd, nothing else reports it again.
+     */
+    struct ReadBudget
+    {
+        ReadBudget()
+            : bytes_(256 * 1024)
+            , reads_(16)
+        {}
+
+        size_t  bytes_;
+        size_t  reads_;     // read/splice calls
+    };
+
+    enum Backend
+    {
+        EPOLL,
+        URING
+    };
+
+    using Task = std::function<void()>;
+    using TimerId = TimerQueue::TimerId;
+
+    static const int EVENT_SIZE = 1024;
+    static const size_t TASK_QUEUE_SIZE = 4096;
     static const uint32_t DefaultEvents = READABLE | CLOSABLE | EPOLLET;
 
 public:
-    Demultiplex();
+    /**
+     * @brief io_uring falls back to epoll when the kernel can not provide
+     * it, backend() tells which one is in use.
+     */
+    explicit Demultiplex(Backend backend = defaultBackend());
     Demultiplex(const Demultiplex &) = delete;
     Demultiplex & operator=(const Demultiplex &) = delete;
     Demultiplex(Demultiplex && demultiplex) = delete;
@@ -38,19 +91,160 @@ public:
 
     std::shared_ptr<::pubsub::PubSubCenter> center() noexcept;
 
+    Backend backend() const noexcept { return backend_; }
+
+    /**
+     * @brief backend picked by RPROXY_BACKEND=epoll|uring, epoll if unset.
+     */
+    static Backend defaultBackend();
+
+    /**
+     * @brief typed handler table for the given context type, e.g.
+     * dmp->handlers<context::DmpWaitContext>().attach(this);
+     */
+    template<typename Ctx>
+    ::pubsub::Dispatcher<Ctx> & handlers() noexcept;
+
+    // sockfd has to be nonblocking already, accept4() and connect paths do it
     int demultiplexRegister(int sockfd, bool notify = false);
 
-    int demultiplexModify(std::shared_ptr<::pubsub::Context> ctx, bool notify = false);
+    // peer is handed to the register handlers, they need not look it up
+    int demultiplexRegister(int sockfd, InetAddr const & peer, bool notify = false);
+
+    /**
+     * @brief watch a listening socket, level-triggered and without the
+     * register handlers, which would take it for a connection.
+     */
+    int demultiplexListen(int sockfd);
+
+    /**
+     * @brief watch fd for `events` only, again without the register
+     * handlers. an fd another loop owns may be watched too, e.g. for
+     * WRITABLE | EPOLLET to resume a transfer stalled on it.
+     */
+    int demultiplexWatch(int fd, uint32_t events);
+
+    int demultiplexModify(context::DmpModifyContext & ctx, bool notify = false);
+
+    int demultiplexRemove(context::DmpDeleteContext & ctx, bool notify = false);
+
+    void demultiplexWait(bool notify = false);
+
+    /**
+     * @brief hand task over to the thread running demultiplexWait(), it
+     * runs after the current batch of events. safe from any thread,
+     * false when the queue is full.
+     */
+    bool post(Task task);
+
+    // runs task right away on the loop thread, otherwise post()s it
+    bool runInLoop(Task task);
+
+    bool isInLoopThread() const noexcept;
+
+    // a thread has waited on it, so what is posted now gets run
+    bool started() const noexcept { return loop_thread_.load(std::memory_order_relaxed) != std::thread::id(); }
 
-    int demultiplexRemove(std::shared_ptr<::pubsub::Context> ctx, bool notify = false);
+    /**
+     * @brief run task once on the loop thread after delay. loop thread
+     * only, runInLoop() it from elsewhere.
+     */
+    TimerId runAfter(std::chrono::milliseconds delay, Task task);
 
-    void demultiplexWait(std::shared_ptr<::pubsub::Context> ctx, bool notify = false);
+    // run task every interval from now on until cancel(), loop thread only
+    TimerId runEvery(std::chrono::milliseconds interval, Task task);
+
+    // false if the timer already ran or was cancelled
+    bool cancel(TimerId id);
+
+    // loop thread only, runInLoop() it from elsewhere once the loop runs
+    void setReadBudget(ReadBudget const & budget) noexcept { budget_ = budget; }
+
+    ReadBudget const & readBudget() const noexcept { return budget_; }
+
+    /**
+     * @brief fd ran out of its budget with data still waiting. the next
+     * round reports it READABLE | DEFERRED without blocking, after the
+     * fds deferred before it, unless a real event for it comes first.
+     * loop thread only.
+     */
+    void defer(int fd);
+
+    /**
+     * @brief completion-based operations, io_uring only. they fail with
+     * ENOTSUP on epoll, so callers keep their readiness path for it.
+     */
+    // ACCEPTED for every incoming connection on listening fd
+    int acceptMultishot(int fd);
+
+    // RECEIVED for every chunk read from fd, the payload is valid until
+    // the wait handlers return unless it is passed to sendReceived()
+    int recvMultishot(int fd);
+
+    // send a RECEIVED payload to fd, SENT reports the result
+    int sendReceived(int fd, context::DmpWaitContext::resp const & received);
+
+    // in_fd -> pipe -> out_fd as one linked submission, SPLICED reports
+    // the bytes that reached out_fd on in_fd. a short read still goes
+    // out, a full out_fd is waited for, an empty in_fd ends it with
+    // nothing moved.
+    int spliceLinked(int in_fd, int out_fd, int pipe_r, int pipe_w, size_t len);
+
+private:
+    bool notifiable(bool notify) const noexcept { return notify_ || notify; }
+
+    // drops the wakeup event from the batch, true if it was there
+    bool takeWakeup(std::vector<context::DmpWaitContext::resp> & resp);
+
+    // appends the deferred fds the batch does not report already, as
+    // many as the batch has room for
+    void takeDeferred(std::vector<context::DmpWaitContext::resp> & resp);
+
+    void runTasks();
+
+    void wakeup();
 
 private:
     uint16_t                                id_;
-    int                                     dmpfd_;
+    Backend                                 backend_;
+    std::unique_ptr<Poller>                 poller_;
     bool                                    notify_;
     std::shared_ptr<::pubsub::PubSubCenter> center_;
+
+    context::DmpWaitContext                 wait_ctx_;
+
+    int                                     wakeup_fd_;
+    std::atomic<bool>                       wakeup_pending_;
+    std::atomic<std::thread::id>            loop_thread_;
+    queue::LockFreeQueue<Task>              tasks_;
+    TimerQueue                              timers_;
+
+    ReadBudget                              budget_;
+    // served in order, the flag by fd tells which are still due
+    std::vector<int>                        deferred_;
+    std::vector<int>                        serving_;
+    std::vector<bool>                       is_deferred_;
+
+    ::pubsub::Dispatcher<context::DmpRegisterContext>   register_handlers_;
+    ::pubsub::Dispatcher<context::DmpModifyContext>     modify_handlers_;
+    ::pubsub::Dispatcher<context::DmpDeleteContext>     delete_handlers_;
+    ::pubsub::Dispatcher<context::DmpWaitContext>       wait_handlers_;
 };
 
-} // namespace reactor end
\ No newline at end of file
+template<>
+inline ::pubsub::Dispatcher<context::DmpRegisterContext> &
+Demultiplex::handlers<context::DmpRegisterContext>() noexcept { return register_handlers_; }
+
+template<>
+inline ::pubsub::Dispatcher<context::DmpModifyContext> &
+Demultiplex::handlers<context::DmpModifyContext>() noexcept { return modify_handlers_; }
+
+template<>
+inline ::pubsub::Dispatcher<context::DmpDeleteContext> &
+Demultiplex::handlers<context::DmpDeleteContext>() noexcept { return delete_handlers_; }
+
+template<>
+inline ::pubsub::Dispatcher<context::DmpWaitContext> &
+Demultiplex::handlers<context::DmpWaitContext>() noexcept { return wait_handlers_; }
+
+} // namespace reactor end
@@ -0,0 +1,90 @@
+#include <errno.h>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "epoll_poller.hpp"
+
+namespace reactor {
+
+int Poller::acceptMultishot(int)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+int Poller::recvMultishot(int)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+int Poller::sendReceived(int, Resp const &)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+int Poller::spliceLinked(int, int, int, int, size_t)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+EpollPoller::EpollPoller()
+    : epfd_(-1)
+    , events_()
+{
+    if ((epfd_ = ::epoll_create(MAX_SIZE)) < 0)
+        throw std::runtime_error("can not create epoll instance");
+}
+
+EpollPoller::~EpollPoller()
+{
+    if (epfd_ != -1)
+        ::close(epfd_);
+}
+
+int EpollPoller::add(int fd, uint32_t events)
+{
+    struct epoll_event event;
+    event.data.fd = fd;
+    event.events = events;
+
+    return ::epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &event);
+}
+
+int EpollPoller::modify(int fd, uint32_t events)
+{
+    struct epoll_event event;
+    event.data.fd = fd;
+    event.events = events;
+
+    return ::epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &event);
+}
+
+int EpollPoller::remove(int fd)
+{
+    return ::epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int EpollPoller::wait(std::vector<Resp> & resp, int max, int timeout)
+{
+    if (events_.size() < static_cast<size_t>(max))
+        events_.resize(max);
+
+    auto resp_count = ::epoll_wait(epfd_, events_.data(), max, timeout);
+    for (int i = 0; i < resp_count; i++)
+    {
+        Resp r;
+        r.fd = events_[i].data.fd;
+        r.events = events_[i].events;
+        r.res = 0;
+        r.data = nullptr;
+        r.buf = 0;
+        resp.push_back(r);
+    }
+
+    return resp_count;
+}
+
+} // namespace reactor
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <sys/epoll.h>
+
+#include "poller.hpp"
+
+namespace reactor {
+
+class EpollPoller : public Poller
+{
+public:
+    static const size_t MAX_SIZE = 1024;
+
+public:
+    EpollPoller();
+    ~EpollPoller();
+
+    int add(int fd, uint32_t events) override;
+
+    int modify(int fd, uint32_t events) override;
+
+    int remove(int fd) override;
+
+    int wait(std::vector<Resp> & resp, int max, int timeout) override;
+
+private:
+    int                             epfd_;
+    // reused by every epoll_wait(), never reallocated
+    std::vector<struct epoll_event> events_;
+};
+
+} // namespace reactor
@@ -1,36 +1,75 @@
+#include <unistd.h>
+
+#ifdef Debug
+#   include <iostream>
+#endif
+
 #include "eventloop.hpp"
 #include "nw_ctx.hpp"
 
 namespace reactor {
 
-EventLoop::EventLoop(std::shared_ptr<Acceptor> acceptor, int subloop)
+EventLoop::EventLoop(std::shared_ptr<Acceptor> acceptor, int subloop,
+        Demultiplex::Backend backend)
+    : EventLoop(acceptor, [&]() {
+            LoopOptions options;
+            options.subloop_ = subloop;
+            options.backend_ = backend;
+            return options;
+        }())
+{}
+
+EventLoop::EventLoop(std::shared_ptr<Acceptor> acceptor, LoopOptions const & options)
     : stop_(false)
     // , dmp_ptr_(std::make_shared<Demultiplex>())
     , loop_group_()
     , acceptor_(acceptor)
+    , accept_dmp_()
+    , listeners_()
+    , reuse_fds_()
+    , limiter_(options.limiter_)
+    , pin_cpu_(options.pin_cpu_)
 {
     // dmp_ptr_->center()->unRegisterPub(dmp_ptr_->id());
     // dmp_ptr_->demultiplexRegister(acceptor_->server());
-    loop_group_.init(subloop);
+    // the loops run from loop() on, whoever owns us attaches first
+    loop_group_.create(options.subloop_, options.backend_);
+    for (auto & dmp : loop_group_.dmp())
+        dmp->setReadBudget(options.read_budget_);
+
+    if (options.reuse_port_)
+        listenInLoops(options.backlog_);
+    else
+    {
+        accept_dmp_ = std::make_shared<Demultiplex>(options.backend_);
+        accept_dmp_->enableNotify(false);
+        listeners_[accept_dmp_.get()].acceptor_ = acceptor_;
+        listen(*accept_dmp_, acceptor_);
+    }
 }
     
 EventLoop::~EventLoop()
 {
     stop_ = true;
     loop_group_.joinAll();
+
+    for (auto fd : reuse_fds_)
+        ::close(fd);
 }
 
 void EventLoop::loop()
 {
-    while (!stop_)
-    {
-        try {
-            int fd = acceptor_->accept();
-            loop_group_.registerFd(fd);
-        } catch (std::exception & e) {
+    loop_group_.start(pin_cpu_);
 
-        }
+    // the sub-reactors accept by themselves
+    if (!accept_dmp_)
+    {
+        loop_group_.joinAll();
+        return;
     }
+
+    while (!stop_)
+        accept_dmp_->demultiplexWait(true);
 }
 
 void EventLoop::stop()
@@ -49,4 +88,97 @@ std::vector<std::shared_ptr<Demultiplex>> EventLoop::dmpForLoopGroup() noexcept
     return loop_group_.dmp();
 }
 
-} // namespace reactor
\ No newline at end of file
+void EventLoop::handle(context::DmpWaitContext & ctx)
+{
+    auto iter = listeners_.find(ctx.dmp_);
+    if (iter == listeners_.end())
+        return;
+
+    auto & listener = iter->second;
+    auto & accepted = listener.accepted_;
+    accepted.clear();
+    for (auto const & resp : ctx.resp_events_)
+    {
+        if (resp.events & Demultiplex::ACCEPTED)
+        {
+            // a multishot accept has nowhere to put the peer, it is
+            // looked up once here
+            if (resp.res >= 0)
+                accepted.emplace_back(resp.res, StreamSocket::getPeerAddr(resp.res));
+        }
+        else if (resp.fd == listener.acceptor_->server()
+                && (resp.events & Demultiplex::READABLE))
+        {
+            // drain the whole backlog, the socket is level-triggered
+            // so whatever is left over wakes the loop up again
+            while (listener.acceptor_->acceptBatch(accepted) == Acceptor::ACCEPT_BATCH)
+                ;
+        }
+    }
+
+    admit(accepted);
+    if (ctx.dmp_ == accept_dmp_.get())
+        loop_group_.registerBatch(accepted);
+    else
+    {
+        // SO_REUSEPORT mode, connections stay on the loop that accepted them
+        for (auto const & conn : accepted)
+            ctx.dmp_->demultiplexRegister(conn.fd_, conn.peer_);
+    }
+}
+
+void EventLoop::listen(Demultiplex & dmp, std::shared_ptr<Acceptor> acceptor)
+{
+    dmp.handlers<context::DmpWaitContext>().attach(this);
+
+    if (dmp.backend() == Demultiplex::URING
+            && dmp.acceptMultishot(acceptor->server()) == 0)
+        return;
+
+    StreamSocket::setNonBlocking(acceptor->server());
+    dmp.demultiplexListen(acceptor->server());
+}
+
+void EventLoop::listenInLoops(int backlog)
+{
+    auto const & dmpes = loop_group_.dmp();
+    for (size_t i = 0; i < dmpes.size(); i++)
+    {
+        auto acceptor = acceptor_;
+        if (i > 0)
+        {
+            int fd = StreamSocket::reuseListener(acceptor_->server(), backlog);
+            if (fd < 0)
+                throw std::runtime_error("can not open SO_REUSEPORT listener");
+            reuse_fds_.push_back(fd);
+            acceptor = std::make_shared<Acceptor>(fd, backlog);
+        }
+        listeners_[dmpes[i].get()].acceptor_ = acceptor;
+    }
+
+    // the table is complete before any loop runs and looks into it
+    for (auto & dmp : dmpes)
+        listen(*dmp, listeners_.at(dmp.get()).acceptor_);
+#ifdef Debug
+    std::cout << "SO_REUSEPORT listeners: " << dmpes.size() << "\n";
+#endif
+}
+
+void EventLoop::admit(std::vector<Acceptor::Accepted> & accepted)
+{
+    if (!limiter_)
+        return;
+
+    size_t kept = 0;
+    for (auto & conn : accepted)
+    {
+        if (conn.peer_.valid() ? limiter_->admit(limiter_->keyOf(conn.peer_.sockAddr()))
+                : limiter_->admit(limiter_->keyOf(conn.fd_)))
+            accepted[kept++] = std::move(conn);
+        else
+            ::close(conn.fd_);
+    }
+    accepted.erase(accepted.begin() + kept, accepted.end());
+}
+
+} // namespace reactor
@@ -2,20 +2,59 @@
 
 #include "acceptor.hpp"
 // #include "demultiplex.hpp"
+#include "dispatcher.hpp"
 #include "group.hpp"
+#include "nw_ctx.hpp"
+#include "rate_limiter.hpp"
 
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
 namespace reactor {
 
-class EventLoop
+struct LoopOptions
+{
+    LoopOptions()
+        : subloop_(1)
+        , backend_(Demultiplex::defaultBackend())
+        , reuse_port_(false)
+        , pin_cpu_(false)
+        , backlog_(SOMAXCONN)
+        , limiter_()
+        , read_budget_()
+    {}
+
+    int                     subloop_;
+    Demultiplex::Backend    backend_;
+    // every sub-reactor listens on its own SO_REUSEPORT socket and
+    // accepts in its own loop, instead of one blocking accept thread
+    bool                    reuse_port_;
+    // pin sub-reactor i to cpu i % ncpu
+    bool                    pin_cpu_;
+    // listen() backlog of every listening socket
+    int                     backlog_;
+    // connections of a client over its rate are closed right after
+    // accept, none if null. shared with whoever limits its bytes
+    std::shared_ptr<RateLimiter> limiter_;
+    // what a connection reads per event on a sub-reactor
+    Demultiplex::ReadBudget read_budget_;
+};
+
+class EventLoop : public ::pubsub::Handler<context::DmpWaitContext>
 {
 public:
     using SocketFd = int;
 
 public:
-    EventLoop(std::shared_ptr<Acceptor> acceptor, int subloop = 1);
+    EventLoop(std::shared_ptr<Acceptor> acceptor, int subloop = 1,
+            Demultiplex::Backend backend = Demultiplex::defaultBackend());
+    /**
+     * @brief with options.reuse_port_ the acceptor's socket has to be
+     * bound with SO_REUSEPORT, it serves the first sub-reactor and the
+     * others open their own sockets on the same address.
+     */
+    EventLoop(std::shared_ptr<Acceptor> acceptor, LoopOptions const & options);
     EventLoop(const EventLoop &) = delete;
     EventLoop(EventLoop &&) = delete;
     EventLoop & operator=(const EventLoop &) = delete;
@@ -23,6 +62,7 @@ public:
     ~EventLoop();
 
 public:
+    // starts the sub-reactors, handlers are attached to them before
     void loop();
 
     void stop();
@@ -31,12 +71,41 @@ public:
 
     std::vector<std::shared_ptr<Demultiplex>> dmpForLoopGroup() noexcept;
 
+    std::shared_ptr<RateLimiter> limiter() const noexcept { return limiter_; }
+
+    // readiness of a listening socket, or connections io_uring accepted
+    virtual void handle(context::DmpWaitContext & ctx) override;
+
+private:
+    struct Listener
+    {
+        std::shared_ptr<Acceptor>   acceptor_;
+        // reused by every drain of the backlog
+        std::vector<Acceptor::Accepted> accepted_;
+    };
+
+private:
+    void listen(Demultiplex & dmp, std::shared_ptr<Acceptor> acceptor);
+
+    void listenInLoops(int backlog);
+
+    // closes what the limiter turns away
+    void admit(std::vector<Acceptor::Accepted> & accepted);
+
 private:
     std::atomic_bool            stop_;
     // std::shared_ptr<Demultiplex> dmp_ptr_;
     LoopThreadGroup             loop_group_;
     std::shared_ptr<Acceptor>   acceptor_;
+    // watches the acceptor when the sub-reactors do not accept themselves
+    std::shared_ptr<Demultiplex> accept_dmp_;
+    // the listening socket each loop accepts on, filled before any loop looks
+    std::unordered_map<Demultiplex *, Listener> listeners_;
+    // SO_REUSEPORT sockets opened for the sub-reactors
+    std::vector<int>            reuse_fds_;
+    std::shared_ptr<RateLimiter> limiter_;
+    bool                        pin_cpu_;
     std::mutex                  mx_;
 };
 
-} // namespace reactor
\ No newline at end of file
+} // namespace reactor
@@ -1,11 +1,20 @@
 #pragma once
 
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <atomic>
 #include <cassert>
 #include <functional>
 #include <memory>
-#include <mutex>
 #include <thread>
 
+#ifdef Debug
+#   include <iostream>
+#endif
+
+#include "acceptor.hpp"
 #include "nw_ctx.hpp"
 #include "demultiplex.hpp"
 
@@ -19,7 +28,7 @@ public:
         , dmpes_()
         , threads_()
         , notify_(notify)
-        , iter_()
+        , next_(0)
     {}
     LoopThreadGroup(const LoopThreadGroup &) = delete;
     LoopThreadGroup(LoopThreadGroup &&) = delete;
@@ -31,15 +40,39 @@ public:
         joinAll();
     }
 
-    void init(int n)
+    /**
+     * @brief n loops that do not run yet. handlers are attached to them
+     * before start(), the dispatchers are not locked.
+     */
+    void create(int n, Demultiplex::Backend backend = Demultiplex::defaultBackend())
     {
         assert(n >= 1);
         for (int i = 0; i < n; i++)
+            dmpes_.emplace_back(std::make_shared<Demultiplex>(backend));
+    }
+
+    /**
+     * @brief a thread per loop, once. with pin_cpu loop i only runs on
+     * cpu i % ncpu, so its connections stay in that core's caches.
+     */
+    void start(bool pin_cpu = false)
+    {
+        if (!threads_.empty())
+            return;
+
+        auto ncpu = std::thread::hardware_concurrency();
+        for (size_t i = 0; i < dmpes_.size(); i++)
         {
-            dmpes_.emplace_back(std::make_shared<Demultiplex>());
             threads_.emplace_back(std::bind(&LoopThreadGroup::run, this, dmpes_[i]));
+
+            if (pin_cpu && ncpu > 0)
+            {
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(i % ncpu, &cpus);
+                ::pthread_setaffinity_np(threads_.back().native_handle(), sizeof(cpus), &cpus);
+            }
         }
-        iter_ = dmpes_.begin();
     }
 
     std::vector<std::shared_ptr<Demultiplex>> dmp()
@@ -47,16 +80,45 @@ public:
         return dmpes_;
     }
 
-    void registerFd(int fd)
+    /**
+     * @brief hand fd to the next loop, which registers it on its own
+     * thread. returns that loop, tasks it is posted afterwards run after
+     * the registration.
+     */
+    std::shared_ptr<Demultiplex> registerFd(int fd)
     {
-        auto i = iter_;
-        {
-            std::lock_guard<std::mutex> guard(mx_ );
-            i = iter_++;
-            if (iter_._M_is_end())
-                iter_ = dmpes_.begin();
-        }
-        (*i)->demultiplexRegister(fd);
+        auto & dmp = dmpes_[reserve(1)];
+        handOver(*dmp, fd);
+
+        return dmp;
+    }
+
+    // claim the loop the next registerFd() would have picked
+    std::shared_ptr<Demultiplex> next()
+    {
+        return dmpes_[reserve(1)];
+    }
+
+    // hand fd to `dmp`, one of this group's loops, with the peer if known
+    void registerFd(int fd, Demultiplex & dmp, InetAddr const & peer = InetAddr())
+    {
+        handOver(dmp, fd, peer);
+    }
+
+    /**
+     * @brief spread a batch of accepted connections round-robin over the
+     * loops, the position is claimed once for the whole batch and every
+     * loop is woken at most once for it.
+     */
+    void registerBatch(std::vector<Acceptor::Accepted> const & accepted)
+    {
+        if (accepted.empty())
+            return;
+
+        auto first = reserve(accepted.size());
+        for (size_t i = 0; i < accepted.size(); i++)
+            handOver(*dmpes_[(first + i) % dmpes_.size()],
+                    accepted[i].fd_, accepted[i].peer_);
     }
 
     void joinAll()
@@ -71,15 +133,36 @@ public:
     void stop()
     {
         stop_.store(true, std::memory_order_release);
+        // loops blocked in wait() only see the flag once woken
+        for (auto & dmp : dmpes_)
+            dmp->post([] {});
     }
 
 private:
+    // claim n consecutive round-robin slots, returns the first one
+    size_t reserve(size_t n)
+    {
+        return next_.fetch_add(n, std::memory_order_relaxed) % dmpes_.size();
+    }
+
+    void handOver(Demultiplex & dmp, int fd, InetAddr const & peer = InetAddr())
+    {
+        Demultiplex * loop = &dmp;
+        if (dmp.runInLoop([loop, fd, peer] { loop->demultiplexRegister(fd, peer); }))
+            return;
+
+        // the loop is too far behind to take more connections
+#ifdef Debug
+        std::cout << "loop " << dmp.pubID() << " backlogged, dropping fd " << fd << "\n";
+#endif
+        ::close(fd);
+    }
+
     void run(std::shared_ptr<Demultiplex> dmp)
     {
-        std::shared_ptr<::pubsub::Context> ctx = std::make_shared<context::DmpWaitContext>(::pubsub::DMPWAIT);
         while (!stop_.load(std::memory_order_relaxed))
         {
-            dmp->demultiplexWait(ctx, notify_);
+            dmp->demultiplexWait(notify_);
         }
     }
 
@@ -87,10 +170,8 @@ private:
     std::atomic_bool                                stop_;
     std::vector<std::shared_ptr<Demultiplex>>       dmpes_;
     std::vector<std::thread>                        threads_;
-    std::mutex                                      mx_;
     bool                                            notify_;
-    std::vector<std::shared_ptr<Demultiplex>>
-                                        ::iterator  iter_;
+    std::atomic<size_t>                             next_;
 };
 
 } // namespace reactor
\ No newline at end of file
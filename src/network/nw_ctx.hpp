@@ -1,6 +1,7 @@
 #pragma once
 
 #include "context.hpp"
+#include "stream_socket.hpp"
 
 #include <cstdint>
 #include <memory>
@@ -27,11 +28,14 @@ struct DmpRegisterContext : ::pubsub::Context
         , fd_(-1)
         , events_()
         , dmp_ptr_()
+        , peer_()
     {}
     
     int                     fd_;
     uint32_t                events_;
     std::shared_ptr<Demultiplex> dmp_ptr_;
+    // as accepted or connected to, unspecified if it is not known
+    InetAddr                peer_;
 };
 
 struct DmpModifyContext : ::pubsub::Context
@@ -51,15 +55,19 @@ struct DmpDeleteContext : ::pubsub::Context
     DmpDeleteContext(uint16_t event)
         : Context(event)
         , fd_(-1)
+        , dmp_(nullptr)
     {}
 
     int fd_;
+    // the loop the fd leaves, set by demultiplexRemove()
+    Demultiplex * dmp_;
 };
 
 struct DmpWaitContext : ::pubsub::Context
 {
     DmpWaitContext(uint16_t event)
         : Context(event)
+        , dmp_(nullptr)
         , resp_events_()
     {}
 
@@ -67,7 +75,13 @@ struct DmpWaitContext : ::pubsub::Context
     {
         int fd;
         uint32_t events;
+        // set by completion-based backends only
+        int32_t res;            // bytes moved, accepted fd or -errno
+        char const * data;      // payload of a RECEIVED completion
+        uint32_t buf;           // provided buffer holding `data`
     };
+    // the loop that produced the batch
+    Demultiplex *     dmp_;
     std::vector<resp> resp_events_;
 };
 
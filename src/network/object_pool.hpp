@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace reactor {
+
+struct PoolStats
+{
+    PoolStats()
+        : hits_(0)
+        , misses_(0)
+        , in_use_(0)
+    {}
+
+    PoolStats & operator+=(PoolStats const & other)
+    {
+        hits_   += other.hits_;
+        misses_ += other.misses_;
+        in_use_ += other.in_use_;
+        return *this;
+    }
+
+    double hitRate() const noexcept
+    {
+        auto total = hits_ + misses_;
+        return total == 0 ? 0.0 : static_cast<double>(hits_) / total;
+    }
+
+    size_t hits_;       // served from the freelist
+    size_t misses_;     // served from fresh slab memory
+    size_t in_use_;
+};
+
+/**
+ * @brief slab allocator for objects of one type. memory is carved out
+ * of slabs of `slab_size` objects and recycled through an intrusive
+ * freelist, so steady-state acquire/release never touches malloc.
+ * objects are constructed on acquire() and destroyed on release().
+ * not thread-safe.
+ */
+template<typename T>
+class ObjectPool
+{
+public:
+    explicit ObjectPool(size_t slab_size = 64)
+        : slab_size_(slab_size == 0 ? 1 : slab_size)
+        , cursor_(0)
+        , free_(nullptr)
+        , slabs_()
+        , stats_()
+    {}
+    ObjectPool(const ObjectPool &) = delete;
+    ObjectPool & operator=(const ObjectPool &) = delete;
+    ~ObjectPool() = default;
+
+    template<typename... Args>
+    T * acquire(Args && ...args)
+    {
+        void * mem = allocate();
+        try {
+            return ::new (mem) T(std::forward<Args>(args)...);
+        } catch (...) {
+            deallocate(mem);
+            throw;
+        }
+    }
+
+    void release(T * obj)
+    {
+        if (!obj)
+            return;
+
+        obj->~T();
+        deallocate(obj);
+    }
+
+    PoolStats stats() const noexcept { return stats_; }
+
+private:
+    /**
+     * @brief raw storage for one object, acquire() constructs it.
+     */
+    void * allocate()
+    {
+        Node * node = free_;
+        if (node)
+        {
+            free_ = node->next_;
+            stats_.hits_++;
+        }
+        else
+        {
+            if (slabs_.empty() || cursor_ == slab_size_)
+            {
+                slabs_.emplace_back(new Node[slab_size_]);
+                cursor_ = 0;
+            }
+            node = &slabs_.back()[cursor_++];
+            stats_.misses_++;
+        }
+        stats_.in_use_++;
+
+        return static_cast<void *>(&node->storage_);
+    }
+
+    /**
+     * @brief give back storage whose object was destroyed or never built.
+     */
+    void deallocate(void * ptr)
+    {
+        if (!ptr)
+            return;
+
+        Node * node = static_cast<Node *>(ptr);
+        node->next_ = free_;
+        free_ = node;
+        stats_.in_use_--;
+    }
+
+private:
+    union Node
+    {
+        Node *                                                          next_;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type     storage_;
+    };
+
+private:
+    size_t                                  slab_size_;
+    size_t                                  cursor_;
+    Node *                                  free_;
+    std::vector<std::unique_ptr<Node[]>>    slabs_;
+    PoolStats                               stats_;
+};
+
+} // namespace reactor
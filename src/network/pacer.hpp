@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace reactor {
+
+/**
+ * @brief the write budget of one connection: rate bytes a second, burst
+ * of them at once. kept as the time the bytes written so far are paid
+ * off at, like RateLimiter's buckets. only the loop writing the
+ * connection touches it, there is no lock.
+ */
+class Pacer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+public:
+    // never holds anything back
+    Pacer()
+        : rate_(0)
+        , tolerance_(0)
+        , paid_()
+    {}
+
+    Pacer(uint64_t rate, uint64_t burst)
+        : rate_(rate)
+        , tolerance_(rate > 0 ? static_cast<Clock::rep>(
+                    std::chrono::duration_cast<Clock::duration>(std::chrono::seconds(1)).count()
+                    * (static_cast<double>(burst) / rate)) : 0)
+        , paid_()
+    {}
+
+    bool enabled() const noexcept { return rate_ > 0; }
+
+    void charge(size_t bytes, Clock::time_point now) noexcept
+    {
+        if (rate_ == 0 || bytes == 0)
+            return;
+
+        auto cost = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(static_cast<double>(bytes) / rate_));
+        paid_ = std::max(paid_, now) + cost;
+    }
+
+    // how long writing has to wait, zero if it may go on
+    Clock::duration wait(Clock::time_point now) const noexcept
+    {
+        auto ahead = paid_ - now - tolerance_;
+        return ahead > Clock::duration::zero() ? ahead : Clock::duration::zero();
+    }
+
+private:
+    uint64_t            rate_;
+    Clock::duration     tolerance_;
+    Clock::time_point   paid_;
+};
+
+} // namespace reactor
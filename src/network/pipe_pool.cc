@@ -0,0 +1,99 @@
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "pipe_pool.hpp"
+
+namespace reactor {
+
+PipePool::PipePool(size_t prealloc, size_t pipe_size, size_t max_idle)
+    : mx_()
+    , free_()
+    , pipe_size_(pipe_size)
+    , max_idle_(max_idle)
+{
+    free_.reserve(prealloc);
+    for (size_t i = 0; i < prealloc; i++)
+    {
+        Pipe pipe;
+        if (!open(pipe))
+            break;
+        free_.push_back(pipe);
+    }
+}
+
+PipePool::~PipePool()
+{
+    for (auto & pipe : free_)
+        close(pipe);
+}
+
+bool PipePool::acquire(Pipe & pipe)
+{
+    {
+        std::lock_guard<std::mutex> guard(mx_);
+        if (!free_.empty())
+        {
+            pipe = free_.back();
+            free_.pop_back();
+            return true;
+        }
+    }
+
+    return open(pipe);
+}
+
+void PipePool::release(Pipe & pipe, bool reuse)
+{
+    if (!pipe.valid())
+        return;
+
+    int left = 0;
+    if (reuse && pipe.pending_ == 0
+            && ::ioctl(pipe.r_, FIONREAD, &left) == 0 && left == 0)
+    {
+        std::lock_guard<std::mutex> guard(mx_);
+        if (free_.size() < max_idle_)
+        {
+            free_.push_back(pipe);
+            pipe = Pipe();
+            return;
+        }
+    }
+
+    close(pipe);
+    pipe = Pipe();
+}
+
+size_t PipePool::idle()
+{
+    std::lock_guard<std::mutex> guard(mx_);
+    return free_.size();
+}
+
+bool PipePool::open(Pipe & pipe)
+{
+    int fds[2];
+    if (::pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1)
+        return false;
+
+    pipe.r_ = fds[0];
+    pipe.w_ = fds[1];
+    pipe.pending_ = 0;
+
+    // may be refused above fs.pipe-max-size or the per-user pipe
+    // budget, the pipe then keeps its default size
+    ::fcntl(pipe.w_, F_SETPIPE_SZ, static_cast<int>(pipe_size_));
+    auto size = ::fcntl(pipe.w_, F_GETPIPE_SZ);
+    pipe.size_ = size > 0 ? static_cast<size_t>(size) : 0;
+
+    return true;
+}
+
+void PipePool::close(Pipe & pipe) noexcept
+{
+    ::close(pipe.r_);
+    ::close(pipe.w_);
+}
+
+} // namespace reactor
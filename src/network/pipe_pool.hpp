@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace reactor {
+
+struct Pipe
+{
+    Pipe()
+        : r_(-1)
+        , w_(-1)
+        , size_(0)
+        , pending_(0)
+    {}
+
+    bool valid() const noexcept { return r_ != -1; }
+
+    int     r_;
+    int     w_;
+    size_t  size_;      // capacity granted by the kernel
+    size_t  pending_;   // spliced in, not spliced out yet
+};
+
+/**
+ * @brief nonblocking pipes for splice(), created up front and resized
+ * with F_SETPIPE_SZ so one splice moves more than the 64K default.
+ * a pipe that comes back empty is parked for the next user, one that
+ * still holds bytes is closed.
+ */
+class PipePool
+{
+public:
+    static const size_t PIPE_SIZE   = 256 * 1024;
+    static const size_t PREALLOC    = 16;
+    static const size_t MAX_IDLE    = 256;
+
+public:
+    PipePool(size_t prealloc = PREALLOC, size_t pipe_size = PIPE_SIZE,
+            size_t max_idle = MAX_IDLE);
+    PipePool(const PipePool &) = delete;
+    PipePool & operator=(const PipePool &) = delete;
+    ~PipePool();
+
+    // false if no pipe could be opened
+    bool acquire(Pipe & pipe);
+
+    /**
+     * @brief `pipe` is invalid afterwards. reuse = false closes it, for
+     * pipes an asynchronous splice may still write to.
+     */
+    void release(Pipe & pipe, bool reuse = true);
+
+    size_t idle();
+
+private:
+    bool open(Pipe & pipe);
+
+    static void close(Pipe & pipe) noexcept;
+
+private:
+    std::mutex          mx_;
+    std::vector<Pipe>   free_;
+    size_t              pipe_size_;
+    size_t              max_idle_;
+};
+
+} // namespace reactor
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "nw_ctx.hpp"
+
+namespace reactor {
+
+/**
+ * @brief I/O backend behind Demultiplex. readiness is reported the
+ * same way by every backend, completion-based operations are optional
+ * and fail with ENOTSUP where they are not available.
+ */
+class Poller
+{
+public:
+    using Resp = context::DmpWaitContext::resp;
+
+public:
+    Poller() = default;
+    Poller(const Poller &) = delete;
+    Poller & operator=(const Poller &) = delete;
+    virtual ~Poller() = default;
+
+    virtual int add(int fd, uint32_t events) =0;
+
+    virtual int modify(int fd, uint32_t events) =0;
+
+    virtual int remove(int fd) =0;
+
+    /**
+     * @brief block until something is ready, then append at most `max`
+     * entries to `resp`.
+     *
+     * @param timeout   milliseconds, -1 waits forever
+     * @return int      number of entries, -1 on error
+     */
+    virtual int wait(std::vector<Resp> & resp, int max, int timeout) =0;
+
+    // called once the batch returned by wait() was dispatched
+    virtual void afterDispatch() {}
+
+    // completion-based operations, see Demultiplex
+    virtual int acceptMultishot(int fd);
+
+    virtual int recvMultishot(int fd);
+
+    virtual int sendReceived(int fd, Resp const & received);
+
+    virtual int spliceLinked(int in_fd, int out_fd, int pipe_r, int pipe_w, size_t len);
+};
+
+} // namespace reactor
@@ -1,10 +1,16 @@
 #pragma once
 
+#include <stdint.h>
+
 #include <atomic>
 #include <cstddef>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <queue>
+#include <type_traits>
+#include <utility>
 
 namespace reactor {
 namespace queue {
@@ -56,50 +62,115 @@ private:
 };
 
 
+/**
+ * @brief bounded multi-producer single-consumer queue. every slot
+ * carries a sequence number telling whether it is free for the round
+ * the producer is in or holds a value for the consumer, so a producer
+ * only contends on the tail index and the consumer takes no lock at
+ * all. push() fails instead of blocking when the queue is full.
+ */
 template<typename T>
 class LockFreeQueue
 {
 public:
     LockFreeQueue(size_t capacity)
-            :   capacity_(capacity),
-                size_(0),
-                head_(-1),
-                tail_(-1),
-                tail_updated_(false),
-                buffer_(0)
+            :   capacity_(round_up_to_power_of_two(capacity)),
+                mask_(capacity_ - 1),
+                cells_(new Cell[capacity_]),
+                tail_(0),
+                head_(0)
         {
-            if (is_power_of_two(capacity))
-                capacity_ = capacity;
-            else
-                capacity_ = round_up_to_power_of_two(capacity);
-
-            buffer_.reserve(capacity_);
+            for (size_t i = 0; i < capacity_; i++)
+                cells_[i].seq_.store(i, std::memory_order_relaxed);
         }
-    
-    LockFreeQueue(LockFreeQueue&& queue)
-        : size_(queue.size_),
-          capacity_(queue.capacity_),
-          tail_(queue.tail_.load(std::memory_order_acquire)),
-          head_(queue.head_.load(std::memory_order_acquire)),
-          buffer_(std::move(queue.buffer_))
-    {
-        queue.size_ = 0;
-        queue.capacity_ = 0;
-        tail_.store(-1, std::memory_order_release);
-        head_.store(-1, std::memory_order_release);
-        queue.buffer_.clear();
-        queue.buffer_.shrink_to_fit();
-    }       
 
+    LockFreeQueue(LockFreeQueue&& queue) = delete;
     LockFreeQueue(const LockFreeQueue& queue) = delete;
     LockFreeQueue & operator=(LockFreeQueue && ) = delete;
     LockFreeQueue & operator=(const LockFreeQueue & ) = delete;
-    ~LockFreeQueue();
+
+    ~LockFreeQueue()
+    {
+        T v;
+        while (pop(v))
+            ;
+    }
+
+    // any thread
+    bool push(T const & v)
+    {
+        return emplace(v);
+    }
+
+    bool push(T && v)
+    {
+        return emplace(std::move(v));
+    }
+
+    // consumer thread only
+    bool pop(T & v)
+    {
+        Cell & cell = cells_[head_ & mask_];
+        auto seq = cell.seq_.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(seq - (head_ + 1)) < 0)
+            return false;
+
+        T * value = reinterpret_cast<T *>(&cell.storage_);
+        v = std::move(*value);
+        value->~T();
+        // free for the producers of the next round
+        cell.seq_.store(head_ + capacity_, std::memory_order_release);
+        head_++;
+
+        return true;
+    }
+
+    // consumer thread only
+    bool empty() const
+    {
+        auto seq = cells_[head_ & mask_].seq_.load(std::memory_order_acquire);
+        return static_cast<intptr_t>(seq - (head_ + 1)) < 0;
+    }
+
+    size_t capacity() const noexcept { return capacity_; }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t>                                         seq_;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+    };
 
 private:
-    bool is_power_of_two(size_t& size) { return (size > 0) && ((size & (size - 1)) == 0); }
+    template<typename U>
+    bool emplace(U && v)
+    {
+        Cell * cell = nullptr;
+        auto pos = tail_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            cell = &cells_[pos & mask_];
+            auto seq = cell->seq_.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(seq - pos);
+            if (diff == 0)
+            {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            // the consumer has not freed this slot yet, the queue is full
+            else if (diff < 0)
+                return false;
+            else
+                pos = tail_.load(std::memory_order_relaxed);
+        }
+
+        ::new (&cell->storage_) T(std::forward<U>(v));
+        cell->seq_.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
 
-    size_t round_up_to_power_of_two(size_t & size) {
+    static size_t round_up_to_power_of_two(size_t size) {
         size_t power = 1;
         while (power < size) {
             power <<= 1;
@@ -109,13 +180,13 @@ private:
     }
 
 private:
-    size_t capacity_;
-    size_t size_;
-    std::atomic<int64_t> head_;
-    std::atomic<int64_t> tail_;
-    std::atomic<bool> tail_updated_;
-    std::vector<T> buffer_;
+    size_t                      capacity_;
+    size_t                      mask_;
+    std::unique_ptr<Cell[]>     cells_;
+    // producers and the consumer write different cache lines
+    alignas(64) std::atomic<size_t> tail_;
+    alignas(64) size_t              head_;
 };
 
 } // namespace queue
-} // namespace reactor
\ No newline at end of file
+} // namespace reactor
@@ -0,0 +1,307 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "rate_limiter.hpp"
+
+namespace reactor {
+
+namespace {
+
+size_t roundUp(size_t n) noexcept
+{
+    size_t power = 1;
+    while (power < n)
+        power <<= 1;
+
+    return power;
+}
+
+// splitmix64's finalizer
+uint64_t mix(uint64_t x) noexcept
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+
+    return x;
+}
+
+uint64_t prefixOf(uint64_t bits, uint32_t prefix) noexcept
+{
+    if (prefix == 0)
+        return 0;
+
+    return prefix >= 64 ? bits : bits & ~(~uint64_t(0) >> prefix);
+}
+
+uint64_t loadBig(unsigned char const * bytes) noexcept
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+        value = value << 8 | bytes[i];
+
+    return value;
+}
+
+// a v4 key never collides with a v6 one: ffff:ffff::/32 is not unicast
+constexpr uint64_t V4_TAG = 0xffffffff00000000ull;
+
+// stands in for a zero prefix, 0 marks a free slot. ff00::/8 is
+// multicast, no peer has it, and v4 keys all carry V4_TAG
+constexpr uint64_t ZERO_KEY = 0xff00000000000000ull;
+
+} // namespace
+
+RateLimiter::RateLimiter(RateLimitOptions const & options)
+    : options_(options)
+    , epoch_(std::chrono::steady_clock::now())
+    , per_shard_(0)
+    , shards_()
+    , request_ns_(0)
+    , request_tolerance_ns_(0)
+    , byte_tolerance_ns_(0)
+{
+    options_.shards_ = roundUp(std::max<size_t>(options_.shards_, 1));
+    options_.slots_ = roundUp(std::max(options_.slots_, options_.shards_ * PROBE));
+    per_shard_ = options_.slots_ / options_.shards_;
+
+    shards_.reset(new Shard[options_.shards_]);
+    for (size_t i = 0; i < options_.shards_; i++)
+    {
+        auto & shard = shards_[i];
+        shard.entries_.reset(new Entry[per_shard_]);
+        for (size_t j = 0; j < per_shard_; j++)
+        {
+            shard.entries_[j].key_.store(0, std::memory_order_relaxed);
+            shard.entries_[j].request_tat_.store(0, std::memory_order_relaxed);
+            shard.entries_[j].byte_tat_.store(0, std::memory_order_relaxed);
+            shard.entries_[j].referenced_.store(false, std::memory_order_relaxed);
+        }
+        shard.hand_.store(0, std::memory_order_relaxed);
+        shard.rejected_.store(0, std::memory_order_relaxed);
+        shard.throttled_.store(0, std::memory_order_relaxed);
+        shard.evictions_.store(0, std::memory_order_relaxed);
+    }
+
+    // the first of a burst is free, the rest run ahead of the rate
+    if (options_.requests_per_sec_ > 0)
+    {
+        request_ns_ = std::max<int64_t>(1000000000 / options_.requests_per_sec_, 1);
+        request_tolerance_ns_ = request_ns_
+                * static_cast<int64_t>(std::max<uint64_t>(options_.request_burst_, 1) - 1);
+    }
+    if (options_.bytes_per_sec_ > 0)
+        byte_tolerance_ns_ = static_cast<int64_t>(
+                options_.byte_burst_ * 1000000000.0 / options_.bytes_per_sec_);
+}
+
+RateLimiter::Key RateLimiter::keyOf(sockaddr const * addr) const noexcept
+{
+    uint64_t key = 0;
+    if (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)
+        return 0;
+
+    if (addr->sa_family == AF_INET)
+    {
+        auto ip = ntohl(reinterpret_cast<sockaddr_in const *>(addr)->sin_addr.s_addr);
+        key = V4_TAG | (prefixOf(uint64_t(ip) << 32, options_.prefix_v4_) >> 32);
+    }
+    else if (addr->sa_family == AF_INET6)
+    {
+        auto const & ip = reinterpret_cast<sockaddr_in6 const *>(addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&ip))
+        {
+            auto v4 = static_cast<uint64_t>(loadBig(ip.s6_addr + 8) & 0xffffffffull);
+            key = V4_TAG | (prefixOf(v4 << 32, options_.prefix_v4_) >> 32);
+        }
+        else
+        {
+            auto high = prefixOf(loadBig(ip.s6_addr), options_.prefix_v6_);
+            // past /64 both halves make the key, hashed into one word
+            key = options_.prefix_v6_ <= 64 ? high
+                    : mix(high ^ mix(prefixOf(loadBig(ip.s6_addr + 8),
+                                    options_.prefix_v6_ - 64)));
+        }
+    }
+
+    return key == 0 ? ZERO_KEY : key;
+}
+
+RateLimiter::Key RateLimiter::keyOf(int sockfd) const noexcept
+{
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (::getpeername(sockfd, reinterpret_cast<sockaddr *>(&addr), &len) == -1)
+        return 0;
+
+    return keyOf(reinterpret_cast<sockaddr const *>(&addr));
+}
+
+bool RateLimiter::admit(Key key)
+{
+    if (request_ns_ == 0 || key == 0)
+        return true;
+
+    auto entry = find(key);
+    if (!entry)
+        return true;
+
+    auto now = this->now();
+    auto tat = entry->request_tat_.load(std::memory_order_relaxed);
+    int64_t next;
+    do
+    {
+        auto base = std::max(tat, now);
+        if (base - now > request_tolerance_ns_)
+        {
+            shards_[mix(key) >> 32 & (options_.shards_ - 1)]
+                .rejected_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        next = base + request_ns_;
+    } while (!entry->request_tat_.compare_exchange_weak(tat, next,
+                std::memory_order_relaxed));
+
+    return true;
+}
+
+void RateLimiter::charge(Key key, size_t bytes)
+{
+    if (options_.bytes_per_sec_ == 0 || key == 0 || bytes == 0)
+        return;
+
+    auto entry = find(key);
+    if (!entry)
+        return;
+
+    auto cost = static_cast<int64_t>(bytes * 1000000000.0 / options_.bytes_per_sec_);
+    auto now = this->now();
+    auto tat = entry->byte_tat_.load(std::memory_order_relaxed);
+    // already moved, so always taken. what runs ahead is waited for
+    while (!entry->byte_tat_.compare_exchange_weak(tat, std::max(tat, now) + cost,
+                std::memory_order_relaxed))
+        ;
+}
+
+std::chrono::nanoseconds RateLimiter::wait(Key key)
+{
+    if (options_.bytes_per_sec_ == 0 || key == 0)
+        return std::chrono::nanoseconds(0);
+
+    // a client with no entry was never charged, or forgotten since
+    auto entry = lookup(key);
+    if (!entry)
+        return std::chrono::nanoseconds(0);
+
+    auto ahead = entry->byte_tat_.load(std::memory_order_relaxed) - now()
+            - byte_tolerance_ns_;
+    if (ahead <= 0)
+        return std::chrono::nanoseconds(0);
+
+    shards_[mix(key) >> 32 & (options_.shards_ - 1)]
+        .throttled_.fetch_add(1, std::memory_order_relaxed);
+    return std::chrono::nanoseconds(ahead);
+}
+
+RateLimitStats RateLimiter::stats() const noexcept
+{
+    RateLimitStats stats;
+    for (size_t i = 0; i < options_.shards_; i++)
+    {
+        stats.rejected_ += shards_[i].rejected_.load(std::memory_order_relaxed);
+        stats.throttled_ += shards_[i].throttled_.load(std::memory_order_relaxed);
+        stats.evictions_ += shards_[i].evictions_.load(std::memory_order_relaxed);
+    }
+
+    return stats;
+}
+
+RateLimiter::Entry * RateLimiter::find(Key key)
+{
+    auto hash = mix(key);
+    auto & shard = shards_[hash >> 32 & (options_.shards_ - 1)];
+    auto mask = per_shard_ - 1;
+    auto base = hash & mask;
+
+    for (size_t i = 0; i < PROBE; i++)
+    {
+        auto & entry = shard.entries_[(base + i) & mask];
+        auto current = entry.key_.load(std::memory_order_acquire);
+        if (current == 0)
+        {
+            // claimed by us, or by another thread for the same key
+            if (entry.key_.compare_exchange_strong(current, key, std::memory_order_acq_rel)
+                    || current == key)
+            {
+                entry.referenced_.store(true, std::memory_order_relaxed);
+                return &entry;
+            }
+        }
+        if (current == key)
+        {
+            // a store only on the first use since the hand passed
+            if (!entry.referenced_.load(std::memory_order_relaxed))
+                entry.referenced_.store(true, std::memory_order_relaxed);
+            return &entry;
+        }
+    }
+
+    // second chance: the hand clears what was used since it last came
+    // by and takes the first entry it finds clear
+    auto start = shard.hand_.fetch_add(1, std::memory_order_relaxed);
+    for (size_t i = 0; i < 2 * PROBE; i++)
+    {
+        auto & entry = shard.entries_[(base + (start + i) % PROBE) & mask];
+        if (entry.referenced_.exchange(false, std::memory_order_relaxed))
+            continue;
+
+        auto victim = entry.key_.load(std::memory_order_acquire);
+        if (victim == key)
+            return &entry;
+        if (!entry.key_.compare_exchange_strong(victim, key, std::memory_order_acq_rel))
+            continue;
+
+        // a thread still on the victim may land one more update, harmless
+        entry.request_tat_.store(0, std::memory_order_relaxed);
+        entry.byte_tat_.store(0, std::memory_order_relaxed);
+        entry.referenced_.store(true, std::memory_order_relaxed);
+        shard.evictions_.fetch_add(1, std::memory_order_relaxed);
+        return &entry;
+    }
+
+    return nullptr;
+}
+
+RateLimiter::Entry * RateLimiter::lookup(Key key) noexcept
+{
+    auto hash = mix(key);
+    auto & shard = shards_[hash >> 32 & (options_.shards_ - 1)];
+    auto mask = per_shard_ - 1;
+    auto base = hash & mask;
+
+    for (size_t i = 0; i < PROBE; i++)
+    {
+        auto & entry = shard.entries_[(base + i) & mask];
+        if (entry.key_.load(std::memory_order_acquire) != key)
+            continue;
+
+        if (!entry.referenced_.load(std::memory_order_relaxed))
+            entry.referenced_.store(true, std::memory_order_relaxed);
+        return &entry;
+    }
+
+    return nullptr;
+}
+
+int64_t RateLimiter::now() const noexcept
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - epoch_).count();
+}
+
+} // namespace reactor
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace reactor {
+
+struct RateLimitOptions
+{
+    // what happens to a client over its byte budget
+    enum OverLimitT
+    {
+        PAUSE,      // it is not read until the budget allows it again
+        REJECT,     // it is shut down
+    };
+
+    RateLimitOptions()
+        : requests_per_sec_(0)
+        , request_burst_(20)
+        , bytes_per_sec_(0)
+        , byte_burst_(1024 * 1024)
+        , prefix_v4_(32)
+        , prefix_v6_(64)
+        , over_limit_(PAUSE)
+        , slots_(64 * 1024)
+        , shards_(16)
+    {}
+
+    // a request is a new connection, the proxy does not parse any. over
+    // the limit it is closed right after accept. 0 turns it off
+    uint64_t        requests_per_sec_;
+    uint64_t        request_burst_;
+    // read from the client, 0 turns it off
+    uint64_t        bytes_per_sec_;
+    uint64_t        byte_burst_;
+    // clients are limited together by prefix, a /24 or a /64 say
+    uint32_t        prefix_v4_;
+    uint32_t        prefix_v6_;
+    OverLimitT      over_limit_;
+    // clients tracked at once in all, rounded up to a power of two
+    size_t          slots_;
+    size_t          shards_;
+};
+
+struct RateLimitStats
+{
+    RateLimitStats()
+        : rejected_(0)
+        , throttled_(0)
+        , evictions_(0)
+    {}
+
+    size_t rejected_;       // connections over requests_per_sec_
+    size_t throttled_;      // reads put off, or clients shut down, for bytes
+    size_t evictions_;      // clients forgotten for a new one
+};
+
+/**
+ * @brief token buckets per client prefix, shared by every loop without
+ * locks. each bucket is one atomic timestamp, its theoretical arrival
+ * time as GCRA keeps it: a bucket with b tokens filled at r per second
+ * is the same as a timestamp allowed to run b / r ahead of now.
+ * clients live in a sharded open-addressing table, probed over a short
+ * window. a full window gives up the entry not referenced since the
+ * clock hand last passed it.
+ */
+class RateLimiter
+{
+public:
+    // binary client prefix, 0 for an unknown address family, which is
+    // never limited
+    using Key = uint64_t;
+
+    // slots probed for a key, the window eviction picks from
+    constexpr static size_t const PROBE = 8;
+
+public:
+    explicit RateLimiter(RateLimitOptions const & options = RateLimitOptions());
+    RateLimiter(const RateLimiter &) = delete;
+    RateLimiter & operator=(const RateLimiter &) = delete;
+
+    Key keyOf(sockaddr const * addr) const noexcept;
+
+    // the key of sockfd's peer
+    Key keyOf(int sockfd) const noexcept;
+
+    // one request of key, false if it is over the limit
+    bool admit(Key key);
+
+    // bytes of key were moved, they count against its budget
+    void charge(Key key, size_t bytes);
+
+    // how long key has to wait before it is in budget again, 0 if it is
+    std::chrono::nanoseconds wait(Key key);
+
+    RateLimitOptions const & options() const noexcept { return options_; }
+
+    RateLimitStats stats() const noexcept;
+
+private:
+    struct Entry
+    {
+        std::atomic<uint64_t>   key_;
+        std::atomic<int64_t>    request_tat_;   // ns since epoch_
+        std::atomic<int64_t>    byte_tat_;
+        std::atomic<bool>       referenced_;
+    };
+
+    struct Shard
+    {
+        std::unique_ptr<Entry[]>    entries_;
+        std::atomic<uint32_t>       hand_;
+        std::atomic<uint64_t>       rejected_;
+        std::atomic<uint64_t>       throttled_;
+        std::atomic<uint64_t>       evictions_;
+    };
+
+    // key's entry, taken over from another key if need be. nullptr if
+    // every probed slot changed hands meanwhile, the key goes unlimited
+    Entry * find(Key key);
+
+    // key's entry if it has one, nothing is taken over for it
+    Entry * lookup(Key key) noexcept;
+
+    int64_t now() const noexcept;
+
+private:
+    RateLimitOptions                options_;
+    std::chrono::steady_clock::time_point epoch_;
+    size_t                          per_shard_;     // power of two
+    std::unique_ptr<Shard[]>        shards_;
+    // per request and per byte, 0 unlimited
+    int64_t                         request_ns_;
+    int64_t                         request_tolerance_ns_;
+    int64_t                         byte_tolerance_ns_;
+};
+
+} // namespace reactor
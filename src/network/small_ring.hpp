@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+
+namespace reactor {
+
+/**
+ * @brief FIFO of plain values, the first N of them stored inline. a
+ * connection's buffers rarely queue more than a few entries, so they
+ * cost no allocation at all; past N the ring moves to the heap,
+ * doubling, and keeps that storage until it is destroyed. only the
+ * front is ever removed. not thread-safe.
+ */
+template<typename T, size_t N>
+class SmallRing
+{
+    static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+    static_assert(std::is_trivially_copyable<T>::value, "entries are moved by copying");
+
+public:
+    SmallRing() noexcept
+        : data_(inline_)
+        , capacity_(N)
+        , head_(0)
+        , size_(0)
+    {}
+    SmallRing(const SmallRing &) = delete;
+    SmallRing & operator=(const SmallRing &) = delete;
+    SmallRing(SmallRing && ring) noexcept
+        : SmallRing()
+    {
+        steal(ring);
+    }
+    SmallRing & operator=(SmallRing && ring) noexcept
+    {
+        if (this != &ring)
+        {
+            free();
+            steal(ring);
+        }
+
+        return *this;
+    }
+    ~SmallRing() { free(); }
+
+    bool empty() const noexcept { return size_ == 0; }
+
+    size_t size() const noexcept { return size_; }
+
+    // the i-th entry from the front
+    T & operator[](size_t i) noexcept { return data_[(head_ + i) & (capacity_ - 1)]; }
+
+    T const & operator[](size_t i) const noexcept { return data_[(head_ + i) & (capacity_ - 1)]; }
+
+    T & front() noexcept { return (*this)[0]; }
+
+    T & back() noexcept { return (*this)[size_ - 1]; }
+
+    T const & back() const noexcept { return (*this)[size_ - 1]; }
+
+    void push_back(T const & value)
+    {
+        if (size_ == capacity_)
+            grow();
+
+        data_[(head_ + size_) & (capacity_ - 1)] = value;
+        size_++;
+    }
+
+    void pop_front() noexcept
+    {
+        head_ = (head_ + 1) & (capacity_ - 1);
+        size_--;
+    }
+
+    // the storage is kept
+    void clear() noexcept
+    {
+        head_ = 0;
+        size_ = 0;
+    }
+
+    // bytes allocated besides the object itself
+    size_t heapBytes() const noexcept
+    {
+        return data_ == inline_ ? 0 : capacity_ * sizeof(T);
+    }
+
+private:
+    void grow()
+    {
+        auto data = new T[capacity_ * 2];
+        for (size_t i = 0; i < size_; i++)
+            data[i] = (*this)[i];
+
+        free();
+        data_ = data;
+        capacity_ *= 2;
+        head_ = 0;
+    }
+
+    void free() noexcept
+    {
+        if (data_ != inline_)
+            delete[] data_;
+        data_ = inline_;
+    }
+
+    // ring is left empty and inline
+    void steal(SmallRing & ring) noexcept
+    {
+        if (ring.data_ == ring.inline_)
+        {
+            std::copy(ring.inline_, ring.inline_ + N, inline_);
+            data_ = inline_;
+        }
+        else
+            data_ = ring.data_;
+        capacity_ = ring.capacity_;
+        head_ = ring.head_;
+        size_ = ring.size_;
+
+        ring.data_ = ring.inline_;
+        ring.capacity_ = N;
+        ring.clear();
+    }
+
+private:
+    T *     data_;
+    size_t  capacity_;
+    size_t  head_;
+    size_t  size_;
+    T       inline_[N];
+};
+
+} // namespace reactor
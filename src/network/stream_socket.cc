@@ -12,28 +12,95 @@
 
 namespace reactor {
 
-InetAddr::InetAddr(std::string ip, uint16_t port)
-    : ip_(ip)
-    , port_(port) {}
+namespace {
 
-bool InetAddr::operator==(InetAddr const & addr)
+// FNV-1a, the addresses are short
+size_t fnv(void const * data, size_t len, uint64_t seed) noexcept
 {
-    return addr.ip_ == ip_ && addr.port_ == port_;
+    auto bytes = static_cast<unsigned char const *>(data);
+    auto hash = seed;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return static_cast<size_t>(hash);
 }
 
-bool InetAddr::operator==(InetAddr && addr)
+} // namespace
+
+InetAddr::InetAddr()
+    : addr_()
+    , len_(0)
+    , port_(0)
+{}
+
+InetAddr::InetAddr(std::string const & ip, uint16_t port)
+    : addr_()
+    , len_(0)
+    , port_(port)
+{
+    auto v4 = reinterpret_cast<sockaddr_in *>(&addr_);
+    auto v6 = reinterpret_cast<sockaddr_in6 *>(&addr_);
+    if (::inet_pton(AF_INET, ip.c_str(), &v4->sin_addr) == 1)
+    {
+        v4->sin_family = AF_INET;
+        v4->sin_port = ::htons(port);
+        len_ = sizeof(sockaddr_in);
+    }
+    else if (::inet_pton(AF_INET6, ip.c_str(), &v6->sin6_addr) == 1)
+    {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = ::htons(port);
+        len_ = sizeof(sockaddr_in6);
+    }
+    else
+        addr_ = sockaddr_storage();
+}
+
+InetAddr::InetAddr(sockaddr const * addr, socklen_t len)
+    : addr_()
+    , len_(0)
+    , port_(0)
 {
-    return addr.ip_ == ip_ && addr.port_ == port_;
+    if (addr->sa_family == AF_INET && len >= sizeof(sockaddr_in))
+    {
+        len_ = sizeof(sockaddr_in);
+        port_ = ::ntohs(reinterpret_cast<sockaddr_in const *>(addr)->sin_port);
+    }
+    else if (addr->sa_family == AF_INET6 && len >= sizeof(sockaddr_in6))
+    {
+        len_ = sizeof(sockaddr_in6);
+        port_ = ::ntohs(reinterpret_cast<sockaddr_in6 const *>(addr)->sin6_port);
+    }
+    ::memcpy(&addr_, addr, len_);
 }
 
-std::string InetAddr::toString()
+bool InetAddr::operator==(InetAddr const & addr) const noexcept
+{
+    if (addr_.ss_family != addr.addr_.ss_family || port_ != addr.port_)
+        return false;
+
+    if (addr_.ss_family == AF_INET)
+        return reinterpret_cast<sockaddr_in const *>(&addr_)->sin_addr.s_addr
+                == reinterpret_cast<sockaddr_in const *>(&addr.addr_)->sin_addr.s_addr;
+    if (addr_.ss_family == AF_INET6)
+        return ::memcmp(&reinterpret_cast<sockaddr_in6 const *>(&addr_)->sin6_addr,
+                &reinterpret_cast<sockaddr_in6 const *>(&addr.addr_)->sin6_addr,
+                sizeof(in6_addr)) == 0;
+
+    return true;
+}
+
+std::string InetAddr::toString() const
 {
     // [ip:port]
     std::string info;
     auto port = std::to_string(port_);
 
     info.append("[");
-    info.append(ip_.c_str());
+    info.append(ip());
     info.append(":");
 
     info.append(port.c_str());
@@ -42,15 +109,41 @@ std::string InetAddr::toString()
     return info;
 }
 
-std::string InetAddr::operator()()
+std::string InetAddr::operator()() const
 {
     return toString();
 }
 
-std::string InetAddr::ip() { return ip_; }
+std::string InetAddr::ip() const
+{
+    char text[INET6_ADDRSTRLEN] = {};
+    if (addr_.ss_family == AF_INET)
+        ::inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in const *>(&addr_)->sin_addr,
+                text, sizeof(text));
+    else if (addr_.ss_family == AF_INET6)
+        ::inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6 const *>(&addr_)->sin6_addr,
+                text, sizeof(text));
+
+    return text;
+}
 
-std::string InetAddr::port() { return std::to_string(port_); }
+std::string InetAddr::port() const { return std::to_string(port_); }
 
+size_t InetAddr::hash(bool with_port) const noexcept
+{
+    uint64_t seed = 0xcbf29ce484222325ull ^ addr_.ss_family;
+    if (with_port)
+        seed = fnv(&port_, sizeof(port_), seed);
+
+    if (addr_.ss_family == AF_INET)
+        return fnv(&reinterpret_cast<sockaddr_in const *>(&addr_)->sin_addr,
+                sizeof(in_addr), seed);
+    if (addr_.ss_family == AF_INET6)
+        return fnv(&reinterpret_cast<sockaddr_in6 const *>(&addr_)->sin6_addr,
+                sizeof(in6_addr), seed);
+
+    return static_cast<size_t>(seed);
+}
 
 StreamSocket::StreamSocket(int sockfd)
     : sockfd_(sockfd)
@@ -60,13 +153,17 @@ StreamSocket::StreamSocket(int sockfd)
     assert(sockfd >= 0);
 }
 
-StreamSocket::StreamSocket(std::string & ip, std::string & port)
+StreamSocket::StreamSocket(std::string & ip, std::string & port, bool reuse_port)
     : sockfd_(::socket(AF_INET, SOCK_STREAM, 0))
     , ip_(ip)
     , port_(port)
 {
     assert(sockfd_ >= 0);
 
+    int reuse = 1;
+    ::setsockopt(sockfd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (reuse_port)
+        ::setsockopt(sockfd_, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
     bindAddr();
 }
 
@@ -101,17 +198,14 @@ int StreamSocket::bindAddr(int sockfd, std::string const & ip, std::string const
     return ret;
 }
 
-int StreamSocket::listen()
+int StreamSocket::listen(int backlog)
 {
-    auto ret = ::listen(sockfd_, 50);
-    assert(ret != -1);
-
-    return ret;
+    return listen(sockfd_, backlog);
 }
 
 int StreamSocket::listen(int fd, int backlog)
 {
-    auto ret = ::listen(fd, 50);
+    auto ret = ::listen(fd, backlog);
     assert(ret != -1);
 
     return ret;
@@ -119,11 +213,9 @@ int StreamSocket::listen(int fd, int backlog)
 
 int StreamSocket::accept()
 {
-    socklen_t addrLen;
-    struct sockaddr_in clientAddr;
-    auto ret = ::accept(sockfd_, (struct sockaddr *) &clientAddr, &addrLen);
-    
-    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    auto ret = ::accept4(sockfd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
         return ret;
 
     assert(ret != -1);
@@ -141,6 +233,30 @@ void StreamSocket::close(int fd)
     ::close(fd);
 }
 
+int StreamSocket::reuseListener(int fd, int backlog)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (::getsockname(fd, (struct sockaddr *) &addr, &len) == -1)
+        return -1;
+
+    auto sock = ::socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+
+    int reuse = 1;
+    if (::setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1
+            || ::setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1
+            || ::bind(sock, (struct sockaddr *) &addr, len) == -1
+            || ::listen(sock, backlog) == -1)
+    {
+        ::close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
 void StreamSocket::reuseAddrPort()
 {
     int reuse = 1;
@@ -152,22 +268,44 @@ void StreamSocket::reuseAddrPort()
 
 int StreamSocket::connectTo(InetAddr addr)
 {
-    struct sockaddr_in serverAddr;
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = ::inet_addr(addr.ip().c_str());
-    serverAddr.sin_port = ::htons(::atoi(addr.port().c_str()));
+    if (!addr.valid())
+        throw std::runtime_error("can not connect to an unspecified address");
 
-    auto sock = ::socket(AF_INET, SOCK_STREAM, 0);
+    auto sock = ::socket(addr.family(), SOCK_STREAM, 0);
     if (sock < 0)
         throw std::runtime_error("can't create new socket");
 
-    auto ret = ::connect(sock, (struct sockaddr *) &serverAddr, sizeof(serverAddr));
+    auto ret = ::connect(sock, addr.sockAddr(), addr.length());
     if (ret < 0)
         throw std::runtime_error("can not establish connection");
 
     return sock;
 }
 
+int StreamSocket::connectNonBlocking(InetAddr addr)
+{
+    if (!addr.valid())
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    auto sock = ::socket(addr.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+
+    auto ret = ::connect(sock, addr.sockAddr(), addr.length());
+    if (ret == -1 && errno != EINPROGRESS)
+    {
+        auto err = errno;
+        ::close(sock);
+        errno = err;
+        return -1;
+    }
+
+    return sock;
+}
+
 ssize_t StreamSocket::read(int sockfd, void * const buf, size_t count)
 {
     return ::read(sockfd, buf, count);
@@ -181,18 +319,31 @@ ssize_t StreamSocket::write(int sockfd, const void *buf, size_t count)
 void StreamSocket::setNonBlocking(int fd)
 {
     auto flag = ::fcntl(fd, F_GETFL, 0);
-    ::fcntl(fd, flag | O_NONBLOCK);
+    ::fcntl(fd, F_SETFL, flag | O_NONBLOCK);
+}
+
+bool StreamSocket::setPacingRate(int fd, uint64_t bytes_per_sec)
+{
+#ifdef SO_MAX_PACING_RATE
+    // older kernels take 32 bits, ~0U is unlimited to them
+    uint32_t rate = bytes_per_sec < UINT32_MAX
+            ? static_cast<uint32_t>(bytes_per_sec) : UINT32_MAX - 1;
+    return ::setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) == 0;
+#else
+    (void) fd;
+    (void) bytes_per_sec;
+    return false;
+#endif
 }
 
 InetAddr StreamSocket::getPeerAddr(int fd)
 {
-    struct sockaddr_in client_addr; 
-    socklen_t len = sizeof(client_addr);
-    ::getpeername(fd, (struct sockaddr *) (&client_addr), &len);
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (::getpeername(fd, reinterpret_cast<sockaddr *>(&addr), &len) == -1)
+        return InetAddr();
 
-    return InetAddr(
-            ::inet_ntoa(client_addr.sin_addr), 
-            ::ntohs(client_addr.sin_port));
+    return InetAddr(reinterpret_cast<sockaddr const *>(&addr), len);
 }
 
 } // namespace reactor
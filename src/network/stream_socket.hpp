@@ -1,43 +1,72 @@
 #pragma once
 
+#include <sys/socket.h>
+
 #include <cstdint>
+#include <functional>
 #include <string>
 
 namespace reactor {
 
+/**
+ * @brief an ipv4 or ipv6 address and port, kept the way the socket calls
+ * take it. parsed once when built from text, formatted only when asked.
+ */
 class InetAddr
 {
 public:
-    InetAddr(std::string ip, uint16_t port);
+    // unspecified, valid() is false
+    InetAddr();
+    // an ip that does not parse leaves the address unspecified
+    InetAddr(std::string const & ip, uint16_t port);
+    InetAddr(sockaddr const * addr, socklen_t len);
     InetAddr(const InetAddr &) = default;
     InetAddr(InetAddr &&) = default;
     InetAddr & operator=(const InetAddr &) = default;
     InetAddr & operator=(InetAddr &&) = default;
     ~InetAddr() = default;
 
-    bool operator==(InetAddr const & addr);
+    bool operator==(InetAddr const & addr) const noexcept;
+
+    bool operator!=(InetAddr const & addr) const noexcept { return !(*this == addr); }
+
+    bool valid() const noexcept { return addr_.ss_family != AF_UNSPEC; }
+
+    int family() const noexcept { return addr_.ss_family; }
 
-    bool operator==(InetAddr && addr);
+    sockaddr const * sockAddr() const noexcept
+    {
+        return reinterpret_cast<sockaddr const *>(&addr_);
+    }
+
+    socklen_t length() const noexcept { return len_; }
 
     // [ip:port]
-    std::string toString();
+    std::string toString() const;
+
+    std::string operator()() const;
 
-    std::string operator()();
+    std::string ip() const;
 
-    std::string ip();
+    std::string port() const;
 
-    std::string port();
+    uint16_t portNumber() const noexcept { return port_; }
+
+    // of the ip, and of the port unless with_port is false
+    size_t hash(bool with_port = true) const noexcept;
 
 private:
-    std::string ip_;
-    uint16_t    port_;
+    sockaddr_storage    addr_;
+    socklen_t           len_;
+    uint16_t            port_;      // host order, kept for unspecified ones too
 };
 
 class StreamSocket
 {
     public:
         explicit StreamSocket(int sockfd);
-        StreamSocket(std::string & ip, std::string & port);
+        // reuse_port must be known before bind() to join a SO_REUSEPORT group
+        StreamSocket(std::string & ip, std::string & port, bool reuse_port = false);
         StreamSocket(const StreamSocket&) = default;
         StreamSocket(StreamSocket&&) = default;
         StreamSocket& operator=(const StreamSocket&) = default;
@@ -52,9 +81,9 @@ class StreamSocket
 
         static int bindAddr(int sockfd, std::string const & ip, std::string const & port);
 
-        int listen();
+        int listen(int backlog = SOMAXCONN);
 
-        static int listen(int fd, int backlog = 50);
+        static int listen(int fd, int backlog = SOMAXCONN);
 
         int accept();
 
@@ -64,14 +93,38 @@ class StreamSocket
 
         static void close(int fd);
 
+        /**
+         * @brief open another listening socket on the local address of
+         * `fd`, which has to be bound with SO_REUSEPORT. the kernel
+         * spreads incoming connections over all sockets of the group.
+         *
+         * @return int  the new nonblocking listening socket, -1 on error
+         */
+        static int reuseListener(int fd, int backlog = SOMAXCONN);
+
         static int connectTo(InetAddr addr);
 
+        /**
+         * @brief start connecting a nonblocking socket to addr. the
+         * handshake is done once the socket turns writable, SO_ERROR
+         * tells how it went.
+         *
+         * @return int  the socket, -1 with errno set if it failed at once
+         */
+        static int connectNonBlocking(InetAddr addr);
+
         static ssize_t read(int sockfd, void * const buf, size_t count);
 
         static ssize_t write(int sockfd, void const * buf, size_t count);
 
         static void setNonBlocking(int fd);
 
+        /**
+         * @brief cap what the kernel sends on fd at bytes_per_sec, paced
+         * out evenly. false where SO_MAX_PACING_RATE is not supported.
+         */
+        static bool setPacingRate(int fd, uint64_t bytes_per_sec);
+
         static InetAddr getPeerAddr(int fd);
 
     private:
@@ -80,4 +133,17 @@ class StreamSocket
         std::string port_;
 };
 
-} // namespace reactor
\ No newline at end of file
+} // namespace reactor
+
+namespace std {
+
+template <>
+struct hash<::reactor::InetAddr>
+{
+    size_t operator()(::reactor::InetAddr const & addr) const noexcept
+    {
+        return addr.hash();
+    }
+};
+
+} // namespace std
@@ -1,40 +1,39 @@
 #include "tcp_connection.hpp"
-#include "nw_ctx.hpp"
 #include <sys/socket.h>
 
 namespace reactor {
 
-TcpConnection::TcpConnection(ChannelPtr const & ptr, ContextPtr const & cxt_ptr)
-    : sockfd_(ptr->socket())
-    , channel_(ptr)
+TcpConnection::TcpConnection(int fd, std::shared_ptr<Demultiplex> dmp,
+        InetAddr const & peer)
+    : sockfd_(fd)
+    , channel_(fd, std::move(dmp))
     , recv_buffer_()
     , send_buffer_()
-    , addr_(StreamSocket::getPeerAddr(sockfd_))
+    , zerocopy_(fd)
+    , addr_(peer.valid() ? peer : StreamSocket::getPeerAddr(sockfd_))
     , state_(CONNECTED)
-    , context_(cxt_ptr)
     {}
 
 TcpConnection::~TcpConnection()
 {
     state_ = DISCONNECT;
 
+    if (!channel_.isLeave())
+        channel_.leave();
+
+    zerocopy_.reap();
     StreamSocket::close(sockfd_);
 }
 
-TcpConnection::ChannelPtr & TcpConnection::channel() noexcept
+Channel & TcpConnection::channel() noexcept
 {
     return channel_;
 }
 
-TcpConnection::ContextPtr & TcpConnection::context() noexcept
-{
-    return context_;
-}
-
 void TcpConnection::disconnect()
 {
     state_ = DISCONNECT;
-    channel_->leave();
+    channel_.leave();
 }
 
 bool TcpConnection::alive() noexcept
@@ -47,45 +46,42 @@ std::string TcpConnection::getTcpInfo() noexcept
     return addr_();
 }
 
-ArrayBuffer & TcpConnection::recvBuffer() noexcept
+ChainBuffer & TcpConnection::recvBuffer() noexcept
 {
     return recv_buffer_;
 }
 
-ArrayBuffer & TcpConnection::sendBuffer() noexcept
+ChainBuffer & TcpConnection::sendBuffer() noexcept
 {
     return send_buffer_;
 }
 
-void TcpConnection::read()
+size_t TcpConnection::memoryUsage() const noexcept
 {
-    read(recv_buffer_.peek(), recv_buffer_.writableBytes());
+    return sizeof(*this) + recv_buffer_.capacity() + send_buffer_.capacity()
+        + recv_buffer_.overhead() + send_buffer_.overhead()
+        + zerocopy_.inFlight() + zerocopy_.overhead();
 }
 
 void TcpConnection::shutdownWrite()
 {
     ::shutdown(sockfd_, SHUT_WR);
-    channel_->disableWrite(context_);
+    channel_.disableWrite();
 }
 
-void TcpConnection::read(void * const buf, size_t len)
+ssize_t TcpConnection::read(void * const buf, size_t len)
 {
     if (state_ == DISCONNECT)
-        return;
+        return -1;
 
-    auto ctx = std::dynamic_pointer_cast<context::DmpRegisterContext>(context_);
-    if (!(ctx->events_ & Demultiplex::READABLE))
-        return;
+    if (!(channel_.events() & Demultiplex::READABLE))
+        return 0;
 
     ssize_t recv = StreamSocket::read(sockfd_, buf, len);
     if (recv < 0)
-    {
         disconnect();
-    }
-    else
-    {
-        recv_buffer_.hasWritten(recv);
-    }
+
+    return recv;
 }
 
 void TcpConnection::send(void const * const buf, size_t len)
@@ -93,11 +89,11 @@ void TcpConnection::send(void const * const buf, size_t len)
     if (state_ == DISCONNECT)
         return;
 
-    auto ctx = std::dynamic_pointer_cast<context::DmpRegisterContext>(context_);
+    auto events = channel_.events();
 
     ssize_t wrote = 0;
     ssize_t remain = len;
-    if (!(Demultiplex::WRITABLE & ctx->events_) &&
+    if (!(Demultiplex::WRITABLE & events) &&
         send_buffer_.readableBytes() == 0)
     {
         wrote = StreamSocket::write(sockfd_, buf, len);
@@ -119,9 +115,29 @@ void TcpConnection::send(void const * const buf, size_t len)
     if (remain > 0)
     {
         send_buffer_.append(static_cast<char const *>(buf) + wrote, remain);
-        auto modify = new context::DmpModifyContext(::pubsub::DMPMODIFY);
-        if (!(Demultiplex::WRITABLE & ctx->events_))
-            channel_->enableWrite(std::shared_ptr<::pubsub::Context>(modify));
+        if (!(Demultiplex::WRITABLE & events))
+            channel_.enableWrite();
+    }
+}
+
+void TcpConnection::send(ChainBuffer & buf)
+{
+    if (state_ == DISCONNECT || buf.empty())
+        return;
+
+    auto events = channel_.events();
+    if (!(Demultiplex::WRITABLE & events) &&
+        send_buffer_.readableBytes() == 0)
+    {
+        // FIXME: Maybe need to handle specified error.
+        zerocopy_.send(buf);
+    }
+
+    if (!buf.empty())
+    {
+        send_buffer_.splice(buf);
+        if (!(Demultiplex::WRITABLE & events))
+            channel_.enableWrite();
     }
 }
 
@@ -130,17 +146,17 @@ void TcpConnection::sendInLoop()
     if (send_buffer_.readableBytes() == 0)
         return;
 
-    auto ctx = std::dynamic_pointer_cast<context::DmpRegisterContext>(context_);
-    if (Demultiplex::READABLE & ctx->events_)
+    if (Demultiplex::READABLE & channel_.events())
     {
 
-        auto wrote = StreamSocket::write(sockfd_, send_buffer_.peek(), send_buffer_.readableBytes());
+        // straight from the blocks, sent ones go back to the pool once the
+        // kernel is done with them
+        auto wrote = zerocopy_.send(send_buffer_);
         if (wrote > 0)
         {
-            send_buffer_.retrieve(wrote);
             if (send_buffer_.readableBytes() == 0)
             {
-                channel_->disableWrite(ctx);
+                channel_.disableWrite();
             }
         }
         // FIXME: maybe need to handle error
@@ -152,4 +168,9 @@ void TcpConnection::sendInLoop(TcpConnection & conn)
     conn.sendInLoop();
 }
 
-} // namespace reactor
\ No newline at end of file
+bool TcpConnection::reapZeroCopy()
+{
+    return zerocopy_.reap() >= 0;
+}
+
+} // namespace reactor
@@ -3,10 +3,10 @@
 #include <cstddef>
 #include <memory>
 
-#include "buffer.hpp"
+#include "chain_buffer.hpp"
 #include "channel.hpp"
-#include "context.hpp"
 #include "stream_socket.hpp"
+#include "zerocopy_sender.hpp"
 
 namespace reactor {
 
@@ -15,9 +15,6 @@ class TcpServer;
 class TcpConnection
 {
 public:
-    using ChannelPtr = std::shared_ptr<Channel>;
-    using ContextPtr = std::shared_ptr<::pubsub::Context>;
-
     enum TcpState
     {
         CONNECTED = 0x00,
@@ -25,17 +22,17 @@ public:
     };
 
 public:
-    TcpConnection(ChannelPtr const & ptr, ContextPtr const & cxt_ptr);
+    // an unspecified peer is looked up with getpeername()
+    TcpConnection(int fd, std::shared_ptr<Demultiplex> dmp,
+            InetAddr const & peer = InetAddr());
     // TcpConnection(EventLoop * const loop, ChannelPtr const & ptr);
-    TcpConnection(const TcpConnection &) = default;
-    TcpConnection(TcpConnection &&) = default;
-    TcpConnection & operator=(TcpConnection &&) = default;
-    TcpConnection & operator=(const TcpConnection &) = default;
+    TcpConnection(const TcpConnection &) = delete;
+    TcpConnection(TcpConnection &&) = delete;
+    TcpConnection & operator=(TcpConnection &&) = delete;
+    TcpConnection & operator=(const TcpConnection &) = delete;
     ~TcpConnection();
 
-    ChannelPtr & channel() noexcept;
-
-    ContextPtr & context() noexcept;
+    Channel & channel() noexcept;
 
     void disconnect();
 
@@ -44,35 +41,52 @@ public:
 
     std::string getTcpInfo() noexcept;
 
-    ArrayBuffer & recvBuffer() noexcept;
+    InetAddr const & peer() const noexcept { return addr_; }
+
+    ChainBuffer & recvBuffer() noexcept;
 
-    ArrayBuffer & sendBuffer() noexcept;
+    ChainBuffer & sendBuffer() noexcept;
 
-    void read();
+    // bytes held by this connection, buffers included
+    size_t memoryUsage() const noexcept;
 
     void shutdownWrite();
 
-    void read(void * const buf, size_t len);
+    // read into caller's memory, bypassing the receive buffer
+    ssize_t read(void * const buf, size_t len);
 
     void send(void const * const buf, size_t len);
 
+    /**
+     * @brief send the content of `buf` without copying it: whatever the
+     * socket does not take right away is spliced into the send buffer.
+     * `buf` is left empty.
+     */
+    void send(ChainBuffer & buf);
+
     void sendInLoop(TcpConnection & conn);
 
+    /**
+     * @brief collect MSG_ZEROCOPY completions, their blocks go back to
+     * the pool. false if the error queue held a real socket error.
+     */
+    bool reapZeroCopy();
+
 private:
     void sendInLoop();
 
 private:
     int         sockfd_;
     // EventLoop * loop_;
-    ChannelPtr  channel_;
+    Channel     channel_;
 
-    ArrayBuffer recv_buffer_;
-    ArrayBuffer send_buffer_;
+    ChainBuffer recv_buffer_;
+    ChainBuffer send_buffer_;
+    // large sends from send_buffer_ go out without a copy
+    ZeroCopySender zerocopy_;
 
     InetAddr    addr_;
     TcpState    state_;
-
-    ContextPtr  context_;
 };
 
-} // namespace reactor
\ No newline at end of file
+} // namespace reactor
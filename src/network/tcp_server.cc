@@ -1,7 +1,11 @@
 #include "context.hpp"
 #include "stream_socket.hpp"
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <future>
 #include <memory>
-#include <mutex>
+#include <string>
 #include <vector>
 
 #ifdef Debug
@@ -15,43 +19,68 @@
 
 namespace reactor {
 
-TcpServer::TcpServer(std::string ip, std::string port, int subloop)
+namespace {
+
+// upper bound of the fd numbers this process can hold
+size_t maxFds()
+{
+    static const size_t CAP = 1 << 20;
+
+    struct rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == RLIM_INFINITY)
+        return CAP;
+
+    return std::min(static_cast<size_t>(limit.rlim_cur), CAP);
+}
+
+} // namespace
+
+TcpServer::TcpServer(std::string ip, std::string port, int subloop,
+        Demultiplex::Backend backend)
+    : TcpServer(ip, port, [&]() {
+            LoopOptions options;
+            options.subloop_ = subloop;
+            options.backend_ = backend;
+            return options;
+        }())
+{}
+
+TcpServer::TcpServer(std::string ip, std::string port, LoopOptions const & options)
     : sub_id_(::pubsub::ID::sub_id())
     , pub_id_(::pubsub::ID::pub_id())
-    , server_(ip, port)
-    , acceptor_(std::make_shared<Acceptor>(server_()))
-    , conn_map_()
+    , server_(ip, port, options.reuse_port_)
+    , acceptor_(std::make_shared<Acceptor>(server_(), options.backlog_))
+    , shards_()
+    , owners_(maxFds())
     , center_(::pubsub::PubSubCenter::instance())
-    , loop_(acceptor_, subloop)
+    , loop_(acceptor_, options)
     , total_conn_(0)
+    , balance_(true)
 {
-    server_.listen();
-    server_.reuseAddrPort();
-    StreamSocket::setNonBlocking(server_());
-
+    center_->registerPub(pub_id_, this);
     center_->subscribe(acceptor_->pubID(), ::pubsub::ACCEPTED, this);
 
     auto const & ptrVec = loop_.dmpForLoopGroup();
     for (auto const & ptr : ptrVec)
     {
-        center_->subscribe(ptr->pubID(), ::pubsub::DMPREGISTER, this);
-        center_->subscribe(ptr->pubID(), ::pubsub::DMPMODIFY, this);
-        center_->subscribe(ptr->pubID(), ::pubsub::DMPDELETE, this);
-        center_->subscribe(ptr->pubID(), ::pubsub::DMPWAIT, this);
+        shards_.emplace(ptr.get(), std::unique_ptr<Shard>(new Shard));
+        ptr->handlers<context::DmpRegisterContext>().attach(this);
+        ptr->handlers<context::DmpDeleteContext>().attach(this);
+        ptr->handlers<context::DmpWaitContext>().attach(this);
     }
 }
 
 TcpServer::~TcpServer()
 {
     center_->unSubscribe(acceptor_->pubID(), ::pubsub::ACCEPTED, this);
+    center_->unRegisterPub(pub_id_);
 
     auto const & loop_threads = loop_.dmpForLoopGroup();
     for (auto const & ptr : loop_threads)
     {
-        center_->unSubscribe(ptr->pubID(), ::pubsub::DMPREGISTER, this);
-        center_->unSubscribe(ptr->pubID(), ::pubsub::DMPMODIFY, this);
-        center_->unSubscribe(ptr->pubID(), ::pubsub::DMPDELETE, this);
-        center_->unSubscribe(ptr->pubID(), ::pubsub::DMPWAIT, this);
+        ptr->handlers<context::DmpRegisterContext>().detach(this);
+        ptr->handlers<context::DmpDeleteContext>().detach(this);
+        ptr->handlers<context::DmpWaitContext>().detach(this);
     }
 
     loop_.stop();
@@ -63,6 +92,89 @@ void TcpServer::start()
     loop_.loop();
 }
 
+PoolStats TcpServer::connectionPoolStats()
+{
+    PoolStats stats;
+    for (auto & pair : shards_)
+        stats += pair.second->pool_.connectionStats();
+
+    return stats;
+}
+
+ChunkPool::Stats TcpServer::bufferStats()
+{
+    return ChunkPool::stats();
+}
+
+size_t TcpServer::memoryPerConnection()
+{
+    // bytes and connections of one loop
+    using Usage = std::pair<size_t, size_t>;
+
+    std::vector<std::future<Usage>> usages;
+    for (auto & pair : shards_)
+    {
+        auto shard = pair.second.get();
+        auto task = std::make_shared<std::packaged_task<Usage()>>([shard] {
+            Usage usage(0, shard->conns_.size());
+            shard->conns_.forEach([&usage](TcpConnection const & conn) {
+                usage.first += conn.memoryUsage();
+            });
+            return usage;
+        });
+        auto usage = task->get_future();
+        // a backlogged loop is left out
+        if (pair.first->runInLoop([task] { (*task)(); }))
+            usages.push_back(std::move(usage));
+    }
+
+    size_t bytes = 0;
+    size_t conns = 0;
+    for (auto & usage : usages)
+    {
+        auto one = usage.get();
+        bytes += one.first;
+        conns += one.second;
+    }
+
+    return conns == 0 ? 0 : bytes / conns;
+}
+
+bool TcpServer::closeConnection(int fd)
+{
+    auto owner = ownerOf(fd);
+    if (!owner)
+        return false;
+
+    return owner->runInLoop([this, owner, fd] { removeConnection(*shardOf(owner), fd); });
+}
+
+bool TcpServer::send(int fd, void const * const buf, size_t len)
+{
+    auto owner = ownerOf(fd);
+    if (!owner)
+        return false;
+
+    // the caller's buffer does not outlive the call
+    auto data = std::make_shared<std::string>(static_cast<char const *>(buf), len);
+    return owner->runInLoop([this, owner, fd, data] {
+        // fd may have been closed or moved on since ownerOf()
+        auto conn = shardOf(owner)->conns_.find(fd);
+        if (conn)
+            conn->send(data->data(), data->size());
+    });
+}
+
+std::vector<std::shared_ptr<Demultiplex>> TcpServer::loops()
+{
+    return loop_.dmpForLoopGroup();
+}
+
+void TcpServer::enableBalance(bool enabled)
+{
+    balance_ = enabled;
+}
+
 uint16_t TcpServer::pubID() const
 {
     return pub_id_;
@@ -70,7 +182,7 @@ uint16_t TcpServer::pubID() const
 
 void TcpServer::notify(::pubsub::PubType type, std::shared_ptr<::pubsub::Context> ctx)
 {
-    center_->notifySubscriber(pub_id_, pubsub::BALANCE, ctx);
+    center_->notifySubscriber(pub_id_, type, ctx);
 }
 
 uint16_t TcpServer::subID() const
@@ -91,155 +203,158 @@ void TcpServer::update(std::shared_ptr<::pubsub::Context> ctx)
             updateForAccept(ctx);
             break;
         }
-        case ::pubsub::DMPREGISTER:
-        {
-            updateForRegister(ctx);
-            break;
-        }
-        case ::pubsub::DMPMODIFY:
-        {
-            updateForModify(ctx);
-            break;
-        }
-        case ::pubsub::DMPDELETE:
-        {
-            updateForDelete(ctx);
-            break;
-        }
-        case ::pubsub::DMPWAIT:
-        {
-            updateForWait(ctx);
-            break;
-        }
         default:
             break;
     }
 }
 
-void TcpServer::updateForAccept(std::shared_ptr<::pubsub::Context> ctx)
+void TcpServer::handle(context::DmpRegisterContext & ctx)
 {
+    updateForRegister(ctx);
 }
 
-void TcpServer::updateForRegister(std::shared_ptr<::pubsub::Context> ctx)
+void TcpServer::handle(context::DmpDeleteContext & ctx)
 {
-    auto dmp_ctx = std::dynamic_pointer_cast<context::DmpRegisterContext>(ctx);
+    updateForDelete(ctx);
+}
+
+void TcpServer::handle(context::DmpWaitContext & ctx)
+{
+    updateForWait(ctx);
+}
 
-    auto dmp_ptr = dmp_ctx->dmp_ptr_;
-    TcpConnection::ChannelPtr channel = std::make_shared<Channel>(dmp_ctx->fd_, dmp_ptr);
+void TcpServer::updateForAccept(std::shared_ptr<::pubsub::Context> ctx)
+{
+}
+
+void TcpServer::updateForRegister(context::DmpRegisterContext & ctx)
+{
+    auto owner = ctx.dmp_ptr_.get();
+    auto shard = shardOf(owner);
+    if (!shard)
+        return;
 
     // the pointer to Demultiplex in DmpRegisterContext
     // is not necessary. It just used to construct Channel object
     // in the layer.
-    dmp_ctx->dmp_ptr_.reset();
-    dmp_ptr.reset();
-
-    std::unique_ptr<TcpConnection> conn(new TcpConnection(std::move(channel), ctx));
-    std::lock_guard<std::mutex> lk(mx_);
-    auto emplaced = conn_map_.emplace(dmp_ctx->fd_, std::move(conn));
-    center_->account(StreamSocket::getPeerAddr(dmp_ctx->fd_).toString(), 0);
-#ifdef Debug
-    auto fd = dmp_ctx->fd_;
-    if (emplaced.second)
+    auto conn = shard->pool_.acquire(ctx.fd_, std::move(ctx.dmp_ptr_), ctx.peer_);
+    auto inserted = shard->conns_.insert(ctx.fd_, std::move(conn));
+    if (inserted)
     {
         total_conn_.fetch_add(1, std::memory_order_release);
+        if (static_cast<size_t>(ctx.fd_) < owners_.size())
+            owners_[ctx.fd_].store(owner, std::memory_order_release);
+    }
+#ifdef Debug
+    auto fd = ctx.fd_;
+    if (inserted)
+    {
         std::cout << "Incoming client: " << total_conn_.load(std::memory_order_acquire)
                   << ", fd: " << fd
-                  << ", " << StreamSocket::getPeerAddr(fd).toString() << "\n";
+                  << ", " << shard->conns_.find(fd)->peer().toString() << "\n";
     }
 #endif
 }
 
-void TcpServer::updateForModify(std::shared_ptr<::pubsub::Context> ctx)
+void TcpServer::updateForDelete(context::DmpDeleteContext & ctx)
 {
-    auto dmp_ctx = std::dynamic_pointer_cast<context::DmpModifyContext>(ctx);
-
-    auto const & iter = conn_map_.find(dmp_ctx->fd_);
-    if (iter == conn_map_.end())
-        return;
-
-    auto & tcp_conn = iter->second;
-    auto conn_ctx = std::dynamic_pointer_cast<context::DmpRegisterContext>(tcp_conn->context());
-
-    if (dmp_ctx->fd_ != conn_ctx->fd_)
-        return;
-
-    conn_ctx->events_ = dmp_ctx->events_;
+    auto shard = shardOf(ctx.dmp_);
+    if (shard)
+        removeConnection(*shard, ctx.fd_);
 }
 
-void TcpServer::updateForDelete(std::shared_ptr<::pubsub::Context> ctx)
+void TcpServer::updateForWait(context::DmpWaitContext & ctx)
 {
-    auto dmp_ctx = std::dynamic_pointer_cast<context::DmpDeleteContext>(ctx);
-
-    removeConnection(dmp_ctx->fd_);
-}
-
-void TcpServer::updateForWait(std::shared_ptr<::pubsub::Context> ctx)
-{
-    auto dmp_ctx = std::dynamic_pointer_cast<context::DmpWaitContext>(ctx);
-
-    auto lb_ptr = new proxy::context::LoadBalanceCtx(pubsub::BALANCE);
-    std::shared_ptr<pubsub::Context> lb_ctx(lb_ptr);
     std::vector<int> sockes;
 
-    auto iter = conn_map_.begin();
-    for (auto & resp : dmp_ctx->resp_events_)
-    {
-        {
-            std::lock_guard<std::mutex> guard(mx_);
-            iter = conn_map_.find(resp.fd);
-            if (iter == conn_map_.end())
-                continue;
-        }
+    // resolved once per batch, every fd in it belongs to this loop
+    auto shard = shardOf(ctx.dmp_);
+    if (!shard)
+        return;
 
-        auto & tcp_conn = iter->second;
-        if ((resp.events & Demultiplex::READABLE)
-                && !(resp.events & Demultiplex::CLOSABLE)
+    for (auto & resp : ctx.resp_events_)
+    {
+        auto tcp_conn = shard->conns_.find(resp.fd);
+        if (!tcp_conn)
+            continue;
+
+        // EPOLLERR may only announce MSG_ZEROCOPY completions
+        auto events = resp.events;
+        if (ZeroCopySender::completionOnly(resp.fd, events)
+                && tcp_conn->reapZeroCopy())
+            events &= ~static_cast<uint32_t>(EPOLLERR);
+
+        if ((events & Demultiplex::READABLE)
+                && !(events & Demultiplex::CLOSABLE)
             )
         {
             // TODO: forward incoming request to proxy
-            sockes.emplace_back(resp.fd);
-
-            // TODO: comment the code. it just used to test the recv and send ability.
-            // tcp_conn->read();
-            // auto str = tcp_conn->recvBuffer().retrieveAllAsString();
-            // tcp_conn->send(str.c_str(), static_cast<size_t>(str.size()));
+            if (balance_)
+                sockes.emplace_back(resp.fd);
         }
-        else if (resp.events & Demultiplex::WRITABLE)
+        else if (events & Demultiplex::WRITABLE)
         {
-            tcp_conn->sendInLoop(*tcp_conn.get());
+            tcp_conn->sendInLoop(*tcp_conn);
         }
-        else if (resp.events & Demultiplex::CLOSABLE)
+        else if (events & Demultiplex::CLOSABLE)
         {
-            // FIXME: This call will remove monitored socket from epoll
-            // and then notify TcpServer to remove TcpConnection object
-            // mapped to the socket. But this will generating unnecessary
-            // function call overhead.
-            tcp_conn->disconnect();
-            removeConnection(resp.fd);
+            // the connection leaves the demultiplexer when it is
+            // handed back to its pool.
+            removeConnection(*shard, resp.fd);
         }
     }
 
-    lb_ptr->sockes_ = std::move(sockes);
+    if (sockes.empty())
+        return;
+
+    auto lb_ctx = std::make_shared<proxy::context::LoadBalanceCtx>(pubsub::BALANCE);
+    lb_ctx->sockes_ = std::move(sockes);
     notify(pubsub::BALANCE, std::move(lb_ctx));
 }
 
-void TcpServer::removeConnection(int sockfd)
+void TcpServer::removeConnection(Shard & shard, int sockfd)
 {
-    auto const & iter = conn_map_.find(sockfd);
-    if (iter == conn_map_.end())
+    auto conn = shard.conns_.take(sockfd);
+    if (!conn)
         return;
 
-    if (sockfd != iter->first)
-        return;
+    if (static_cast<size_t>(sockfd) < owners_.size())
+        owners_[sockfd].store(nullptr, std::memory_order_release);
 
     total_conn_.fetch_sub(1, std::memory_order_release);
+    // the fd is still open, so its number can not be taken meanwhile
+    notify(pubsub::DISCONNECTED,
+            std::make_shared<proxy::context::DisconnectContext>(pubsub::DISCONNECTED, sockfd));
 #ifdef Debug
     std::cout << "remove fd: " << sockfd << ", "
               << "Alive: " << total_conn_.load(std::memory_order_acquire)
-              << ", " << StreamSocket::getPeerAddr(sockfd).toString() << "\n";
+              << ", " << conn->getTcpInfo() << "\n";
 #endif
-    std::lock_guard<std::mutex> guard(mx_);
-    conn_map_.erase(sockfd);
+    // released once out of the table, leaving the channel re-enters
+    // updateForDelete() which then finds nothing to remove.
+    conn.reset();
+}
+
+TcpServer::Shard * TcpServer::shardOf(Demultiplex * dmp) noexcept
+{
+    auto iter = shards_.find(dmp);
+    return iter == shards_.end() ? nullptr : iter->second.get();
+}
+
+Demultiplex * TcpServer::ownerOf(int sockfd) noexcept
+{
+    if (sockfd < 0 || static_cast<size_t>(sockfd) >= owners_.size())
+        return nullptr;
+
+    return owners_[sockfd].load(std::memory_order_acquire);
+}
+
+InetAddr const * TcpServer::peerOf(int sockfd) noexcept
+{
+    auto shard = shardOf(ownerOf(sockfd));
+    auto conn = shard ? shard->conns_.find(sockfd) : nullptr;
+
+    return conn ? &conn->peer() : nullptr;
 }
 
-} // namespace reactor
\ No newline at end of file
+} // namespace reactor
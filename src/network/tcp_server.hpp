@@ -3,8 +3,16 @@
 #include <sys/types.h>
 
 #include <atomic>
-
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "chunk_pool.hpp"
+#include "connection_pool.hpp"
+#include "connection_table.hpp"
+#include "dispatcher.hpp"
 #include "eventloop.hpp"
+#include "nw_ctx.hpp"
 #include "publisher.hpp"
 #include "tcp_connection.hpp"
 // #include "worker_group.hpp"
@@ -12,18 +20,66 @@
 namespace reactor {
 
 class TcpServer : public ::pubsub::Subscriber,
-                  public pubsub::Publisher
+                  public pubsub::Publisher,
+                  public ::pubsub::Handler<context::DmpRegisterContext>,
+                  public ::pubsub::Handler<context::DmpDeleteContext>,
+                  public ::pubsub::Handler<context::DmpWaitContext>
 {
 public:
-    using TcpConnectionPtr = std::unique_ptr<TcpConnection>;
+    using TcpConnectionPtr = ConnectionPool::TcpConnectionPtr;
 
 public:
-    TcpServer(std::string ip, std::string port, int subloop = 1);
+    TcpServer(std::string ip, std::string port, int subloop = 1,
+            Demultiplex::Backend backend = Demultiplex::defaultBackend());
+
+    TcpServer(std::string ip, std::string port, LoopOptions const & options);
 
     ~TcpServer();
 
+    // runs the loops and accepts, blocking. handlers are attached before
     void start();
 
+    // aggregated over the per-loop pools
+    PoolStats connectionPoolStats();
+
+    ChunkPool::Stats bufferStats();
+
+    /**
+     * @brief average bytes held by one live connection, buffers included.
+     * every loop sums its own connections, this waits for all of them,
+     * so it is not for a loop thread.
+     */
+    size_t memoryPerConnection();
+
+    /**
+     * @brief safe from any thread: the work is posted to the loop owning
+     * fd and runs there. false if fd is unknown or its loop is backlogged.
+     */
+    bool closeConnection(int fd);
+
+    bool send(int fd, void const * const buf, size_t len);
+
+    // the sub-reactors, attach handlers to them before start()
+    std::vector<std::shared_ptr<Demultiplex>> loops();
+
+    /**
+     * @brief readable connections are published as BALANCE per batch,
+     * unless whoever handles them on the loops themselves turns it off.
+     */
+    void enableBalance(bool enabled);
+
+    // the loop owning fd, nullptr if it is not a connection of this server
+    Demultiplex * ownerOf(int sockfd) noexcept;
+
+    /**
+     * @brief the peer fd was accepted from, as its connection keeps it.
+     * only on the thread of the loop owning fd, nullptr if there is none.
+     */
+    InetAddr const * peerOf(int sockfd) noexcept;
+
+    // LoopOptions::limiter_, nullptr if connections are not limited
+    std::shared_ptr<RateLimiter> rateLimiter() const noexcept { return loop_.limiter(); }
+
 public:
     virtual uint16_t pubID() const override;
 
@@ -35,18 +91,31 @@ public:
 
     virtual void update(std::shared_ptr<::pubsub::Context> ctx) override;
 
+    virtual void handle(context::DmpRegisterContext & ctx) override;
+
+    virtual void handle(context::DmpDeleteContext & ctx) override;
+
+    virtual void handle(context::DmpWaitContext & ctx) override;
+
 private:
     void updateForAccept(std::shared_ptr<::pubsub::Context> ctx);
 
-    void updateForRegister(std::shared_ptr<::pubsub::Context> ctx);
+    void updateForRegister(context::DmpRegisterContext & ctx);
+
+    void updateForDelete(context::DmpDeleteContext & ctx);
 
-    void updateForModify(std::shared_ptr<::pubsub::Context> ctx);
+    void updateForWait(context::DmpWaitContext & ctx);
 
-    void updateForDelete(std::shared_ptr<::pubsub::Context> ctx);
+    // one per loop, only that loop's thread touches it
+    struct Shard
+    {
+        ConnectionPool  pool_;
+        ConnectionTable conns_;
+    };
 
-    void updateForWait(std::shared_ptr<::pubsub::Context> ctx);
+    Shard * shardOf(Demultiplex * dmp) noexcept;
 
-    void removeConnection(int sockfd);
+    void removeConnection(Shard & shard, int sockfd);
 
     friend void TcpConnection::sendInLoop(TcpConnection & conn);
 
@@ -55,15 +124,19 @@ private:
     uint16_t                                    pub_id_;
     StreamSocket                                server_;
     std::shared_ptr<Acceptor>                   acceptor_;
-    std::unordered_map<int, TcpConnectionPtr>   conn_map_;
+    // filled before the loops take connections, read-only afterwards
+    std::unordered_map<Demultiplex *,
+        std::unique_ptr<Shard>>                 shards_;
+    // fd -> owning loop, written by the owner only
+    std::vector<std::atomic<Demultiplex *>>     owners_;
     std::shared_ptr<::pubsub::PubSubCenter>       center_;
 
-    std::mutex                                  mx_;
     EventLoop                                   loop_;
     // std::vector<EventLoop>                      loops_;
     // WorkerGroup                                 workers_;
 
     std::atomic<ssize_t>                        total_conn_;
+    bool                                        balance_;
 };
 
 } // namespace reactor
\ No newline at end of file
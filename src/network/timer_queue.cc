@@ -0,0 +1,281 @@
+#include <climits>
+
+#include "timer_queue.hpp"
+
+namespace reactor {
+
+namespace {
+
+constexpr uint64_t spanOf(size_t level) noexcept
+{
+    return uint64_t(1) << (level * TimerQueue::SLOT_BITS);
+}
+
+} // namespace
+
+TimerQueue::TimerQueue()
+    : origin_(Clock::now())
+    , elapsed_(0)
+    , nodes_()
+    , free_(NIL)
+    , heads_()
+    , tails_()
+    , used_()
+    , count_(0)
+{
+    for (size_t i = 0; i < LEVELS * SLOTS; i++)
+    {
+        heads_[i] = NIL;
+        tails_[i] = NIL;
+    }
+}
+
+TimerQueue::TimerId TimerQueue::add(Clock::time_point when, Task task, Clock::duration interval)
+{
+    uint32_t index = free_;
+    if (index != NIL)
+        free_ = nodes_[index].next_;
+    else
+    {
+        index = static_cast<uint32_t>(nodes_.size());
+        nodes_.emplace_back();
+        nodes_.back().gen_ = 0;
+    }
+
+    auto & node = nodes_[index];
+    node.task_ = std::move(task);
+    node.tick_ = tickOf(when);
+    // a period below the resolution still takes a tick
+    auto period = std::chrono::duration_cast<std::chrono::milliseconds>(interval).count();
+    node.interval_ = interval > Clock::duration::zero()
+            ? static_cast<uint64_t>(period > 0 ? period : 1) : 0;
+    node.slot_ = UNLINKED;
+    node.armed_ = true;
+    place(index);
+    count_++;
+
+    return (static_cast<TimerId>(node.gen_) << 32) | (index + 1);
+}
+
+bool TimerQueue::cancel(TimerId id)
+{
+    auto index = static_cast<uint32_t>(id & UINT32_MAX) - 1;
+    if (id == 0 || index >= nodes_.size())
+        return false;
+
+    auto & node = nodes_[index];
+    if (!node.armed_ || node.gen_ != static_cast<uint32_t>(id >> 32))
+        return false;
+
+    // a periodic timer running right now is linked nowhere
+    if (node.slot_ != UNLINKED)
+        unlink(index);
+    release(index);
+
+    return true;
+}
+
+int TimerQueue::timeout(Clock::time_point now) const
+{
+    auto next = nextTick();
+    if (next == NEVER)
+        return -1;
+
+    auto when = origin_ + std::chrono::milliseconds(next);
+    if (when <= now)
+        return 0;
+
+    // rounded up, waking early would only spin until it is due
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+            when - now + std::chrono::milliseconds(1) - Clock::duration(1)).count();
+
+    return wait > INT_MAX ? INT_MAX : static_cast<int>(wait);
+}
+
+size_t TimerQueue::expire(Clock::time_point now)
+{
+    auto now_tick = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(now - origin_).count());
+    size_t count = 0;
+    // from one tick where something happens to the next, the empty ones
+    // in between are skipped
+    for (auto tick = nextTick(); tick <= now_tick; tick = nextTick())
+    {
+        // timers added from here on are due after this tick
+        elapsed_ = tick;
+        for (size_t level = LEVELS - 1; level > 0; level--)
+        {
+            if ((tick & (spanOf(level) - 1)) == 0)
+                cascade(level, (tick >> (level * SLOT_BITS)) & (SLOTS - 1));
+        }
+
+        auto slot = static_cast<uint16_t>(tick & (SLOTS - 1));
+        while (heads_[slot] != NIL)
+        {
+            auto index = heads_[slot];
+            unlink(index);
+
+            auto & node = nodes_[index];
+            auto task = std::move(node.task_);
+            if (node.interval_ == 0)
+            {
+                // gone before it runs, the task may add or cancel timers
+                release(index);
+                task();
+                count++;
+                continue;
+            }
+
+            auto gen = node.gen_;
+            task();
+            count++;
+            // nodes_ may have grown, and the timer been cancelled
+            auto & again = nodes_[index];
+            if (!again.armed_ || again.gen_ != gen || again.slot_ != UNLINKED)
+                continue;
+
+            again.task_ = std::move(task);
+            // missed periods are dropped, not caught up on
+            again.tick_ += again.interval_;
+            if (again.tick_ <= elapsed_)
+                again.tick_ = elapsed_ + 1;
+            place(index);
+        }
+    }
+
+    if (now_tick > elapsed_)
+        elapsed_ = now_tick;
+
+    return count;
+}
+
+uint64_t TimerQueue::tickOf(Clock::time_point when) const noexcept
+{
+    if (when <= origin_)
+        return 0;
+
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                when - origin_ + std::chrono::milliseconds(1) - Clock::duration(1)).count());
+}
+
+void TimerQueue::place(uint32_t index)
+{
+    auto & node = nodes_[index];
+    // already due: the next tick
+    if (node.tick_ <= elapsed_)
+        node.tick_ = elapsed_ + 1;
+
+    auto delta = node.tick_ - elapsed_;
+    size_t level = 0;
+    while (level < LEVELS - 1 && delta >= spanOf(level + 1))
+        level++;
+    // beyond the wheel: parked in the farthest slot, placed again from there
+    auto tick = delta < spanOf(LEVELS) ? node.tick_ : elapsed_ + spanOf(LEVELS) - 1;
+
+    link(index, level, (tick >> (level * SLOT_BITS)) & (SLOTS - 1));
+}
+
+void TimerQueue::link(uint32_t index, size_t level, size_t index_in_level)
+{
+    auto & node = nodes_[index];
+    auto slot = static_cast<uint16_t>(level * SLOTS + index_in_level);
+    node.slot_ = slot;
+    node.next_ = NIL;
+    node.prev_ = tails_[slot];
+    if (tails_[slot] != NIL)
+        nodes_[tails_[slot]].next_ = index;
+    else
+        heads_[slot] = index;
+    tails_[slot] = index;
+    used_[level][index_in_level / 64] |= uint64_t(1) << (index_in_level % 64);
+}
+
+void TimerQueue::unlink(uint32_t index)
+{
+    auto & node = nodes_[index];
+    auto slot = node.slot_;
+    if (node.prev_ != NIL)
+        nodes_[node.prev_].next_ = node.next_;
+    else
+        heads_[slot] = node.next_;
+    if (node.next_ != NIL)
+        nodes_[node.next_].prev_ = node.prev_;
+    else
+        tails_[slot] = node.prev_;
+
+    if (heads_[slot] == NIL)
+    {
+        auto level = slot / SLOTS;
+        auto index_in_level = slot % SLOTS;
+        used_[level][index_in_level / 64] &= ~(uint64_t(1) << (index_in_level % 64));
+    }
+    node.slot_ = UNLINKED;
+}
+
+void TimerQueue::release(uint32_t index)
+{
+    auto & node = nodes_[index];
+    node.task_ = nullptr;
+    node.armed_ = false;
+    node.gen_++;
+    node.next_ = free_;
+    free_ = index;
+    count_--;
+}
+
+void TimerQueue::cascade(size_t level, size_t slot)
+{
+    auto list = static_cast<uint16_t>(level * SLOTS + slot);
+    while (heads_[list] != NIL)
+    {
+        auto index = heads_[list];
+        unlink(index);
+        // due this very tick, which runs right after
+        if (nodes_[index].tick_ <= elapsed_)
+            link(index, 0, elapsed_ & (SLOTS - 1));
+        else
+            place(index);
+    }
+}
+
+uint64_t TimerQueue::nextTick() const noexcept
+{
+    if (count_ == 0)
+        return NEVER;
+
+    auto next = NEVER;
+    // the lowest level runs its slots, those above move theirs down
+    // when the tick crosses into their span
+    for (size_t level = 0; level < LEVELS; level++)
+    {
+        auto shift = level * SLOT_BITS;
+        auto base = (elapsed_ >> shift) + 1;
+        auto ahead = distance(level, base & (SLOTS - 1));
+        if (ahead == SLOTS)
+            continue;
+
+        auto tick = (base + ahead) << shift;
+        if (tick < next)
+            next = tick;
+    }
+
+    return next;
+}
+
+size_t TimerQueue::distance(size_t level, size_t from) const noexcept
+{
+    for (size_t seen = 0; seen < SLOTS; )
+    {
+        auto slot = (from + seen) & (SLOTS - 1);
+        auto word = used_[level][slot / 64] >> (slot % 64);
+        if (word)
+            return seen + __builtin_ctzll(word);
+
+        // on to the next word, or the wrap to slot 0
+        seen += 64 - slot % 64;
+    }
+
+    return SLOTS;
+}
+
+} // namespace reactor
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace reactor {
+
+/**
+ * @brief one-shot and periodic timers of one loop on a hierarchical
+ * timing wheel: four levels of 256 slots, 1ms apart on the lowest one.
+ * adding and cancelling are O(1), a timer is a node in one array the
+ * wheel links by index, not an allocation of its own. timers further
+ * out wait on a coarser level and move down as their time nears. the
+ * loop waits at most until the next slot that holds something and runs
+ * the due timers after its batch of events. loop thread only.
+ */
+class TimerQueue
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using Task = std::function<void()>;
+    // 0 is never handed out
+    using TimerId = uint64_t;
+
+    constexpr static size_t const LEVELS = 4;
+    constexpr static size_t const SLOT_BITS = 8;
+    constexpr static size_t const SLOTS = size_t(1) << SLOT_BITS;
+
+public:
+    TimerQueue();
+    TimerQueue(const TimerQueue &) = delete;
+    TimerQueue & operator=(const TimerQueue &) = delete;
+    ~TimerQueue() = default;
+
+    /**
+     * @brief run task at when, rounded up to the next millisecond. with
+     * an interval it runs again every interval until it is cancelled,
+     * the id stays the same.
+     */
+    TimerId add(Clock::time_point when, Task task,
+            Clock::duration interval = Clock::duration::zero());
+
+    // false if id already ran or is unknown. a periodic timer may cancel
+    // itself from its task
+    bool cancel(TimerId id);
+
+    // milliseconds until the earliest deadline, rounded up. -1 if none
+    int timeout(Clock::time_point now) const;
+
+    // run everything due by now, returns how many ran
+    size_t expire(Clock::time_point now);
+
+    size_t size() const noexcept { return count_; }
+
+private:
+    constexpr static uint32_t const NIL = UINT32_MAX;
+    constexpr static uint16_t const UNLINKED = UINT16_MAX;
+    constexpr static uint64_t const NEVER = UINT64_MAX;
+
+    struct Node
+    {
+        Task        task_;
+        uint64_t    tick_;          // due at, in ms since origin_
+        uint64_t    interval_;      // ms, 0 for one-shot
+        uint32_t    prev_;
+        uint32_t    next_;          // also links the free nodes
+        uint32_t    gen_;           // bumped on release, stale ids miss
+        uint16_t    slot_;          // level * SLOTS + index, or UNLINKED
+        bool        armed_;
+    };
+
+    // first ms tick at or after when
+    uint64_t tickOf(Clock::time_point when) const noexcept;
+
+    // link node into the slot its tick falls in, seen from elapsed_
+    void place(uint32_t index);
+
+    void link(uint32_t index, size_t level, size_t index_in_level);
+
+    void unlink(uint32_t index);
+
+    void release(uint32_t index);
+
+    // move everything in slot of level down, it comes due within its span.
+    // elapsed_ is the tick being run
+    void cascade(size_t level, size_t slot);
+
+    // the earliest tick anything runs or moves down at, NEVER if empty
+    uint64_t nextTick() const noexcept;
+
+    // slots from `from` on, wrapping, to the first one in use. SLOTS if none
+    size_t distance(size_t level, size_t from) const noexcept;
+
+private:
+    Clock::time_point           origin_;
+    uint64_t                    elapsed_;       // every tick up to it has run
+    std::vector<Node>           nodes_;
+    uint32_t                    free_;
+    uint32_t                    heads_[LEVELS * SLOTS];
+    uint32_t                    tails_[LEVELS * SLOTS];
+    uint64_t                    used_[LEVELS][SLOTS / 64];
+    size_t                      count_;
+};
+
+} // namespace reactor
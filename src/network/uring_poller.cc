@@ -0,0 +1,872 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+#include "demultiplex.hpp"
+#include "uring_poller.hpp"
+
+namespace reactor {
+
+namespace {
+
+inline int uringSetup(unsigned entries, struct io_uring_params * p)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+inline int uringRegister(int fd, unsigned opcode, void * arg, unsigned nr_args)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+// flags epoll understands but poll(2) masks must not carry
+const uint32_t EPOLL_ONLY = EPOLLET | EPOLLONESHOT | EPOLLEXCLUSIVE | EPOLLWAKEUP;
+
+} // namespace
+
+UringPoller::UringPoller()
+    : ring_fd_(-1)
+    , sq_ptr_(MAP_FAILED)
+    , sq_size_(0)
+    , cq_ptr_(MAP_FAILED)
+    , cq_size_(0)
+    , sqes_(static_cast<struct io_uring_sqe *>(MAP_FAILED))
+    , sqes_size_(0)
+    , sq_head_(nullptr)
+    , sq_tail_(nullptr)
+    , sq_mask_(0)
+    , sq_entries_(0)
+    , cq_head_(nullptr)
+    , cq_tail_(nullptr)
+    , cq_mask_(0)
+    , cqes_(nullptr)
+    , sqe_tail_(0)
+    , to_submit_(0)
+    , buf_ring_(static_cast<struct io_uring_buf_ring *>(MAP_FAILED))
+    , buf_ring_size_(0)
+    , bufs_(nullptr)
+    , buf_tail_(0)
+    , received_()
+    , claimed_(BUF_ENTRIES, false)
+    , starved_()
+    , fds_()
+    , sends_()
+    , free_sends_()
+    , splices_()
+    , free_splices_()
+    , owner_()
+    , mx_()
+{
+    struct io_uring_params params;
+    ::memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CLAMP;
+
+    if ((ring_fd_ = uringSetup(ENTRIES, &params)) < 0)
+        throw std::runtime_error("can not create io_uring instance");
+
+    try {
+        if (!(params.features & IORING_FEAT_NODROP)
+                || !(params.features & IORING_FEAT_EXT_ARG))
+            throw std::runtime_error("io_uring is too old");
+
+        sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+
+        sq_ptr_ = ::mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+        if (sq_ptr_ == MAP_FAILED)
+            throw std::runtime_error("can not map io_uring sq ring");
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            cq_ptr_ = sq_ptr_;
+        else
+        {
+            cq_ptr_ = ::mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+            if (cq_ptr_ == MAP_FAILED)
+                throw std::runtime_error("can not map io_uring cq ring");
+        }
+
+        sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes_ = static_cast<struct io_uring_sqe *>(::mmap(nullptr, sqes_size_,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+        if (sqes_ == MAP_FAILED)
+            throw std::runtime_error("can not map io_uring sqes");
+
+        char * sq = static_cast<char *>(sq_ptr_);
+        char * cq = static_cast<char *>(cq_ptr_);
+        sq_head_    = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sq_tail_    = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask_    = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        cq_head_    = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail_    = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask_    = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes_       = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        // slot i of the sq array always points at sqe i
+        unsigned * array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries_; i++)
+            array[i] = i;
+        sqe_tail_ = *sq_tail_;
+
+        // registering the buffer ring doubles as the 5.19 check
+        buf_ring_size_ = BUF_ENTRIES * sizeof(struct io_uring_buf);
+        buf_ring_ = static_cast<struct io_uring_buf_ring *>(::mmap(nullptr, buf_ring_size_,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (buf_ring_ == MAP_FAILED)
+            throw std::runtime_error("can not map provided buffer ring");
+        buf_ring_->tail = 0;
+
+        struct io_uring_buf_reg reg;
+        ::memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+        reg.ring_entries = BUF_ENTRIES;
+        reg.bgid = BUF_GROUP;
+        if (uringRegister(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+            throw std::runtime_error("can not register provided buffer ring");
+    } catch (...) {
+        if (buf_ring_ != MAP_FAILED)
+            ::munmap(buf_ring_, buf_ring_size_);
+        if (sqes_ != MAP_FAILED)
+            ::munmap(sqes_, sqes_size_);
+        if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_)
+            ::munmap(cq_ptr_, cq_size_);
+        if (sq_ptr_ != MAP_FAILED)
+            ::munmap(sq_ptr_, sq_size_);
+        ::close(ring_fd_);
+        throw;
+    }
+}
+
+UringPoller::~UringPoller()
+{
+    // closing the ring cancels whatever is still in flight
+    ::close(ring_fd_);
+
+    ::munmap(buf_ring_, buf_ring_size_);
+    ::munmap(sqes_, sqes_size_);
+    if (cq_ptr_ != sq_ptr_)
+        ::munmap(cq_ptr_, cq_size_);
+    ::munmap(sq_ptr_, sq_size_);
+    delete [] bufs_;
+}
+
+int UringPoller::add(int fd, uint32_t events)
+{
+    if (fd < 0)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> guard(mx_);
+
+    auto & st = state(fd);
+    if (st.polled_)
+    {
+        errno = EEXIST;
+        return -1;
+    }
+    st.poll_++;
+    st.events_ = events;
+    st.polled_ = true;
+    armPoll(fd);
+    flush(false);
+
+    return 0;
+}
+
+int UringPoller::modify(int fd, uint32_t events)
+{
+    std::lock_guard<std::mutex> guard(mx_);
+
+    if (fd < 0 || static_cast<size_t>(fd) >= fds_.size() || !fds_[fd].polled_)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (fds_[fd].events_ == events)
+        return 0;
+
+    rearmPoll(fd, events);
+    flush(false);
+
+    return 0;
+}
+
+int UringPoller::remove(int fd)
+{
+    std::lock_guard<std::mutex> guard(mx_);
+
+    if (fd < 0 || static_cast<size_t>(fd) >= fds_.size())
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    auto & st = fds_[fd];
+    st.gen_++;
+    st.poll_++;
+    st.events_ = 0;
+    st.polled_ = false;
+    st.accept_ = false;
+    st.recv_   = false;
+
+    // the cancel looks the fd up when it is issued, the caller is
+    // about to close it, so it can not wait for the next batch
+    cancel(fd);
+    flush(true);
+
+    return 0;
+}
+
+int UringPoller::wait(std::vector<Resp> & resp, int max, int timeout)
+{
+    unsigned to_submit = 0;
+    bool ready = false;
+    {
+        std::lock_guard<std::mutex> guard(mx_);
+        owner_ = std::this_thread::get_id();
+        flush(false);
+        to_submit = to_submit_;
+        to_submit_ = 0;
+        ready = *cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    }
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    ::memset(&arg, 0, sizeof(arg));
+    unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    if (timeout >= 0)
+    {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+    }
+
+    auto ret = enter(to_submit, ready ? 0 : 1, flags, &arg, sizeof(arg));
+
+    std::lock_guard<std::mutex> guard(mx_);
+    // whatever did not go out is retried with the next submission,
+    // over-counting is harmless, the kernel stops at the sq tail
+    if (ret < 0)
+        to_submit_ += to_submit;
+    else if (static_cast<unsigned>(ret) < to_submit)
+        to_submit_ += to_submit - ret;
+
+    int count = 0;
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail && count < max; head++)
+    {
+        auto before = resp.size();
+        complete(cqes_[head & cq_mask_], resp);
+        count += static_cast<int>(resp.size() - before);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+    if (ret < 0 && count == 0 && errno != ETIME && errno != EINTR)
+        return -1;
+
+    return count;
+}
+
+void UringPoller::afterDispatch()
+{
+    std::lock_guard<std::mutex> guard(mx_);
+
+    bool provided = false;
+    for (auto buf : received_)
+    {
+        if (claimed_[buf])
+            continue;
+        provide(buf);
+        provided = true;
+    }
+    received_.clear();
+
+    if (provided && !starved_.empty())
+    {
+        for (auto fd : starved_)
+        {
+            if (static_cast<size_t>(fd) < fds_.size() && fds_[fd].recv_)
+                armRecv(fd);
+        }
+        starved_.clear();
+    }
+}
+
+int UringPoller::acceptMultishot(int fd)
+{
+    if (fd < 0)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> guard(mx_);
+
+    auto & st = state(fd);
+    if (st.accept_)
+        return 0;
+    st.accept_ = true;
+    armAccept(fd);
+    flush(false);
+
+    return 0;
+}
+
+int UringPoller::recvMultishot(int fd)
+{
+    if (fd < 0)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> guard(mx_);
+
+    if (!bufs_)
+    {
+        bufs_ = new char[static_cast<size_t>(BUF_ENTRIES) * BUF_SIZE];
+        for (unsigned i = 0; i < BUF_ENTRIES; i++)
+            provide(static_cast<uint16_t>(i));
+    }
+
+    auto & st = state(fd);
+    if (st.recv_)
+        return 0;
+    st.recv_ = true;
+    armRecv(fd);
+
+    // the recv reports data from now on, readiness only has to cover errors
+    if (st.polled_ && (st.events_ & EPOLLIN))
+        rearmPoll(fd, st.events_ & ~static_cast<uint32_t>(EPOLLIN));
+    flush(false);
+
+    return 0;
+}
+
+int UringPoller::sendReceived(int fd, Resp const & received)
+{
+    if (fd < 0 || !(received.events & Demultiplex::RECEIVED) || received.res <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> guard(mx_);
+
+    uint32_t idx;
+    if (free_sends_.empty())
+    {
+        idx = static_cast<uint32_t>(sends_.size());
+        sends_.push_back(SendOp());
+    }
+    else
+    {
+        idx = free_sends_.back();
+        free_sends_.pop_back();
+    }
+
+    auto & op = sends_[idx];
+    op.fd_   = fd;
+    op.buf_  = static_cast<uint16_t>(received.buf);
+    op.data_ = received.data;
+    op.len_  = static_cast<uint32_t>(received.res);
+    op.off_  = 0;
+    op.next_ = -1;
+
+    // the buffer goes back to the ring once the send completed
+    claimed_[op.buf_] = true;
+
+    // a send still in flight to fd goes first, concurrent sends on
+    // one socket may interleave
+    auto & st = state(fd);
+    if (st.send_tail_ != -1)
+    {
+        sends_[st.send_tail_].next_ = static_cast<int32_t>(idx);
+        st.send_tail_ = static_cast<int32_t>(idx);
+        return 0;
+    }
+    st.send_head_ = st.send_tail_ = static_cast<int32_t>(idx);
+    armSend(idx);
+    flush(false);
+
+    return 0;
+}
+
+int UringPoller::spliceLinked(int in_fd, int out_fd, int pipe_r, int pipe_w, size_t len)
+{
+    if (in_fd < 0 || out_fd < 0)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> guard(mx_);
+
+    auto & st = state(in_fd);
+    if (st.splice_ != -1)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    uint32_t idx;
+    if (free_splices_.empty())
+    {
+        idx = static_cast<uint32_t>(splices_.size());
+        splices_.push_back(SpliceOp());
+    }
+    else
+    {
+        idx = free_splices_.back();
+        free_splices_.pop_back();
+    }
+
+    auto & op = splices_[idx];
+    op.in_fd_   = in_fd;
+    op.out_fd_  = out_fd;
+    op.pipe_r_  = pipe_r;
+    op.in_gen_  = st.gen_;
+    op.in_res_  = 0;
+    op.out_     = 0;
+    op.out_err_ = 0;
+    op.out_full_ = false;
+    op.pending_ = 2;
+    st.splice_ = static_cast<int32_t>(idx);
+
+    auto len32 = static_cast<uint32_t>(std::min<size_t>(len, INT32_MAX));
+
+    // in_fd -> pipe, hard linked to pipe -> out_fd so a short first
+    // splice does not cancel the second one: the pipe is nonblocking, it
+    // moves whatever arrived and finds an empty pipe when nothing did.
+    // completeSplice() moves what out_fd did not take.
+    auto s = sqe();
+    s->opcode = IORING_OP_SPLICE;
+    s->flags = IOSQE_IO_HARDLINK;
+    s->fd = pipe_w;
+    s->off = static_cast<uint64_t>(-1);
+    s->splice_fd_in = in_fd;
+    s->splice_off_in = static_cast<uint64_t>(-1);
+    s->len = len32;
+    s->splice_flags = SPLICE_F_MOVE;
+    s->user_data = pack(SPLICE_IN, idx, in_fd);
+
+    s = sqe();
+    s->opcode = IORING_OP_SPLICE;
+    s->fd = out_fd;
+    s->off = static_cast<uint64_t>(-1);
+    s->splice_fd_in = pipe_r;
+    s->splice_off_in = static_cast<uint64_t>(-1);
+    s->len = len32;
+    s->splice_flags = SPLICE_F_MOVE;
+    s->user_data = pack(SPLICE_OUT, idx, out_fd);
+
+    flush(false);
+
+    return 0;
+}
+
+uint64_t UringPoller::pack(Op op, uint32_t tag, int fd) noexcept
+{
+    return (static_cast<uint64_t>(op) << 56)
+            | (static_cast<uint64_t>(tag & 0xffffff) << 32)
+            | static_cast<uint32_t>(fd);
+}
+
+UringPoller::FdState & UringPoller::state(int fd)
+{
+    if (static_cast<size_t>(fd) >= fds_.size())
+    {
+        FdState st;
+        st.events_ = 0;
+        st.gen_    = 0;
+        st.poll_   = 0;
+        st.polled_ = false;
+        st.accept_ = false;
+        st.recv_   = false;
+        st.splice_ = -1;
+        st.send_head_ = -1;
+        st.send_tail_ = -1;
+        fds_.resize(fd + 1, st);
+    }
+
+    return fds_[fd];
+}
+
+bool UringPoller::current(int fd, uint32_t gen) const noexcept
+{
+    return fd >= 0 && static_cast<size_t>(fd) < fds_.size()
+            && (fds_[fd].gen_ & 0xffffff) == gen;
+}
+
+struct io_uring_sqe * UringPoller::sqe()
+{
+    // the sq is full, push it to the kernel to make room
+    while (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+    {
+        flush(true);
+        if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+            std::this_thread::yield();
+    }
+
+    auto s = &sqes_[sqe_tail_ & sq_mask_];
+    ::memset(s, 0, sizeof(*s));
+    sqe_tail_++;
+    to_submit_++;
+
+    return s;
+}
+
+void UringPoller::flush(bool now)
+{
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+
+    // the loop thread submits with its next wait
+    if (to_submit_ == 0
+            || (!now && owner_ == std::this_thread::get_id()))
+        return;
+
+    auto ret = enter(to_submit_, 0, 0);
+    if (ret > 0)
+        to_submit_ -= std::min(to_submit_, static_cast<unsigned>(ret));
+}
+
+int UringPoller::enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+            void * arg, size_t argsz)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd_,
+                to_submit, min_complete, flags, arg, argsz));
+}
+
+void UringPoller::rearmPoll(int fd, uint32_t events)
+{
+    auto & st = fds_[fd];
+
+    // drop the armed poll, its CQEs turn stale with the new generation
+    auto s = sqe();
+    s->opcode = IORING_OP_POLL_REMOVE;
+    s->fd = -1;
+    s->addr = pack(POLL, st.poll_, fd);
+    s->user_data = pack(CANCEL, 0, fd);
+
+    st.poll_++;
+    st.events_ = events;
+    armPoll(fd);
+}
+
+void UringPoller::armPoll(int fd)
+{
+    auto & st = fds_[fd];
+    auto s = sqe();
+    s->opcode = IORING_OP_POLL_ADD;
+    s->fd = fd;
+    s->poll32_events = st.events_ & ~EPOLL_ONLY;
+    s->len = IORING_POLL_ADD_MULTI;
+    s->user_data = pack(POLL, st.poll_, fd);
+}
+
+void UringPoller::armAccept(int fd)
+{
+    auto s = sqe();
+    s->opcode = IORING_OP_ACCEPT;
+    s->fd = fd;
+    s->ioprio = IORING_ACCEPT_MULTISHOT;
+    s->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    s->user_data = pack(ACCEPT, fds_[fd].gen_, fd);
+}
+
+void UringPoller::armRecv(int fd)
+{
+    auto s = sqe();
+    s->opcode = IORING_OP_RECV;
+    s->flags = IOSQE_BUFFER_SELECT;
+    s->fd = fd;
+    s->ioprio = IORING_RECV_MULTISHOT;
+    s->buf_group = BUF_GROUP;
+    s->user_data = pack(RECV, fds_[fd].gen_, fd);
+}
+
+void UringPoller::armSend(uint32_t idx)
+{
+    auto & op = sends_[idx];
+    auto s = sqe();
+    s->opcode = IORING_OP_SEND;
+    s->fd = op.fd_;
+    s->addr = reinterpret_cast<uint64_t>(op.data_ + op.off_);
+    s->len = op.len_ - op.off_;
+    s->msg_flags = MSG_NOSIGNAL;
+    s->user_data = pack(SEND, idx, op.fd_);
+}
+
+void UringPoller::popSend(int fd, std::vector<Resp> & resp, int32_t res)
+{
+    auto & st = fds_[fd];
+    while (st.send_head_ != -1)
+    {
+        auto idx = static_cast<uint32_t>(st.send_head_);
+        auto & op = sends_[idx];
+        st.send_head_ = op.next_;
+        if (st.send_head_ == -1)
+            st.send_tail_ = -1;
+
+        provide(op.buf_);
+        emit(resp, fd, Demultiplex::SENT, res);
+        free_sends_.push_back(idx);
+
+        // after an error the rest of the queue fails with it
+        if (res >= 0)
+            break;
+    }
+
+    if (st.send_head_ != -1)
+        armSend(static_cast<uint32_t>(st.send_head_));
+}
+
+void UringPoller::armSpliceOut(uint32_t idx, uint32_t len, bool wait)
+{
+    auto & op = splices_[idx];
+    op.out_full_ = false;
+    op.pending_++;
+
+    // the splice itself does not wait on a nonblocking socket
+    if (wait)
+    {
+        op.pending_++;
+        auto s = sqe();
+        s->opcode = IORING_OP_POLL_ADD;
+        s->flags = IOSQE_IO_LINK;
+        s->fd = op.out_fd_;
+        s->poll32_events = POLLOUT;
+        s->user_data = pack(SPLICE_WAIT, idx, op.out_fd_);
+    }
+
+    auto s = sqe();
+    s->opcode = IORING_OP_SPLICE;
+    s->fd = op.out_fd_;
+    s->off = static_cast<uint64_t>(-1);
+    s->splice_fd_in = op.pipe_r_;
+    s->splice_off_in = static_cast<uint64_t>(-1);
+    s->len = len;
+    s->splice_flags = SPLICE_F_MOVE;
+    s->user_data = pack(SPLICE_OUT, idx, op.out_fd_);
+}
+
+void UringPoller::cancel(int fd)
+{
+    auto s = sqe();
+    s->opcode = IORING_OP_ASYNC_CANCEL;
+    s->fd = fd;
+    s->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    s->user_data = pack(CANCEL, 0, fd);
+}
+
+void UringPoller::provide(uint16_t buf)
+{
+    // the ring is an array of io_uring_buf, `bufs` is not at offset 0
+    // when the flexible array macro is compiled as C++
+    auto & slot = reinterpret_cast<struct io_uring_buf *>(buf_ring_)[buf_tail_ & (BUF_ENTRIES - 1)];
+    slot.addr = reinterpret_cast<uint64_t>(bufs_ + static_cast<size_t>(buf) * BUF_SIZE);
+    slot.len = BUF_SIZE;
+    slot.bid = buf;
+    buf_tail_++;
+    claimed_[buf] = false;
+
+    __atomic_store_n(&buf_ring_->tail, buf_tail_, __ATOMIC_RELEASE);
+}
+
+void UringPoller::complete(struct io_uring_cqe const & cqe, std::vector<Resp> & resp)
+{
+    auto op   = static_cast<Op>(cqe.user_data >> 56);
+    auto tag  = static_cast<uint32_t>(cqe.user_data >> 32) & 0xffffff;
+    auto fd   = static_cast<int>(static_cast<uint32_t>(cqe.user_data));
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+
+    switch (op) {
+        case POLL:
+        {
+            if (fd < 0 || static_cast<size_t>(fd) >= fds_.size()
+                    || (fds_[fd].poll_ & 0xffffff) != tag || !fds_[fd].polled_)
+                break;
+
+            if (cqe.res >= 0)
+            {
+                emit(resp, fd, static_cast<uint32_t>(cqe.res));
+                // the kernel may end a multishot poll at any time
+                if (!more)
+                    armPoll(fd);
+            }
+            else if (cqe.res != -ECANCELED)
+                emit(resp, fd, EPOLLERR, cqe.res);
+            break;
+        }
+        case ACCEPT:
+        {
+            if (!current(fd, tag) || !fds_[fd].accept_)
+            {
+                if (cqe.res >= 0)
+                    ::close(cqe.res);
+                break;
+            }
+
+            if (cqe.res >= 0)
+                emit(resp, fd, Demultiplex::ACCEPTED, cqe.res);
+            if (!more && cqe.res != -ECANCELED)
+                armAccept(fd);
+            break;
+        }
+        case RECV:
+        {
+            bool has_buf = cqe.flags & IORING_CQE_F_BUFFER;
+            auto buf = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+            bool live = current(fd, tag) && fds_[fd].recv_;
+            if (!live)
+            {
+                if (has_buf)
+                    provide(buf);
+                break;
+            }
+
+            if (cqe.res > 0 && has_buf)
+            {
+                received_.push_back(buf);
+                emit(resp, fd, Demultiplex::RECEIVED, cqe.res,
+                        bufs_ + static_cast<size_t>(buf) * BUF_SIZE, buf);
+                if (!more)
+                    armRecv(fd);
+            }
+            else if (cqe.res == -ENOBUFS)
+                starved_.push_back(fd);
+            else if (cqe.res == 0)
+            {
+                fds_[fd].recv_ = false;
+                emit(resp, fd, Demultiplex::RECEIVED | EPOLLRDHUP);
+            }
+            else if (cqe.res != -ECANCELED)
+            {
+                fds_[fd].recv_ = false;
+                emit(resp, fd, Demultiplex::RECEIVED | EPOLLERR, cqe.res);
+            }
+            break;
+        }
+        case SEND:
+        {
+            auto & send = sends_[tag];
+            if (cqe.res > 0)
+            {
+                send.off_ += cqe.res;
+                if (send.off_ < send.len_)
+                {
+                    armSend(tag);
+                    break;
+                }
+            }
+
+            popSend(send.fd_, resp, cqe.res > 0 ? static_cast<int32_t>(send.len_) : cqe.res);
+            break;
+        }
+        case SPLICE_IN:
+        {
+            auto & splice = splices_[tag];
+            splice.pending_--;
+            splice.in_res_ = cqe.res;
+            completeSplice(tag, resp);
+            break;
+        }
+        case SPLICE_OUT:
+        {
+            auto & splice = splices_[tag];
+            splice.pending_--;
+            // EAGAIN is a full out_fd, or an empty pipe when the in
+            // side moved nothing, which ends the splice anyway
+            if (cqe.res > 0)
+                splice.out_ += cqe.res;
+            else if (cqe.res == -EAGAIN)
+                splice.out_full_ = true;
+            else if (cqe.res != -ECANCELED)
+                splice.out_err_ = cqe.res;
+            completeSplice(tag, resp);
+            break;
+        }
+        case SPLICE_WAIT:
+        {
+            auto & splice = splices_[tag];
+            splice.pending_--;
+            if (cqe.res < 0 && cqe.res != -ECANCELED)
+                splice.out_err_ = cqe.res;
+            completeSplice(tag, resp);
+            break;
+        }
+        case CANCEL:
+        default:
+            break;
+    }
+}
+
+void UringPoller::completeSplice(uint32_t idx, std::vector<Resp> & resp)
+{
+    auto & op = splices_[idx];
+    if (op.pending_ > 0)
+        return;
+
+    // the out side was cancelled or only took part of the pipe
+    if (op.in_res_ > 0 && op.out_err_ == 0
+            && op.out_ < static_cast<uint32_t>(op.in_res_))
+    {
+        armSpliceOut(idx, static_cast<uint32_t>(op.in_res_) - op.out_, op.out_full_);
+        return;
+    }
+
+    // EAGAIN on in_fd just ends the chain, its next readiness restarts it
+    uint32_t events = Demultiplex::SPLICED;
+    int32_t res = static_cast<int32_t>(op.out_);
+    if (op.in_res_ == 0)
+        events |= EPOLLRDHUP;
+    else if (op.in_res_ < 0 && op.in_res_ != -ECANCELED && op.in_res_ != -EAGAIN)
+    {
+        events |= EPOLLERR;
+        res = op.in_res_;
+    }
+    else if (op.out_err_ < 0)
+    {
+        events |= EPOLLERR;
+        res = op.out_err_;
+    }
+
+    if (fds_[op.in_fd_].splice_ == static_cast<int32_t>(idx))
+        fds_[op.in_fd_].splice_ = -1;
+    if (current(op.in_fd_, op.in_gen_ & 0xffffff))
+        emit(resp, op.in_fd_, events, res);
+    free_splices_.push_back(idx);
+}
+
+void UringPoller::emit(std::vector<Resp> & resp, int fd, uint32_t events,
+        int32_t res, char const * data, uint32_t buf)
+{
+    Resp r;
+    r.fd = fd;
+    r.events = events;
+    r.res = res;
+    r.data = data;
+    r.buf = buf;
+    resp.push_back(r);
+}
+
+} // namespace reactor
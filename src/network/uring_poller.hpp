@@ -0,0 +1,188 @@
+#pragma once
+
+#include <linux/io_uring.h>
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "poller.hpp"
+
+namespace reactor {
+
+/**
+ * @brief io_uring backend, driven through the raw syscalls.
+ *
+ * readiness is a multishot poll per fd, so handlers see the same
+ * edge-triggered events as with epoll. on top of that it can accept,
+ * receive into a ring of provided buffers, send and splice without a
+ * syscall per operation: the SQEs queued while dispatching a batch are
+ * submitted by the io_uring_enter() that waits for the next one.
+ * submissions from other threads go out immediately.
+ *
+ * needs linux 5.19 or later, the constructor throws otherwise.
+ */
+class UringPoller : public Poller
+{
+public:
+    static const unsigned ENTRIES       = 4096;
+    // provided buffers for multishot recv, BUF_ENTRIES must be a power of two
+    static const unsigned BUF_ENTRIES   = 256;
+    static const unsigned BUF_SIZE      = 16 * 1024;
+    static const uint16_t BUF_GROUP     = 0;
+
+public:
+    UringPoller();
+    ~UringPoller();
+
+    int add(int fd, uint32_t events) override;
+
+    int modify(int fd, uint32_t events) override;
+
+    int remove(int fd) override;
+
+    int wait(std::vector<Resp> & resp, int max, int timeout) override;
+
+    void afterDispatch() override;
+
+    int acceptMultishot(int fd) override;
+
+    int recvMultishot(int fd) override;
+
+    int sendReceived(int fd, Resp const & received) override;
+
+    int spliceLinked(int in_fd, int out_fd, int pipe_r, int pipe_w, size_t len) override;
+
+private:
+    enum Op : uint8_t
+    {
+        POLL = 1,
+        ACCEPT,
+        RECV,
+        SEND,
+        SPLICE_IN,
+        SPLICE_OUT,
+        SPLICE_WAIT,    // POLLOUT linked in front of a retried SPLICE_OUT
+        CANCEL
+    };
+
+    struct FdState
+    {
+        uint32_t    events_;
+        uint32_t    gen_;       // bumped by remove(), stale CQEs carry an older one
+        uint32_t    poll_;      // bumped on every poll re-arm
+        bool        polled_;
+        bool        accept_;
+        bool        recv_;
+        int32_t     splice_;    // in-flight splice reading from this fd, -1 if none
+        int32_t     send_head_; // sends to this fd go out one at a time, in order
+        int32_t     send_tail_;
+    };
+
+    struct SendOp
+    {
+        int             fd_;
+        uint16_t        buf_;
+        char const *    data_;
+        uint32_t        len_;
+        uint32_t        off_;
+        int32_t         next_;
+    };
+
+    struct SpliceOp
+    {
+        int         in_fd_;
+        int         out_fd_;
+        int         pipe_r_;
+        uint32_t    in_gen_;
+        int32_t     in_res_;    // bytes moved into the pipe or -errno
+        uint32_t    out_;       // bytes moved out of the pipe
+        int32_t     out_err_;
+        bool        out_full_;  // out_fd said EAGAIN, wait for POLLOUT
+        int         pending_;   // CQEs still to come
+    };
+
+private:
+    static uint64_t pack(Op op, uint32_t tag, int fd) noexcept;
+
+    FdState & state(int fd);
+
+    bool current(int fd, uint32_t gen) const noexcept;
+
+    void rearmPoll(int fd, uint32_t events);
+
+    struct io_uring_sqe * sqe();
+
+    // publish queued SQEs, submit them unless the loop thread will
+    void flush(bool now);
+
+    int enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+            void * arg = nullptr, size_t argsz = 0);
+
+    void armPoll(int fd);
+
+    void armAccept(int fd);
+
+    void armRecv(int fd);
+
+    void armSend(uint32_t idx);
+
+    // the head of fd's send queue is done, start the next one
+    void popSend(int fd, std::vector<Resp> & resp, int32_t res);
+
+    void armSpliceOut(uint32_t idx, uint32_t len, bool wait);
+
+    void cancel(int fd);
+
+    void provide(uint16_t buf);
+
+    void complete(struct io_uring_cqe const & cqe, std::vector<Resp> & resp);
+
+    void completeSplice(uint32_t idx, std::vector<Resp> & resp);
+
+    static void emit(std::vector<Resp> & resp, int fd, uint32_t events,
+            int32_t res = 0, char const * data = nullptr, uint32_t buf = 0);
+
+private:
+    int                     ring_fd_;
+
+    // mmap'ed rings
+    void *                  sq_ptr_;
+    size_t                  sq_size_;
+    void *                  cq_ptr_;
+    size_t                  cq_size_;
+    struct io_uring_sqe *   sqes_;
+    size_t                  sqes_size_;
+
+    unsigned *              sq_head_;
+    unsigned *              sq_tail_;
+    unsigned                sq_mask_;
+    unsigned                sq_entries_;
+    unsigned *              cq_head_;
+    unsigned *              cq_tail_;
+    unsigned                cq_mask_;
+    struct io_uring_cqe *   cqes_;
+
+    unsigned                sqe_tail_;      // local tail, published by flush()
+    unsigned                to_submit_;
+
+    // provided buffer ring, the buffers are allocated on first recvMultishot()
+    struct io_uring_buf_ring *  buf_ring_;
+    size_t                      buf_ring_size_;
+    char *                      bufs_;
+    uint16_t                    buf_tail_;
+    std::vector<uint16_t>       received_;  // handed out in the current batch
+    std::vector<bool>           claimed_;   // kept by sendReceived()
+    std::vector<int>            starved_;   // recv stopped for lack of buffers
+
+    std::vector<FdState>    fds_;
+    std::vector<SendOp>     sends_;
+    std::vector<uint32_t>   free_sends_;
+    std::vector<SpliceOp>   splices_;
+    std::vector<uint32_t>   free_splices_;
+
+    std::thread::id         owner_;         // the thread in wait()
+    std::mutex              mx_;
+};
+
+} // namespace reactor
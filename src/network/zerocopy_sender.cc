@@ -0,0 +1,173 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+// needs struct timespec from time.h first
+#include <linux/errqueue.h>
+
+#include "zerocopy_sender.hpp"
+
+#ifndef SO_ZEROCOPY
+#   define SO_ZEROCOPY 60
+#endif
+
+namespace reactor {
+
+ZeroCopySender::ZeroCopySender(int fd, size_t threshold)
+    : fd_(fd)
+    , threshold_(threshold)
+    , tried_(false)
+    , enabled_(false)
+    , next_id_(0)
+    , copied_(0)
+    , pending_()
+    , sent_()
+    , inflight_(0)
+    , stats_()
+{}
+
+ZeroCopySender::~ZeroCopySender() = default;
+
+ssize_t ZeroCopySender::send(ChainBuffer & buf, int flags)
+{
+    if (!pending_.empty())
+        reap();
+
+    if (buf.readableBytes() < threshold_ || !enable())
+    {
+        stats_.copied_++;
+        return buf.sendTo(fd_, flags);
+    }
+
+    struct iovec iov[ChainBuffer::MAX_IOV];
+    auto cnt = buf.peek(iov, ChainBuffer::MAX_IOV);
+    if (cnt == 0)
+        return 0;
+
+    struct msghdr msg;
+    ::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+
+    auto sent = ::sendmsg(fd_, &msg, flags | MSG_ZEROCOPY);
+    // out of option memory for the notifications, copy this one
+    if (sent == -1 && errno == ENOBUFS)
+    {
+        stats_.copied_++;
+        return buf.sendTo(fd_, flags);
+    }
+    if (sent <= 0)
+        return sent;
+
+    sent_.share(buf, static_cast<size_t>(sent));
+    pending_.push_back(Pending{ next_id_++, false, static_cast<size_t>(sent) });
+    inflight_ += static_cast<size_t>(sent);
+    stats_.zerocopy_++;
+
+    buf.retrieve(static_cast<size_t>(sent));
+
+    return sent;
+}
+
+int ZeroCopySender::reap()
+{
+    // nothing was sent zero-copy, there is nothing of ours to reap
+    if (!tried_)
+        return 0;
+
+    int reaped = 0;
+    for (;;)
+    {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg;
+        ::memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (::recvmsg(fd_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        for (auto cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                    && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            auto err = reinterpret_cast<struct sock_extended_err *>(CMSG_DATA(cm));
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            {
+                if (err->ee_errno == 0)
+                    continue;
+                errno = static_cast<int>(err->ee_errno);
+                return -1;
+            }
+
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                stats_.deferred_++;
+                if (++copied_ >= MAX_COPIED)
+                    enabled_ = false;
+            }
+            else
+                copied_ = 0;
+
+            complete(err->ee_info, err->ee_data);
+            stats_.completions_++;
+            reaped++;
+        }
+    }
+
+    return reaped;
+}
+
+bool ZeroCopySender::completionOnly(int fd, uint32_t events)
+{
+    if (!(events & EPOLLERR) || (events & (EPOLLHUP | EPOLLRDHUP)))
+        return false;
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+    return ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0;
+}
+
+bool ZeroCopySender::enable() noexcept
+{
+    // a connection that never sends that much never pays the syscall
+    if (!tried_)
+    {
+        tried_ = true;
+        int one = 1;
+        enabled_ = fd_ >= 0
+                && ::setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    }
+
+    return enabled_;
+}
+
+void ZeroCopySender::complete(uint32_t lo, uint32_t hi)
+{
+    for (size_t i = 0; i < pending_.size(); i++)
+    {
+        auto & pending = pending_[i];
+        if (pending.id_ - lo <= hi - lo)
+            pending.done_ = true;
+    }
+
+    // reports usually cover the oldest sends, one that overtook an
+    // earlier send keeps its blocks until that one is done as well
+    while (!pending_.empty() && pending_.front().done_)
+    {
+        sent_.retrieve(pending_.front().bytes_);
+        inflight_ -= pending_.front().bytes_;
+        pending_.pop_front();
+    }
+}
+
+} // namespace reactor
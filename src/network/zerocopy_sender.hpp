@@ -0,0 +1,109 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "chain_buffer.hpp"
+#include "small_ring.hpp"
+
+namespace reactor {
+
+/**
+ * @brief MSG_ZEROCOPY sends from a ChainBuffer to one socket. the kernel
+ * reads the sent pages until it reports the send complete on the error
+ * queue, so the sent blocks stay referenced here until reap() sees that
+ * report for them and every send before them. SO_ZEROCOPY is asked for
+ * at the first send reaching the threshold, and the answer kept: sends
+ * below it, and all sends on a socket refusing it, are plain copying
+ * sends. one sender per socket, used on the socket's loop only. the
+ * owner reap()s once more before closing the socket, the destructor
+ * does not touch it.
+ */
+class ZeroCopySender
+{
+public:
+    // below this pinning the pages costs more than copying them
+    static const size_t THRESHOLD = 10 * 1024;
+    // completions the kernel had to copy anyway before giving up on it,
+    // e.g. loopback or a device without scatter-gather
+    static const uint32_t MAX_COPIED = 8;
+
+    struct Stats
+    {
+        size_t zerocopy_;       // MSG_ZEROCOPY sends
+        size_t copied_;         // plain sends
+        size_t completions_;
+        size_t deferred_;       // completions the kernel copied after all
+    };
+
+public:
+    explicit ZeroCopySender(int fd, size_t threshold = THRESHOLD);
+    ZeroCopySender(const ZeroCopySender &) = delete;
+    ZeroCopySender & operator=(const ZeroCopySender &) = delete;
+    ~ZeroCopySender();
+
+    /**
+     * @brief send from the head of `buf` and consume what was sent.
+     * completions already queued are reaped first.
+     */
+    ssize_t send(ChainBuffer & buf, int flags = MSG_NOSIGNAL);
+
+    /**
+     * @brief drain the error queue, blocks of completed sends are
+     * released. -1 with errno set if it held a real socket error.
+     *
+     * @return int  completion notifications reaped
+     */
+    int reap();
+
+    // false until a send reached the threshold
+    bool enabled() const noexcept { return enabled_; }
+
+    // bytes held for the kernel, it may still read them
+    size_t inFlight() const noexcept { return inflight_; }
+
+    // bytes of the bookkeeping, once it outgrew its inline room
+    size_t overhead() const noexcept { return sent_.overhead() + pending_.heapBytes(); }
+
+    Stats stats() const noexcept { return stats_; }
+
+    /**
+     * @brief EPOLLERR also announces completions on the error queue.
+     * true if that is all it means for fd: no hangup and no pending
+     * socket error, which this reads and clears.
+     */
+    static bool completionOnly(int fd, uint32_t events);
+
+private:
+    struct Pending
+    {
+        uint32_t    id_;
+        bool        done_;
+        size_t      bytes_;     // at the front of sent_
+    };
+
+private:
+    // turns SO_ZEROCOPY on the first time, false if the socket refused
+    bool enable() noexcept;
+
+    // release the sends numbered lo..hi, the range may wrap
+    void complete(uint32_t lo, uint32_t hi);
+
+private:
+    int                     fd_;
+    size_t                  threshold_;
+    bool                    tried_;     // SO_ZEROCOPY was asked for
+    bool                    enabled_;
+    uint32_t                next_id_;   // the kernel numbers sends per socket
+    uint32_t                copied_;
+    // the sends in order and the bytes they still pin
+    SmallRing<Pending, 4>   pending_;
+    ChainBuffer             sent_;
+    size_t                  inflight_;
+    Stats                   stats_;
+};
+
+} // namespace reactor
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+
+#include "stream_socket.hpp"
+
+namespace proxy {
+
+// ids, and so the per-backend arrays, stay below it
+constexpr uint32_t MAX_BACKENDS = 256;
+
+struct Backend
+{
+    Backend(uint32_t id, reactor::InetAddr addr, uint32_t weight)
+        : id_(id)
+        , addr_(std::move(addr))
+        , key_(addr_.toString())
+        , weight_(weight)
+    {}
+
+    uint32_t            id_;        // stable for the [ip:port], indexes the per-backend arrays
+    reactor::InetAddr   addr_;
+    std::string         key_;       // [ip:port]
+    uint32_t            weight_;
+};
+
+} // namespace proxy
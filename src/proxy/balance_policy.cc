@@ -0,0 +1,199 @@
+#include <algorithm>
+
+#include "balance_policy.hpp"
+
+namespace proxy {
+
+BackendLoads::BackendLoads()
+    : loads_(new Load[MAX_BACKENDS])
+{
+    for (uint32_t i = 0; i < MAX_BACKENDS; i++)
+    {
+        loads_[i].outstanding_.store(0, std::memory_order_relaxed);
+        loads_[i].ewma_ns_.store(0, std::memory_order_relaxed);
+        loads_[i].weight_.store(WEIGHT_SCALE, std::memory_order_relaxed);
+    }
+}
+
+void BackendLoads::acquire(uint32_t id) noexcept
+{
+    loads_[id].outstanding_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void BackendLoads::release(uint32_t id) noexcept
+{
+    loads_[id].outstanding_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void BackendLoads::observe(uint32_t id, std::chrono::nanoseconds latency) noexcept
+{
+    auto & ewma = loads_[id].ewma_ns_;
+    auto sample = static_cast<int64_t>(latency.count());
+    auto old = ewma.load(std::memory_order_relaxed);
+    int64_t next;
+    // weight 1/8 for the new sample, the first one is taken as it is
+    do
+        next = old == 0 ? sample : old + (sample - old) / 8;
+    while (!ewma.compare_exchange_weak(old, next, std::memory_order_relaxed));
+}
+
+int64_t BackendLoads::outstanding(uint32_t id) const noexcept
+{
+    return loads_[id].outstanding_.load(std::memory_order_relaxed);
+}
+
+int64_t BackendLoads::latency(uint32_t id) const noexcept
+{
+    return loads_[id].ewma_ns_.load(std::memory_order_relaxed);
+}
+
+void BackendLoads::setWeight(uint32_t id, int64_t weight) noexcept
+{
+    loads_[id].weight_.store(std::max<int64_t>(weight, 1), std::memory_order_relaxed);
+}
+
+int64_t BackendLoads::weight(uint32_t id) const noexcept
+{
+    return loads_[id].weight_.load(std::memory_order_relaxed);
+}
+
+PolicyFactory makePolicy(PolicyType type)
+{
+    switch (type) {
+        case WEIGHTED_ROUND_ROBIN:
+            return [] { return std::unique_ptr<BalancePolicy>(new WeightedRoundRobinPolicy); };
+        case LEAST_OUTSTANDING:
+            return [] { return std::unique_ptr<BalancePolicy>(new LeastOutstandingPolicy); };
+        case P2C_EWMA:
+            return [] { return std::unique_ptr<BalancePolicy>(new P2CEwmaPolicy); };
+        case MAGLEV:
+        case RING_HASH:
+            return [type] { return std::unique_ptr<BalancePolicy>(new HashPolicy(type)); };
+        case ROUND_ROBIN:
+        default:
+            return [] { return std::unique_ptr<BalancePolicy>(new RoundRobinPolicy); };
+    }
+}
+
+bool hashing(PolicyType type) noexcept
+{
+    return type == MAGLEV || type == RING_HASH;
+}
+
+size_t RoundRobinPolicy::choose(BackendSet const & set, BackendLoads const & loads,
+        uint32_t const * candidates, size_t n, uint64_t key)
+{
+    return candidates[next_++ % n];
+}
+
+size_t WeightedRoundRobinPolicy::choose(BackendSet const & set, BackendLoads const & loads,
+        uint32_t const * candidates, size_t n, uint64_t key)
+{
+    // every candidate gains its weight, the leader pays back the total
+    int64_t total = 0;
+    size_t best = candidates[0];
+    for (size_t i = 0; i < n; i++)
+    {
+        auto const & backend = set.backends_[candidates[i]];
+        if (backend.id_ >= current_.size())
+            current_.resize(backend.id_ + 1, 0);
+
+        auto weight = loads.weight(backend.id_);
+        current_[backend.id_] += weight;
+        total += weight;
+        if (current_[backend.id_] > current_[set.backends_[best].id_])
+            best = candidates[i];
+    }
+    current_[set.backends_[best].id_] -= total;
+
+    return best;
+}
+
+size_t LeastOutstandingPolicy::choose(BackendSet const & set, BackendLoads const & loads,
+        uint32_t const * candidates, size_t n, uint64_t key)
+{
+    auto start = next_++ % n;
+    size_t best = candidates[start];
+    auto best_load = loads.outstanding(set.backends_[best].id_);
+    auto best_weight = loads.weight(set.backends_[best].id_);
+    for (size_t i = 1; i < n; i++)
+    {
+        auto index = candidates[(start + i) % n];
+        auto const & backend = set.backends_[index];
+        auto load = loads.outstanding(backend.id_);
+        auto weight = loads.weight(backend.id_);
+        // load / weight < best_load / best_weight
+        if (load * best_weight < best_load * weight)
+        {
+            best = index;
+            best_load = load;
+            best_weight = weight;
+        }
+    }
+
+    return best;
+}
+
+P2CEwmaPolicy::P2CEwmaPolicy()
+    : state_(static_cast<uint64_t>(
+                std::chrono::steady_clock::now().time_since_epoch().count())
+            ^ reinterpret_cast<uintptr_t>(this))
+{
+    if (state_ == 0)
+        state_ = 0x9e3779b97f4a7c15ull;
+}
+
+size_t P2CEwmaPolicy::choose(BackendSet const & set, BackendLoads const & loads,
+        uint32_t const * candidates, size_t n, uint64_t key)
+{
+    if (n == 1)
+        return candidates[0];
+
+    auto first = random() % n;
+    auto second = random() % (n - 1);
+    if (second >= first)
+        second++;
+
+    // an unmeasured backend costs as if it answered at once, so it gets probed
+    auto cost = [&set, &loads](size_t index) {
+        auto const & backend = set.backends_[index];
+        return static_cast<double>(loads.latency(backend.id_) + 1)
+                * static_cast<double>(loads.outstanding(backend.id_) + 1)
+                / static_cast<double>(loads.weight(backend.id_));
+    };
+
+    auto a = candidates[first];
+    auto b = candidates[second];
+    return cost(a) <= cost(b) ? a : b;
+}
+
+uint64_t P2CEwmaPolicy::random() noexcept
+{
+    // xorshift64
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 7;
+    state_ ^= state_ << 17;
+
+    return state_;
+}
+
+size_t HashPolicy::choose(BackendSet const & set, BackendLoads const & loads,
+        uint32_t const * candidates, size_t n, uint64_t key)
+{
+    auto const & table = set.maglev_;
+    auto const & ring = set.ring_;
+    auto built = type_ == MAGLEV ? !table.empty() : !ring.empty();
+
+    // the keys of an excluded backend are rehashed until they land on a candidate
+    for (uint64_t attempt = 0; built && attempt < 8; attempt++)
+    {
+        auto index = type_ == MAGLEV ? table.lookup(key) : ring.lookup(key);
+        if (std::binary_search(candidates, candidates + n, index))
+            return index;
+        key = hashKey(&key, sizeof(key), attempt + 1);
+    }
+
+    return candidates[key % n];
+}
+
+} // namespace proxy
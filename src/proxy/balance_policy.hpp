@@ -0,0 +1,187 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "backend.hpp"
+#include "consistent_hash.hpp"
+
+namespace proxy {
+
+/**
+ * @brief the backends in service, ordered by id. published as a whole
+ * and never modified afterwards, readers hold on to their copy. the
+ * hash tables are built along with it when the policy needs them.
+ */
+struct BackendSet
+{
+    std::vector<Backend>    backends_;
+    MaglevTable             maglev_;
+    KetamaRing              ring_;
+};
+
+/**
+ * @brief load shared by every thread picking backends, one cache line per
+ * backend id. a session is counted from its pick until it is released,
+ * which may happen on another thread. the weight the policies go by is
+ * here as well, it changes while a backend is slow-started.
+ */
+class BackendLoads
+{
+public:
+    // effective weights are the configured ones times this
+    static constexpr int64_t WEIGHT_SCALE = 1024;
+
+public:
+    BackendLoads();
+    BackendLoads(const BackendLoads &) = delete;
+    BackendLoads & operator=(const BackendLoads &) = delete;
+
+    void acquire(uint32_t id) noexcept;
+
+    void release(uint32_t id) noexcept;
+
+    // folds one request/response round trip into the backend's EWMA
+    void observe(uint32_t id, std::chrono::nanoseconds latency) noexcept;
+
+    int64_t outstanding(uint32_t id) const noexcept;
+
+    // 0 until the first round trip
+    int64_t latency(uint32_t id) const noexcept;
+
+    void setWeight(uint32_t id, int64_t weight) noexcept;
+
+    // scaled by WEIGHT_SCALE, never below 1
+    int64_t weight(uint32_t id) const noexcept;
+
+private:
+    struct Load
+    {
+        std::atomic<int64_t>    outstanding_;
+        std::atomic<int64_t>    ewma_ns_;
+        std::atomic<int64_t>    weight_;
+        char                    pad_[64 - 3 * sizeof(std::atomic<int64_t>)];
+    };
+
+    std::unique_ptr<Load[]>     loads_;
+};
+
+/**
+ * @brief how a backend is chosen among the candidates. one instance per
+ * picking thread, so its own state needs no locking.
+ */
+class BalancePolicy
+{
+public:
+    virtual ~BalancePolicy() = default;
+
+    /**
+     * @brief choose among `n` candidates, indices into set.backends_ in
+     * ascending order.
+     *
+     * @param key       hashed affinity key of the connection, like its
+     *                  client's ip. only the hashing policies look at it
+     * @return size_t   the chosen index into set.backends_, n is never 0
+     */
+    virtual size_t choose(BackendSet const & set, BackendLoads const & loads,
+            uint32_t const * candidates, size_t n, uint64_t key) = 0;
+};
+
+using PolicyFactory = std::function<std::unique_ptr<BalancePolicy>()>;
+
+enum PolicyType : uint8_t
+{
+    ROUND_ROBIN,
+    // smooth weighted round robin, as nginx does it. this and the two
+    // below go by the effective weights in BackendLoads
+    WEIGHTED_ROUND_ROBIN,
+    // fewest sessions per weight
+    LEAST_OUTSTANDING,
+    // the better of two random picks by latency EWMA and sessions
+    P2C_EWMA,
+    // the same key to the same backend, a lookup in set.maglev_
+    MAGLEV,
+    // the same, on the ketama ring in set.ring_
+    RING_HASH,
+};
+
+PolicyFactory makePolicy(PolicyType type);
+
+// whether the policy looks keys up in one of the set's hash tables
+bool hashing(PolicyType type) noexcept;
+
+class RoundRobinPolicy : public BalancePolicy
+{
+public:
+    RoundRobinPolicy() : next_(0) {}
+
+    virtual size_t choose(BackendSet const & set, BackendLoads const & loads,
+            uint32_t const * candidates, size_t n, uint64_t key) override;
+
+private:
+    size_t next_;
+};
+
+class WeightedRoundRobinPolicy : public BalancePolicy
+{
+public:
+    virtual size_t choose(BackendSet const & set, BackendLoads const & loads,
+            uint32_t const * candidates, size_t n, uint64_t key) override;
+
+private:
+    // by backend id
+    std::vector<int64_t> current_;
+};
+
+class LeastOutstandingPolicy : public BalancePolicy
+{
+public:
+    LeastOutstandingPolicy() : next_(0) {}
+
+    virtual size_t choose(BackendSet const & set, BackendLoads const & loads,
+            uint32_t const * candidates, size_t n, uint64_t key) override;
+
+private:
+    // where the scan starts, ties don't all land on the first backend
+    size_t next_;
+};
+
+class P2CEwmaPolicy : public BalancePolicy
+{
+public:
+    P2CEwmaPolicy();
+
+    virtual size_t choose(BackendSet const & set, BackendLoads const & loads,
+            uint32_t const * candidates, size_t n, uint64_t key) override;
+
+private:
+    uint64_t random() noexcept;
+
+private:
+    uint64_t state_;
+};
+
+/**
+ * @brief consistent hashing over set.maglev_ or set.ring_. a key whose
+ * backend is not a candidate is rehashed a few times, then spread over
+ * the candidates.
+ */
+class HashPolicy : public BalancePolicy
+{
+public:
+    explicit HashPolicy(PolicyType type) : type_(type) {}
+
+    virtual size_t choose(BackendSet const & set, BackendLoads const & loads,
+            uint32_t const * candidates, size_t n, uint64_t key) override;
+
+private:
+    // MAGLEV or RING_HASH
+    PolicyType type_;
+};
+
+} // namespace proxy
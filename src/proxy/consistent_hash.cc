@@ -0,0 +1,110 @@
+#include <algorithm>
+#include <utility>
+
+#include "consistent_hash.hpp"
+
+namespace proxy {
+
+static_assert(MAX_BACKENDS <= 256, "table entries are one byte");
+
+constexpr uint32_t MaglevTable::DEFAULT_SIZE;
+constexpr uint32_t KetamaRing::POINTS;
+
+uint64_t hashKey(void const * data, size_t len, uint64_t seed) noexcept
+{
+    // FNV-1a, then the splitmix64 finalizer to spread it over all bits
+    auto bytes = static_cast<unsigned char const *>(data);
+    uint64_t hash = 0xcbf29ce484222325ull ^ (seed * 0x9e3779b97f4a7c15ull);
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebull;
+    hash ^= hash >> 31;
+
+    return hash;
+}
+
+void MaglevTable::build(std::vector<Backend> const & backends, uint32_t size)
+{
+    table_.clear();
+    if (backends.empty())
+        return;
+
+    auto n = backends.size();
+    std::vector<uint64_t> offset(n), skip(n), next(n, 0);
+    std::vector<uint64_t> credit(n, 0);
+    uint32_t max_weight = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        // from the [ip:port], a backend keeps its permutation whatever else changes
+        offset[i] = hashKey(backends[i].key_, 0) % size;
+        skip[i] = hashKey(backends[i].key_, 1) % (size - 1) + 1;
+        max_weight = std::max(max_weight, backends[i].weight_);
+    }
+
+    std::vector<int16_t> slots(size, -1);
+    uint32_t filled = 0;
+    while (filled < size)
+    {
+        for (size_t i = 0; i < n && filled < size; i++)
+        {
+            credit[i] += backends[i].weight_;
+            if (credit[i] < max_weight)
+                continue;
+            credit[i] -= max_weight;
+
+            // the next slot of its permutation nobody took yet
+            uint64_t slot;
+            do
+                slot = (offset[i] + next[i]++ * skip[i]) % size;
+            while (slots[slot] >= 0);
+
+            slots[slot] = static_cast<int16_t>(i);
+            filled++;
+        }
+    }
+
+    table_.assign(slots.begin(), slots.end());
+}
+
+void KetamaRing::build(std::vector<Backend> const & backends)
+{
+    std::vector<std::pair<uint32_t, uint8_t>> ring;
+    for (size_t i = 0; i < backends.size(); i++)
+    {
+        auto points = POINTS * backends[i].weight_;
+        for (uint32_t j = 0; j < points; j++)
+        {
+            auto point = backends[i].key_ + "-" + std::to_string(j);
+            ring.emplace_back(static_cast<uint32_t>(hashKey(point) >> 32),
+                    static_cast<uint8_t>(i));
+        }
+    }
+    std::sort(ring.begin(), ring.end());
+
+    points_.resize(ring.size());
+    owners_.resize(ring.size());
+    for (size_t i = 0; i < ring.size(); i++)
+    {
+        points_[i] = ring[i].first;
+        owners_[i] = ring[i].second;
+    }
+}
+
+uint32_t KetamaRing::lookup(uint64_t key) const noexcept
+{
+    auto iter = std::lower_bound(points_.begin(), points_.end(),
+            static_cast<uint32_t>(key >> 32));
+    if (iter == points_.end())
+        iter = points_.begin();
+
+    return owners_[iter - points_.begin()];
+}
+
+} // namespace proxy
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "backend.hpp"
+
+namespace proxy {
+
+// stable across runs and hosts, the tables are built from it
+uint64_t hashKey(void const * data, size_t len, uint64_t seed = 0) noexcept;
+
+inline uint64_t hashKey(std::string const & key, uint64_t seed = 0) noexcept
+{
+    return hashKey(key.data(), key.size(), seed);
+}
+
+/**
+ * @brief Maglev lookup table: every slot names a backend, each backend
+ * fills slots along its own permutation in turn, weight times per round.
+ * removing a backend moves little more than its own slots. a lookup is
+ * one index into the table.
+ */
+class MaglevTable
+{
+public:
+    // prime, well above 100 slots per backend for MAX_BACKENDS
+    static constexpr uint32_t DEFAULT_SIZE = 65537;
+
+public:
+    // `size` has to be prime, otherwise permutations repeat early
+    void build(std::vector<Backend> const & backends, uint32_t size = DEFAULT_SIZE);
+
+    bool empty() const noexcept { return table_.empty(); }
+
+    // index into the backends it was built from. key is already hashed
+    uint32_t lookup(uint64_t key) const noexcept { return table_[key % table_.size()]; }
+
+private:
+    // index into the backends, a byte as there are at most MAX_BACKENDS
+    std::vector<uint8_t> table_;
+};
+
+/**
+ * @brief ketama ring: POINTS points per unit of weight for each backend,
+ * a key belongs to the first point clockwise. a binary search per lookup.
+ */
+class KetamaRing
+{
+public:
+    static constexpr uint32_t POINTS = 160;
+
+public:
+    void build(std::vector<Backend> const & backends);
+
+    bool empty() const noexcept { return points_.empty(); }
+
+    // index into the backends it was built from. key is already hashed
+    uint32_t lookup(uint64_t key) const noexcept;
+
+private:
+    // sorted, owners_[i] is the backend index for points_[i]
+    std::vector<uint32_t>   points_;
+    std::vector<uint8_t>    owners_;
+};
+
+} // namespace proxy
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace proxy {
+
+/**
+ * @brief per-loop state indexed by fd, as reactor::ConnectionTable is.
+ * fds are small dense integers, so a lookup is an array index. entries
+ * stay put until erased. only the owning loop thread touches it, there
+ * is no lock.
+ */
+template<typename T>
+class FdTable
+{
+public:
+    static const size_t INITIAL_SLOTS = 1024;
+
+public:
+    FdTable()
+        : slots_(INITIAL_SLOTS)
+        , size_(0)
+    {}
+    FdTable(const FdTable &) = delete;
+    FdTable & operator=(const FdTable &) = delete;
+    ~FdTable() = default;
+
+    T * find(int fd) const noexcept
+    {
+        if (fd < 0 || static_cast<size_t>(fd) >= slots_.size())
+            return nullptr;
+
+        return slots_[fd].get();
+    }
+
+    // fd's entry, made from args unless it has one already
+    template<typename... Args>
+    T & emplace(int fd, Args &&... args)
+    {
+        if (static_cast<size_t>(fd) >= slots_.size())
+            slots_.resize(std::max(static_cast<size_t>(fd) + 1, slots_.size() * 2));
+
+        auto & slot = slots_[fd];
+        if (!slot)
+        {
+            slot.reset(new T(std::forward<Args>(args)...));
+            size_++;
+        }
+
+        return *slot;
+    }
+
+    void erase(int fd) noexcept
+    {
+        if (!find(fd))
+            return;
+
+        slots_[fd].reset();
+        size_--;
+    }
+
+    template<typename F>
+    void forEach(F f)
+    {
+        for (size_t fd = 0; fd < slots_.size(); fd++)
+        {
+            if (slots_[fd])
+                f(static_cast<int>(fd), *slots_[fd]);
+        }
+    }
+
+    size_t size() const noexcept { return size_; }
+
+private:
+    std::vector<std::unique_ptr<T>> slots_;
+    size_t                          size_;
+};
+
+} // namespace proxy
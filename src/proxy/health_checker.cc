@@ -0,0 +1,283 @@
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "health_checker.hpp"
+#include "pub_type.hpp"
+
+namespace proxy {
+
+HealthChecker::HealthChecker(Listener listener)
+    : listener_(std::move(listener))
+    , group_()
+    , dmp_()
+    , probes_()
+    , by_fd_()
+    , random_(static_cast<uint64_t>(
+                std::chrono::steady_clock::now().time_since_epoch().count()) | 1)
+    , probes_run_(0)
+    , failures_(0)
+    , timeouts_(0)
+    , transitions_(0)
+{
+    // probes are few and short, epoll does whatever the proxy runs on
+    group_.create(1, ::reactor::Demultiplex::EPOLL);
+    dmp_ = group_.dmp().front();
+    dmp_->handlers<::reactor::context::DmpWaitContext>().attach(this);
+    group_.start();
+}
+
+HealthChecker::~HealthChecker()
+{
+    group_.stop();
+    group_.joinAll();
+    dmp_->handlers<::reactor::context::DmpWaitContext>().detach(this);
+
+    for (auto & pair : by_fd_)
+        ::close(pair.first);
+}
+
+void HealthChecker::watch(std::string const & backend, ::reactor::InetAddr addr,
+        HealthCheckOptions const & options)
+{
+    auto posted = dmp_->runInLoop([this, backend, addr, options] {
+        std::unique_ptr<Probe> fresh(new Probe(backend, addr, options));
+        auto iter = probes_.find(backend);
+        if (iter != probes_.end())
+        {
+            // new options, the verdict so far stays as the listener knows it
+            auto & old = *iter->second;
+            drop(old);
+            fresh->healthy_ = old.healthy_;
+            fresh->passes_ = old.passes_;
+            fresh->failures_ = old.failures_;
+            probes_.erase(iter);
+        }
+
+        auto & probe = *probes_.emplace(backend, std::move(fresh)).first->second;
+        // the first round is spread over a whole interval
+        auto spread = options.interval_.count() > 0
+                ? std::chrono::milliseconds(random() % options.interval_.count())
+                : std::chrono::milliseconds(0);
+        schedule(probe, spread);
+    });
+    if (!posted)
+        std::cout << "health checker backlogged, not watching: " << backend << "\n";
+}
+
+void HealthChecker::unwatch(std::string const & backend)
+{
+    dmp_->runInLoop([this, backend] {
+        auto iter = probes_.find(backend);
+        if (iter == probes_.end())
+            return;
+
+        drop(*iter->second);
+        probes_.erase(iter);
+    });
+}
+
+HealthStats HealthChecker::stats() const noexcept
+{
+    HealthStats stats;
+    stats.probes_ = probes_run_.load(std::memory_order_relaxed);
+    stats.failures_ = failures_.load(std::memory_order_relaxed);
+    stats.timeouts_ = timeouts_.load(std::memory_order_relaxed);
+    stats.transitions_ = transitions_.load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+void HealthChecker::handle(::reactor::context::DmpWaitContext & ctx)
+{
+    for (auto & resp : ctx.resp_events_)
+    {
+        auto iter = by_fd_.find(resp.fd);
+        if (iter == by_fd_.end())
+            continue;
+
+        auto & probe = *iter->second;
+        if (probe.phase_ == CONNECTING)
+            connected(probe);
+        else if (probe.phase_ == READING)
+            receive(probe);
+    }
+}
+
+void HealthChecker::schedule(Probe & probe, std::chrono::milliseconds delay)
+{
+    auto ptr = &probe;
+    probe.next_ = dmp_->runAfter(delay, [this, ptr] {
+        ptr->next_ = 0;
+        start(*ptr);
+    });
+}
+
+void HealthChecker::start(Probe & probe)
+{
+    probes_run_.fetch_add(1, std::memory_order_relaxed);
+    probe.answer_.clear();
+
+    probe.fd_ = ::reactor::StreamSocket::connectNonBlocking(probe.addr_);
+    if (probe.fd_ < 0)
+    {
+        finish(probe, false);
+        return;
+    }
+
+    // level-triggered, a probe is read once and dropped
+    if (dmp_->demultiplexWatch(probe.fd_,
+                ::reactor::Demultiplex::WRITABLE | ::reactor::Demultiplex::CLOSABLE) < 0)
+    {
+        ::close(probe.fd_);
+        probe.fd_ = -1;
+        finish(probe, false);
+        return;
+    }
+
+    by_fd_.emplace(probe.fd_, &probe);
+    probe.phase_ = CONNECTING;
+
+    auto ptr = &probe;
+    probe.timeout_ = dmp_->runAfter(probe.options_.timeout_, [this, ptr] {
+        ptr->timeout_ = 0;
+        finish(*ptr, false, true);
+    });
+}
+
+void HealthChecker::connected(Probe & probe)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (::getsockopt(probe.fd_, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0)
+    {
+        finish(probe, false);
+        return;
+    }
+
+    // a few bytes into an empty socket buffer, all or nothing
+    auto const & send = probe.options_.send_;
+    if (!send.empty() && ::send(probe.fd_, send.data(), send.size(),
+                MSG_NOSIGNAL | MSG_DONTWAIT) != static_cast<ssize_t>(send.size()))
+    {
+        finish(probe, false);
+        return;
+    }
+
+    if (probe.options_.expect_.empty())
+    {
+        finish(probe, true);
+        return;
+    }
+
+    ::reactor::context::DmpModifyContext mod_ctx(::pubsub::DMPMODIFY);
+    mod_ctx.fd_ = probe.fd_;
+    mod_ctx.events_ = ::reactor::Demultiplex::READABLE | ::reactor::Demultiplex::CLOSABLE;
+    dmp_->demultiplexModify(mod_ctx);
+    probe.phase_ = READING;
+}
+
+void HealthChecker::receive(Probe & probe)
+{
+    auto const & expect = probe.options_.expect_;
+    char buf[512];
+    auto want = std::min(sizeof(buf), expect.size() - probe.answer_.size());
+    auto len = ::recv(probe.fd_, buf, want, MSG_DONTWAIT);
+    if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    // closed or failed before the whole answer was there
+    if (len <= 0)
+    {
+        finish(probe, false);
+        return;
+    }
+
+    probe.answer_.append(buf, len);
+    if (expect.compare(0, probe.answer_.size(), probe.answer_) != 0)
+        finish(probe, false);
+    else if (probe.answer_.size() == expect.size())
+        finish(probe, true);
+}
+
+void HealthChecker::finish(Probe & probe, bool passed, bool timed_out)
+{
+    release(probe);
+
+    bool changed = false;
+    if (passed)
+    {
+        probe.failures_ = 0;
+        probe.passes_++;
+        changed = !probe.healthy_ && probe.passes_ >= probe.options_.rise_;
+    }
+    else
+    {
+        failures_.fetch_add(1, std::memory_order_relaxed);
+        if (timed_out)
+            timeouts_.fetch_add(1, std::memory_order_relaxed);
+        probe.passes_ = 0;
+        probe.failures_++;
+        changed = probe.healthy_ && probe.failures_ >= probe.options_.fall_;
+    }
+
+    if (changed)
+    {
+        probe.healthy_ = !probe.healthy_;
+        transitions_.fetch_add(1, std::memory_order_relaxed);
+        std::cout << "backend " << probe.backend_
+                  << (probe.healthy_ ? " is healthy again\n" : " is down\n");
+        listener_(probe.backend_, probe.healthy_);
+    }
+
+    schedule(probe, probe.options_.interval_ + jitter(probe));
+}
+
+void HealthChecker::drop(Probe & probe)
+{
+    if (probe.next_)
+        dmp_->cancel(probe.next_);
+    probe.next_ = 0;
+
+    release(probe);
+}
+
+void HealthChecker::release(Probe & probe)
+{
+    if (probe.timeout_)
+        dmp_->cancel(probe.timeout_);
+    probe.timeout_ = 0;
+    probe.phase_ = IDLE;
+    if (probe.fd_ < 0)
+        return;
+
+    ::reactor::context::DmpDeleteContext del_ctx(::pubsub::DMPDELETE);
+    del_ctx.fd_ = probe.fd_;
+    dmp_->demultiplexRemove(del_ctx);
+    by_fd_.erase(probe.fd_);
+    ::close(probe.fd_);
+    probe.fd_ = -1;
+}
+
+std::chrono::milliseconds HealthChecker::jitter(Probe const & probe)
+{
+    auto range = probe.options_.jitter_.count();
+    if (range <= 0)
+        return std::chrono::milliseconds(0);
+
+    return std::chrono::milliseconds(random() % (range + 1));
+}
+
+uint64_t HealthChecker::random() noexcept
+{
+    // xorshift64, this loop is the only user
+    random_ ^= random_ << 13;
+    random_ ^= random_ >> 7;
+    random_ ^= random_ << 17;
+
+    return random_;
+}
+
+} // namespace proxy
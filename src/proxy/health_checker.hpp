@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "dispatcher.hpp"
+#include "group.hpp"
+#include "nw_ctx.hpp"
+#include "stream_socket.hpp"
+
+namespace proxy {
+
+struct HealthCheckOptions
+{
+    HealthCheckOptions()
+        : interval_(std::chrono::seconds(5))
+        , jitter_(std::chrono::milliseconds(500))
+        , timeout_(std::chrono::seconds(2))
+        , rise_(2)
+        , fall_(3)
+        , send_()
+        , expect_()
+    {}
+
+    std::chrono::milliseconds   interval_;
+    // up to this much is added to every interval, so probes don't line up
+    std::chrono::milliseconds   jitter_;
+    std::chrono::milliseconds   timeout_;   // connect and answer together
+    uint32_t                    rise_;      // passes in a row to come back
+    uint32_t                    fall_;      // failures in a row to go down
+    std::string                 send_;      // written once connected, if any
+    std::string                 expect_;    // the answer has to start with it. nothing:
+                                            // connecting, and sending, is the check
+};
+
+struct HealthStats
+{
+    HealthStats()
+        : probes_(0)
+        , failures_(0)
+        , timeouts_(0)
+        , transitions_(0)
+    {}
+
+    size_t probes_;
+    size_t failures_;       // timeouts included
+    size_t timeouts_;
+    size_t transitions_;    // up -> down and back
+};
+
+/**
+ * @brief probes backends with nonblocking TCP connects, optionally a text
+ * exchange, on a loop thread of its own. a backend goes down after
+ * `fall_` failures in a row and comes back after `rise_` passes, the
+ * listener hears of every such change on the checker's thread. backends
+ * start out healthy.
+ */
+class HealthChecker : public ::pubsub::Handler<::reactor::context::DmpWaitContext>
+{
+public:
+    using Listener = std::function<void(std::string const & backend, bool healthy)>;
+
+public:
+    explicit HealthChecker(Listener listener);
+    HealthChecker(const HealthChecker &) = delete;
+    HealthChecker & operator=(const HealthChecker &) = delete;
+    ~HealthChecker();
+
+    /**
+     * @brief start probing addr for backend [ip:port], replacing what it
+     * was probed with before. safe from any thread.
+     */
+    void watch(std::string const & backend, ::reactor::InetAddr addr,
+            HealthCheckOptions const & options);
+
+    // stop probing backend, safe from any thread
+    void unwatch(std::string const & backend);
+
+    HealthStats stats() const noexcept;
+
+    virtual void handle(::reactor::context::DmpWaitContext & ctx) override;
+
+private:
+    enum PhaseT
+    {
+        IDLE,
+        CONNECTING,
+        READING
+    };
+
+    struct Probe
+    {
+        Probe(std::string backend, ::reactor::InetAddr addr, HealthCheckOptions options)
+            : backend_(std::move(backend))
+            , addr_(std::move(addr))
+            , options_(std::move(options))
+            , healthy_(true)
+            , passes_(0)
+            , failures_(0)
+            , phase_(IDLE)
+            , fd_(-1)
+            , next_(0)
+            , timeout_(0)
+            , answer_()
+        {}
+
+        std::string                     backend_;
+        ::reactor::InetAddr             addr_;
+        HealthCheckOptions              options_;
+        bool                            healthy_;
+        uint32_t                        passes_;        // in a row
+        uint32_t                        failures_;      // in a row
+        PhaseT                          phase_;
+        int                             fd_;
+        ::reactor::Demultiplex::TimerId next_;
+        ::reactor::Demultiplex::TimerId timeout_;
+        std::string                     answer_;
+    };
+
+    // everything below runs on the checker's loop only
+    void schedule(Probe & probe, std::chrono::milliseconds delay);
+
+    void start(Probe & probe);
+
+    void connected(Probe & probe);
+
+    void receive(Probe & probe);
+
+    // the probe is over, counted and the next one scheduled
+    void finish(Probe & probe, bool passed, bool timed_out = false);
+
+    // cancel everything of probe, unwatched or replaced
+    void drop(Probe & probe);
+
+    // close the probe's socket and its timeout
+    void release(Probe & probe);
+
+    std::chrono::milliseconds jitter(Probe const & probe);
+
+    uint64_t random() noexcept;
+
+private:
+    Listener                                        listener_;
+    ::reactor::LoopThreadGroup                      group_;
+    std::shared_ptr<::reactor::Demultiplex>         dmp_;
+    std::unordered_map<std::string,
+        std::unique_ptr<Probe>>                     probes_;
+    std::unordered_map<int, Probe *>                by_fd_;
+    uint64_t                                        random_;
+
+    std::atomic<uint64_t>                           probes_run_;
+    std::atomic<uint64_t>                           failures_;
+    std::atomic<uint64_t>                           timeouts_;
+    std::atomic<uint64_t>                           transitions_;
+};
+
+} // namespace proxy
@@ -1,30 +1,94 @@
-#include <mutex>
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
-#include <thread>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
 
 #include "loader.hpp"
 #include "stream_socket.hpp"
 
 namespace proxy {
 
-LoadBalancer::LoadBalancer()
+namespace {
+
+// the part of its weight a backend gets, elapsed into its slow start
+double rampFactor(SlowStartOptions const & options, LoadBalancer::Clock::duration elapsed)
+{
+    auto low = std::min(options.min_percent_, 100u) / 100.0;
+    auto progress = std::chrono::duration<double>(elapsed).count()
+            / std::chrono::duration<double>(options.window_).count();
+    if (progress >= 1.0)
+        return 1.0;
+
+    if (options.ramp_ == SlowStartOptions::RAMP_EXPONENTIAL && low > 0)
+        return low * std::pow(1.0 / low, progress);
+
+    return std::max(low, progress);
+}
+
+} // namespace
+
+LoadBalancer::LoadBalancer(Options const & options)
     : pub_id_(::pubsub::ID::pub_id())
     , sub_id_(::pubsub::ID::sub_id())
     , center_(::pubsub::PubSubCenter::instance())
     , backend_()
+    , ids_()
+    , snapshot_(std::make_shared<BackendSet>())
+    , loads_()
+    , policy_(makePolicy(options.policy_))
+    , policy_gen_(0)
+    , tables_(options.policy_)
+    , drafted_(0)
+    , published_(0)
     , stop_(false)
-    , sockes_()
     , sock_queue_()
+    , options_(options)
+    , wakeup_fd_(-1)
+    , wakeup_pending_(false)
+    , wakeups_(0)
+    , spun_(0)
+    , batches_(0)
+    , idle_ns_(0)
+    , busy_ns_(0)
     , checked_()
-    , text_()
+    , down_()
+    , ejected_()
+    , outliers_(new std::atomic<bool>[MAX_BACKENDS]())
+    , outliers_dirty_(false)
+    , ramps_()
+    , next_ramp_(std::numeric_limits<int64_t>::max())
+    , outlier_(options.outlier_, [this](uint32_t id, bool ejected) {
+        updateForOutlier(id, ejected);
+    })
+    , check_options_()
+    , backend_checks_()
+    , checker_()
 {
+    // blocking, reading it is how the balancing thread sleeps
+    wakeup_fd_ = ::eventfd(0, EFD_CLOEXEC);
+    if (wakeup_fd_ == -1)
+        throw std::runtime_error(std::string("eventfd error: ") + ::strerror(errno));
+
     center_->registerPub(pub_id_, this);
 }
 
 LoadBalancer::~LoadBalancer()
 {
+    // its thread may be calling updateForHealth()
+    checker_.reset();
     center_->unRegisterPub(pub_id_);
     stop();
+    ::close(wakeup_fd_);
 }
 
 uint16_t LoadBalancer::pubID() const { return pub_id_; }
@@ -57,132 +121,502 @@ void LoadBalancer::update(std::shared_ptr<::pubsub::Context> ctx)
 
 void LoadBalancer::updateForLoadbalance(std::shared_ptr<context::LoadBalanceCtx> ctx)
 {
-    std::lock_guard<std::mutex> guard(mx_);
-    sock_queue_.push_back(std::move(ctx->sockes_));
+    {
+        std::lock_guard<std::mutex> guard(mx_);
+        sock_queue_.push_back(std::move(ctx));
+    }
+    wakeup();
 }
 
-void LoadBalancer::addBackend(reactor::InetAddr addr, uint16_t const & check_port)
+void LoadBalancer::addBackend(reactor::InetAddr addr, uint16_t const & check_port,
+        uint32_t weight)
 {
-    std::lock_guard<std::mutex> lk(mx_);
+    std::unique_lock<std::mutex> lk(mx_);
     auto const & str = addr.toString();
-    backend_.emplace(str, std::move(addr));
-    checked_.emplace(str, check_port);
+    auto id = ids_.emplace(str, static_cast<uint32_t>(ids_.size())).first->second;
+    if (id >= MAX_BACKENDS)
+    {
+        ids_.erase(str);
+        std::cout << "too many backends, ignoring: " << str << "\n";
+        return;
+    }
+
+    auto added = backend_.emplace(std::piecewise_construct, std::forward_as_tuple(str),
+            std::forward_as_tuple(id, std::move(addr), weight > 0 ? weight : 1)).second;
+    if (added)
+        startRamp(id);
+    checked_[str] = check_port;
+    watch(str);
+    publish(lk);
 }
 
 void LoadBalancer::removeBackend(reactor::InetAddr addr)
 {
-    if (backend_.find(addr.toString()) == backend_.end())
+    std::unique_lock<std::mutex> lk(mx_);
+    auto const & str = addr.toString();
+    auto iter = backend_.find(str);
+    if (iter == backend_.end())
+        return;
+
+    ramps_.erase(iter->second.id_);
+    backend_.erase(iter);
+    if (checker_)
+        checker_->unwatch(str);
+    down_.erase(str);
+    publish(lk);
+}
+
+void LoadBalancer::startHealthCheck()
+{
+    std::lock_guard<std::mutex> guard(mx_);
+    if (checker_)
         return;
 
-    std::lock_guard<std::mutex> lk(mx_);
-    backend_.erase(addr.toString());
+    checker_.reset(new HealthChecker([this](std::string const & backend, bool healthy) {
+        updateForHealth(backend, healthy);
+    }));
+    for (auto const & pair : backend_)
+        watch(pair.first);
+}
+
+void LoadBalancer::setHealthCheck(HealthCheckOptions const & options)
+{
+    std::lock_guard<std::mutex> guard(mx_);
+    check_options_ = options;
+    for (auto const & pair : backend_)
+        watch(pair.first);
+}
+
+void LoadBalancer::setHealthCheck(reactor::InetAddr addr, HealthCheckOptions const & options)
+{
+    std::lock_guard<std::mutex> guard(mx_);
+    auto const & key = addr.toString();
+    backend_checks_[key] = options;
+    watch(key);
+}
+
+void LoadBalancer::specifyCheckText(std::string const & text)
+{
+    std::lock_guard<std::mutex> guard(mx_);
+    check_options_.send_ = text;
+    check_options_.expect_ = text;
+    for (auto const & pair : backend_)
+        watch(pair.first);
+}
+
+HealthStats LoadBalancer::healthStats() const
+{
+    std::lock_guard<std::mutex> guard(mx_);
+    return checker_ ? checker_->stats() : HealthStats();
+}
+
+void LoadBalancer::updateForHealth(std::string const & backend, bool healthy)
+{
+    std::unique_lock<std::mutex> guard(mx_);
+    auto iter = backend_.find(backend);
+    if (healthy && down_.erase(backend) && iter != backend_.end())
+        startRamp(iter->second.id_);
+    else if (!healthy && iter != backend_.end())
+        down_.insert(backend);
+    publish(guard);
+}
+
+void LoadBalancer::updateForOutlier(uint32_t id, bool ejected)
+{
+    // pick() skips it from now on, the set is rebuilt off the forwarding path
+    outliers_[id].store(ejected, std::memory_order_release);
+    outliers_dirty_.store(true, std::memory_order_release);
+    wakeup();
 }
 
-void LoadBalancer::checkAllBackend()
+void LoadBalancer::applyOutliers()
 {
-    for (auto & pair : checked_)
+    std::unique_lock<std::mutex> guard(mx_);
+    for (auto const & pair : backend_)
     {
-        int time = 3;
-        int sock = 0;
-        auto const & ip = backend_.at(pair.first).ip();
-        auto const & addr = reactor::InetAddr(ip, pair.second);
-        // Verify the correctness of the connection
-        do
-        {
-            sock = reactor::StreamSocket::connectTo(addr);
-            if (sock > 0)
-                break;
-        } while (--time);
-        if (sock < 0)
-        {
-            std::lock_guard<std::mutex> guard(mx_);
-            backend_.erase(pair.first);
+        auto id = pair.second.id_;
+        auto ejected = outliers_[id].load(std::memory_order_acquire);
+        if (ejected == (ejected_.count(id) > 0))
             continue;
-        }
 
-        time = 3;
-        auto len = text_.length();
-        // Verify the legitimacy for sending data
-        do
-        {
-            auto sent = reactor::StreamSocket::write(sock, text_.c_str(), len);
-            if (sent == len)
-                break;
-        } while (--time);
-        if (time < 0)
+        if (ejected)
+            ejected_.insert(id);
+        else
         {
-            std::lock_guard<std::mutex> guard(mx_);
-            backend_.erase(pair.first);
-            continue;
+            ejected_.erase(id);
+            startRamp(id);
         }
+        std::cout << "backend " << pair.first
+                  << (ejected ? " is ejected\n" : " is back from ejection\n");
+    }
+    publish(guard);
+}
 
-        // Verify the legitimacy for receiving data
-        time = 3;
-        char buf[len];
-        do
-        {
-            ::recv(sock, buf, len, 0);
-            if (text_ == buf)
-                break;
-        } while (--time);
-        if (time < 0)
-        {
-            std::lock_guard<std::mutex> guard(mx_);
-            backend_.erase(pair.first);
+void LoadBalancer::startRamp(uint32_t id)
+{
+    if (options_.slow_start_.window_.count() <= 0)
+        return;
+
+    auto now = Clock::now();
+    ramps_[id] = now;
+    // the first step is taken right away, by publish() or the next pick
+    next_ramp_.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+}
+
+void LoadBalancer::ramp()
+{
+    auto due = next_ramp_.load(std::memory_order_relaxed);
+    if (due == std::numeric_limits<int64_t>::max())
+        return;
+
+    auto now = Clock::now();
+    // twenty steps over the window, one picking thread takes each
+    auto step = std::max<Clock::duration>(options_.slow_start_.window_ / 20,
+            std::chrono::milliseconds(1));
+    if (now.time_since_epoch().count() < due
+            || !next_ramp_.compare_exchange_strong(due,
+                (now + step).time_since_epoch().count(), std::memory_order_relaxed))
+        return;
+
+    std::lock_guard<std::mutex> guard(mx_);
+    for (auto const & pair : backend_)
+    {
+        auto const & backend = pair.second;
+        auto iter = ramps_.find(backend.id_);
+        if (iter == ramps_.end())
             continue;
-        }
+
+        auto factor = rampFactor(options_.slow_start_, now - iter->second);
+        loads_.setWeight(backend.id_, static_cast<int64_t>(
+                    backend.weight_ * BackendLoads::WEIGHT_SCALE * factor));
+        if (factor >= 1.0)
+            ramps_.erase(iter);
     }
+    if (ramps_.empty())
+        next_ramp_.store(std::numeric_limits<int64_t>::max(), std::memory_order_relaxed);
 }
 
-void LoadBalancer::specifyCheckText(std::string const & text)
+double LoadBalancer::effectiveWeight(reactor::InetAddr addr) const
+{
+    std::lock_guard<std::mutex> guard(mx_);
+    auto iter = backend_.find(addr.toString());
+    if (iter == backend_.end())
+        return 0;
+
+    return static_cast<double>(loads_.weight(iter->second.id_)) / BackendLoads::WEIGHT_SCALE;
+}
+
+void LoadBalancer::watch(std::string const & backend)
 {
-    text_ = text;
+    auto iter = backend_.find(backend);
+    if (!checker_ || iter == backend_.end())
+        return;
+
+    auto custom = backend_checks_.find(backend);
+    auto const & options = custom != backend_checks_.end() ? custom->second : check_options_;
+    checker_->watch(backend, reactor::InetAddr(iter->second.addr_.ip(), checked_.at(backend)),
+            options);
 }
 
 void LoadBalancer::loadbalance()
 {
+    std::deque<std::shared_ptr<context::LoadBalanceCtx>> batches;
+    auto mark = Clock::now();
     while (!stop_.load(std::memory_order_acquire))
     {
-        while (sock_queue_.empty())
-            std::this_thread::yield();
+        // cleared first, a change from here on marks it again
+        if (outliers_dirty_.exchange(false, std::memory_order_acq_rel))
+            applyOutliers();
 
         {
             std::lock_guard<std::mutex> guard(mx_);
-            sockes_ = sock_queue_.front();
-            sock_queue_.pop_front();
+            batches.swap(sock_queue_);
+        }
+        if (batches.empty())
+        {
+            park();
+            auto now = Clock::now();
+            idle_ns_.fetch_add((now - mark).count(), std::memory_order_relaxed);
+            mark = now;
+            continue;
         }
 
+        // everything queued since the last round goes out as one FORWARD
         std::shared_ptr<::pubsub::Context> forward_ctx =
             std::make_shared<context::ForwardContext>(
                 ::pubsub::FORWARD);
         auto forward_ptr = std::dynamic_pointer_cast<context::ForwardContext>(forward_ctx);
 
         auto bk_2_sock = new std::unordered_map<int, ::reactor::InetAddr>;
-        balancing(sockes_, *bk_2_sock);
+        for (auto & lb_ctx : batches)
+            balancing(*lb_ctx, *bk_2_sock);
         forward_ptr->sock_to_backend_.reset(bk_2_sock);
+        batches_.fetch_add(batches.size(), std::memory_order_relaxed);
+        batches.clear();
 
         center_->notifySubscriber(pub_id_,
             pubsub::FORWARD,
              forward_ctx);
+
+        auto now = Clock::now();
+        busy_ns_.fetch_add((now - mark).count(), std::memory_order_relaxed);
+        mark = now;
     }
 }
 
+void LoadBalancer::park()
+{
+    auto until = Clock::now() + options_.spin_;
+    bool spun = false;
+    while (!spun && Clock::now() < until)
+        spun = wakeup_pending_.load(std::memory_order_acquire);
+
+    // once pending is seen the write is on its way, this read won't sleep long
+    uint64_t count;
+    while (::read(wakeup_fd_, &count, sizeof(count)) == -1 && errno == EINTR)
+        ;
+    // re-armed before draining, a batch queued from here on writes again
+    wakeup_pending_.exchange(false, std::memory_order_acq_rel);
+
+    wakeups_.fetch_add(1, std::memory_order_relaxed);
+    if (spun)
+        spun_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void LoadBalancer::wakeup()
+{
+    // one wakeup covers every batch queued until the thread drains them
+    if (wakeup_pending_.exchange(true, std::memory_order_acq_rel))
+        return;
+
+    uint64_t one = 1;
+    while (::write(wakeup_fd_, &one, sizeof(one)) == -1 && errno == EINTR)
+        ;
+}
+
+BalancerStats LoadBalancer::stats() const
+{
+    BalancerStats stats;
+    stats.wakeups_ = wakeups_.load(std::memory_order_relaxed);
+    stats.spun_ = spun_.load(std::memory_order_relaxed);
+    stats.batches_ = batches_.load(std::memory_order_relaxed);
+    stats.idle_ = std::chrono::nanoseconds(idle_ns_.load(std::memory_order_relaxed));
+    stats.busy_ = std::chrono::nanoseconds(busy_ns_.load(std::memory_order_relaxed));
+
+    return stats;
+}
+
 void LoadBalancer::balancing(
-            std::vector<int> & sockes,
+            context::LoadBalanceCtx const & ctx,
             std::unordered_map<int, ::reactor::InetAddr> & sock_map)
 {
-    auto iter = backend_.begin();
-    for (auto & sock : sockes)
+    ::reactor::InetAddr addr;
+    auto keyed = hashing();
+    for (auto & sock : ctx.sockes_)
+    {
+        if (pick(addr, ctx.excluded_, nullptr, keyed ? keyOf(sock) : 0))
+            sock_map.emplace(sock, addr);
+    }
+}
+
+bool LoadBalancer::pick(::reactor::InetAddr & addr,
+        std::vector<std::string> const & excluded, uint32_t * id, uint64_t key)
+{
+    // an ejection due runs out here, before the set is read
+    outlier_.tick();
+    ramp();
+
+    auto set = std::atomic_load(&snapshot_);
+    auto const & backends = set->backends_;
+    if (backends.empty())
+        return false;
+
+    // ejected since the set was published, out until the next one is
+    auto ejected = [this](Backend const & backend) {
+        return outliers_[backend.id_].load(std::memory_order_relaxed);
+    };
+
+    thread_local std::vector<uint32_t> candidates;
+    candidates.clear();
+    for (uint32_t i = 0; i < backends.size(); i++)
+    {
+        if (!ejected(backends[i])
+                && std::find(excluded.begin(), excluded.end(), backends[i].key_) == excluded.end())
+            candidates.push_back(i);
+    }
+    // with every backend excluded they all get another chance
+    if (candidates.empty())
+    {
+        for (uint32_t i = 0; i < backends.size(); i++)
+        {
+            if (!ejected(backends[i]))
+                candidates.push_back(i);
+        }
+    }
+    if (candidates.empty())
+    {
+        for (uint32_t i = 0; i < backends.size(); i++)
+            candidates.push_back(i);
+    }
+
+    auto const & backend = backends[policy().choose(*set, loads_,
+            candidates.data(), candidates.size(), key)];
+    addr = backend.addr_;
+    if (id)
+    {
+        *id = backend.id_;
+        loads_.acquire(backend.id_);
+    }
+
+    return true;
+}
+
+void LoadBalancer::release(uint32_t id) noexcept
+{
+    loads_.release(id);
+}
+
+void LoadBalancer::observe(uint32_t id, std::chrono::nanoseconds latency)
+{
+    loads_.observe(id, latency);
+    outlier_.observe(id, latency);
+}
+
+void LoadBalancer::report(uint32_t id, OutlierDetector::FailureT failure)
+{
+    outlier_.report(id, failure);
+}
+
+OutlierStats LoadBalancer::outlierStats() const
+{
+    return outlier_.stats();
+}
+
+std::chrono::microseconds LoadBalancer::latencyP99(uint32_t id) const noexcept
+{
+    return outlier_.p99(id);
+}
+
+uint64_t LoadBalancer::keyOf(int sockfd)
+{
+    return keyOf(reactor::StreamSocket::getPeerAddr(sockfd));
+}
+
+uint64_t LoadBalancer::keyOf(reactor::InetAddr const & client) noexcept
+{
+    return client.hash(false);
+}
+
+bool LoadBalancer::hashing() const noexcept
+{
+    return ::proxy::hashing(tables_.load(std::memory_order_relaxed));
+}
+
+void LoadBalancer::setPolicy(PolicyType type)
+{
+    {
+        std::unique_lock<std::mutex> guard(mx_);
+        tables_.store(type, std::memory_order_relaxed);
+        // the table goes out before the policy that needs it
+        publish(guard);
+    }
+    setPolicy(makePolicy(type));
+}
+
+void LoadBalancer::setPolicy(PolicyFactory factory)
+{
+    std::lock_guard<std::mutex> guard(mx_);
+    policy_ = std::move(factory);
+    policy_gen_.fetch_add(1, std::memory_order_release);
+}
+
+BalancePolicy & LoadBalancer::policy()
+{
+    struct Slot
+    {
+        uint64_t                        gen_;
+        std::unique_ptr<BalancePolicy>  policy_;
+    };
+    // by balancer, pub ids are never reused
+    thread_local std::unordered_map<uint16_t, Slot> slots;
+
+    auto gen = policy_gen_.load(std::memory_order_acquire);
+    auto & slot = slots[pub_id_];
+    if (!slot.policy_ || slot.gen_ != gen)
+    {
+        std::lock_guard<std::mutex> guard(mx_);
+        slot.gen_ = gen;
+        slot.policy_ = policy_();
+    }
+
+    return *slot.policy_;
+}
+
+void LoadBalancer::publish(std::unique_lock<std::mutex> & lock)
+{
+    auto set = std::make_shared<BackendSet>();
+    set->backends_.reserve(backend_.size());
+    for (auto const & pair : backend_)
+    {
+        auto const & backend = pair.second;
+        // a ramping backend's weight is ramp()'s to set
+        auto ramping = ramps_.find(backend.id_);
+        if (ramping == ramps_.end())
+            loads_.setWeight(backend.id_, backend.weight_ * BackendLoads::WEIGHT_SCALE);
+        else
+            loads_.setWeight(backend.id_, static_cast<int64_t>(backend.weight_
+                        * BackendLoads::WEIGHT_SCALE
+                        * rampFactor(options_.slow_start_, Clock::now() - ramping->second)));
+
+        if (!down_.count(pair.first) && !ejected_.count(backend.id_))
+            set->backends_.push_back(backend);
+    }
+    // with every backend out the ejected ones get traffic again, then,
+    // all of them down being more likely the checks failing, the rest
+    if (set->backends_.empty())
+    {
+        for (auto const & pair : backend_)
+        {
+            if (!down_.count(pair.first))
+                set->backends_.push_back(pair.second);
+        }
+    }
+    if (set->backends_.empty())
     {
-        sock_map.emplace(sock, iter->second);
-        if (++iter == backend_.end())
-            iter = backend_.begin();
+        for (auto const & pair : backend_)
+            set->backends_.push_back(pair.second);
     }
+    // by id, the order stays put whatever the map does
+    std::sort(set->backends_.begin(), set->backends_.end(),
+            [](Backend const & a, Backend const & b) { return a.id_ < b.id_; });
+
+    auto tables = tables_.load(std::memory_order_relaxed);
+    auto count = backend_.size();
+    auto gen = ++drafted_;
+    lock.unlock();
+
+    // the tables are built with mx_ released, pickers keep their old set
+    // until this one is out
+    if (tables == MAGLEV)
+        set->maglev_.build(set->backends_);
+    else if (tables == RING_HASH)
+        set->ring_.build(set->backends_);
+
+    // a set drafted earlier but built slower does not replace this one
+    std::lock_guard<std::mutex> guard(publish_mx_);
+    if (gen < published_)
+        return;
+
+    published_ = gen;
+    outlier_.setBackends(count);
+    std::atomic_store(&snapshot_, std::shared_ptr<const BackendSet>(std::move(set)));
 }
 
 void LoadBalancer::stop()
 {
     stop_.store(true, std::memory_order_release);
+    // a parked thread has to see it
+    wakeup();
 }
 
 } // namespace
\ No newline at end of file
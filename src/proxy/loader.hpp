@@ -1,13 +1,19 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <deque>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "balance_policy.hpp"
+#include "health_checker.hpp"
+#include "outlier_detector.hpp"
 #include "proxy_ctx.hpp"
 #include "pub_sub.hpp"
 #include "publisher.hpp"
@@ -16,11 +22,71 @@
 
 namespace proxy {
 
+struct BalancerStats
+{
+    BalancerStats()
+        : wakeups_(0)
+        , spun_(0)
+        , batches_(0)
+        , idle_(0)
+        , busy_(0)
+    {}
+
+    size_t                      wakeups_;   // times the thread came back from parking
+    size_t                      spun_;      // of those, caught while still spinning
+    size_t                      batches_;
+    std::chrono::nanoseconds    idle_;      // spinning and parked
+    std::chrono::nanoseconds    busy_;
+};
+
+/**
+ * @brief how a backend added or back in service gets its share: its
+ * effective weight starts at min_percent_ of its weight and reaches all
+ * of it after window_. only the weighted policies see it.
+ */
+struct SlowStartOptions
+{
+    enum RampT
+    {
+        RAMP_LINEAR,
+        RAMP_EXPONENTIAL,   // by the same factor every step, a gentle start
+    };
+
+    SlowStartOptions()
+        : window_(0)
+        , ramp_(RAMP_LINEAR)
+        , min_percent_(10)
+    {}
+
+    std::chrono::milliseconds   window_;    // 0 turns it off
+    RampT                       ramp_;
+    uint32_t                    min_percent_;
+};
+
 class LoadBalancer : public ::pubsub::Publisher,
                      public ::pubsub::Subscriber
 {
 public:
-    LoadBalancer();
+    using Clock = std::chrono::steady_clock;
+
+    struct Options
+    {
+        Options()
+            : spin_(0)
+            , policy_(ROUND_ROBIN)
+            , outlier_()
+            , slow_start_()
+        {}
+
+        // polled before parking, trades a core for the wakeup latency
+        std::chrono::microseconds   spin_;
+        PolicyType                  policy_;
+        OutlierOptions              outlier_;
+        SlowStartOptions            slow_start_;
+    };
+
+public:
+    explicit LoadBalancer(Options const & options = Options());
     ~LoadBalancer();
 
     virtual uint16_t pubID() const override;
@@ -41,8 +107,9 @@ public:
      * @brief add new backend that is online
      * 
      * @param backend backend's address, got by InetAddr that load from configuration file
+     * @param weight  its share relative to the others, for the weighted policies
      */
-    void addBackend(reactor::InetAddr addr, uint16_t const & check_port);
+    void addBackend(reactor::InetAddr addr, uint16_t const & check_port, uint32_t weight = 1);
 
     /**
      * @brief remove backend that was offline
@@ -52,25 +119,121 @@ public:
     void removeBackend(reactor::InetAddr addr);
 
     /**
-     * @brief Timer Task. check whether all backend is alive or dead.
-     * if dead, remove the backend from cache.
-     * 
+     * @brief probe every backend on its check port from now on, those
+     * added later included. a backend that fails its checks leaves the
+     * set pick() sees until it passes them again. with all of them down
+     * all of them are used, rather than none.
      */
-    void checkAllBackend();
+    void startHealthCheck();
+
+    // how backends without options of their own are checked
+    void setHealthCheck(HealthCheckOptions const & options);
+
+    void setHealthCheck(reactor::InetAddr addr, HealthCheckOptions const & options);
 
+    // the text each check sends and expects back, as an echo service answers
     void specifyCheckText(std::string const & text);
 
+    HealthStats healthStats() const;
+
+    /**
+     * @brief the balancing thread. parks on an eventfd while nothing is
+     * queued and drains every queued batch into one FORWARD per wakeup.
+     * ejections and their ends are published from here as well.
+     */
     void loadbalance();
 
+    // the policy every thread switches to at its next pick
+    void setPolicy(PolicyType type);
+
+    void setPolicy(PolicyFactory factory);
+
+    /**
+     * @brief choose the backend for one connection, safe from any thread.
+     * backends in `excluded` are skipped unless nothing else is left.
+     *
+     * @param id    if given, the session is counted against the backend
+     *              until release(*id)
+     * @param key   affinity key for MAGLEV and RING_HASH, see hashKey()
+     * @return false if there is no backend at all
+     */
+    bool pick(::reactor::InetAddr & addr,
+            std::vector<std::string> const & excluded = std::vector<std::string>(),
+            uint32_t * id = nullptr, uint64_t key = 0);
+
+    // the affinity key of a connection: its client's ip
+    static uint64_t keyOf(int sockfd);
+
+    static uint64_t keyOf(::reactor::InetAddr const & client) noexcept;
+
+    // whether pick() looks at the key
+    bool hashing() const noexcept;
+
+    // the session picked with id is over
+    void release(uint32_t id) noexcept;
+
+    // one request on a session with backend id was answered after latency
+    void observe(uint32_t id, std::chrono::nanoseconds latency);
+
+    /**
+     * @brief backend id failed a session, from the forwarding path. too
+     * many of those and the backend is ejected from the set pick() sees
+     * for a while, see OutlierOptions.
+     */
+    void report(uint32_t id, OutlierDetector::FailureT failure);
+
+    OutlierStats outlierStats() const;
+
+    // p99 of backend id's answers in the last interval that had any
+    std::chrono::microseconds latencyP99(uint32_t id) const noexcept;
+
+    // the weight addr is picked by right now, 0 if it is unknown
+    double effectiveWeight(reactor::InetAddr addr) const;
+
+    // safe from any thread
+    BalancerStats stats() const;
+
     void stop();
 
 private:
+    // spin for options_.spin_, then sleep until the next batch or stop()
+    void park();
+
+    void wakeup();
+
+    // the calling thread's instance of the current policy
+    BalancePolicy & policy();
+
+    /**
+     * @brief hands readers a new BackendSet. lock holds mx_ while the set
+     * is drafted and is released before its hash tables are built.
+     */
+    void publish(std::unique_lock<std::mutex> & lock);
+
+    // from the checker's thread
+    void updateForHealth(std::string const & backend, bool healthy);
+
+    // from whichever thread ejected id or let it back, outlier_'s lock held
+    void updateForOutlier(uint32_t id, bool ejected);
+
+    // from the balancing thread, brings ejected_ in line with outliers_
+    void applyOutliers();
+
+    // slow-start id from now on, mx_ is held
+    void startRamp(uint32_t id);
+
+    // moves the ramps on if a step is due, called by pick()
+    void ramp();
+
+    // (re)start probing backend if checks are running, mx_ is held
+    void watch(std::string const & backend);
+
     /**
      * @brief implementation for Load Balancing algorithm.
      * default to Round Robin.
      * 
      */
-    void balancing(std::vector<int> & sockes,
+    void balancing(context::LoadBalanceCtx const & ctx,
             std::unordered_map<int, ::reactor::InetAddr> & sock_map);
 
 private:
@@ -78,14 +241,52 @@ private:
     uint16_t                                sub_id_;
     std::shared_ptr<pubsub::PubSubCenter>   center_;
     std::unordered_map<std::string,
-            reactor::InetAddr>              backend_;
-    std::mutex                              mx_;
+            Backend>                        backend_;
+    // ids are kept for an [ip:port] that leaves and comes back
+    std::unordered_map<std::string,
+            uint32_t>                       ids_;
+    std::shared_ptr<const BackendSet>       snapshot_;
+    BackendLoads                            loads_;
+    PolicyFactory                           policy_;
+    std::atomic<uint64_t>                   policy_gen_;
+    // the hash table publish() builds: MAGLEV, RING_HASH, or none
+    std::atomic<PolicyType>                 tables_;
+    // sets drafted under mx_, the last published under publish_mx_
+    uint64_t                                drafted_;
+    uint64_t                                published_;
+    std::mutex                              publish_mx_;
+    mutable std::mutex                      mx_;
     std::atomic_bool                        stop_;
-    std::vector<int>                        sockes_;
-    std::deque<std::vector<int>>            sock_queue_;
+    std::deque<std::shared_ptr<
+        context::LoadBalanceCtx>>           sock_queue_;
+    Options                                 options_;
+    int                                     wakeup_fd_;
+    std::atomic<bool>                       wakeup_pending_;
+    std::atomic<uint64_t>                   wakeups_;
+    std::atomic<uint64_t>                   spun_;
+    std::atomic<uint64_t>                   batches_;
+    std::atomic<int64_t>                    idle_ns_;
+    std::atomic<int64_t>                    busy_ns_;
     std::unordered_map<std::string,
                         uint16_t>        checked_;
-    std::string                             text_;
+    // failing their health checks, left out of the published set
+    std::unordered_set<std::string>         down_;
+    // by id, ejected by outlier_ and left out as well
+    std::unordered_set<uint32_t>            ejected_;
+    // by id, as outlier_ last told, ahead of ejected_ until applyOutliers()
+    std::unique_ptr<std::atomic<bool>[]>    outliers_;
+    std::atomic<bool>                       outliers_dirty_;
+    // by id, when their slow start began
+    std::unordered_map<uint32_t,
+            Clock::time_point>              ramps_;
+    // steady clock ticks, max while nothing ramps
+    std::atomic<int64_t>                    next_ramp_;
+    OutlierDetector                         outlier_;
+    HealthCheckOptions                      check_options_;
+    std::unordered_map<std::string,
+            HealthCheckOptions>             backend_checks_;
+    // last, it calls back into the rest until it is gone
+    std::unique_ptr<HealthChecker>          checker_;
 };
 
 } // namespace
\ No newline at end of file
@@ -0,0 +1,286 @@
+#include <algorithm>
+#include <unordered_map>
+
+#include "outlier_detector.hpp"
+
+namespace proxy {
+
+namespace {
+
+std::atomic<uint64_t> serials(0);
+
+// only the owning thread writes a shard, a plain store does
+void bump(std::atomic<uint64_t> & counter) noexcept
+{
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+size_t bucketOf(std::chrono::nanoseconds latency) noexcept
+{
+    auto us = static_cast<uint64_t>(std::max<int64_t>(latency.count() / 1000, 1));
+    auto bucket = static_cast<size_t>(63 - __builtin_clzll(us));
+
+    return std::min(bucket, OutlierDetector::LATENCY_BUCKETS - 1);
+}
+
+// the upper bound of the bucket the q-th answer fell in
+int64_t percentile(uint64_t const * window, uint64_t answers, double q) noexcept
+{
+    auto rank = static_cast<uint64_t>(q * answers);
+    uint64_t seen = 0;
+    size_t bucket = 0;
+    for (; bucket < OutlierDetector::LATENCY_BUCKETS - 1; bucket++)
+    {
+        seen += window[bucket];
+        if (seen > rank)
+            break;
+    }
+
+    return int64_t(2) << bucket;
+}
+
+} // namespace
+
+OutlierDetector::Shard::Shard()
+    : counters_(new Counters[MAX_BACKENDS]())
+{}
+
+OutlierDetector::OutlierDetector(OutlierOptions const & options, Listener listener)
+    : options_(options)
+    , listener_(std::move(listener))
+    , serial_(serials.fetch_add(1, std::memory_order_relaxed))
+    , states_(new State[MAX_BACKENDS])
+    , ids_(0)
+    , backends_(0)
+    , next_sweep_((Clock::now() + options.interval_).time_since_epoch().count())
+    , shards_()
+    , ejected_(0)
+    , stats_()
+{}
+
+void OutlierDetector::report(uint32_t id, FailureT failure)
+{
+    if (id >= MAX_BACKENDS)
+        return;
+
+    track(id);
+    auto & counters = shard().counters_[id];
+    bump(counters.failures_);
+    bump(failure == CONNECT_ERROR ? counters.connect_errors_ : counters.resets_);
+
+    // the run is counted across threads, a bad backend fails on all of them
+    auto & state = states_[id];
+    auto run = state.consecutive_.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (options_.consecutive_failures_ > 0 && run >= options_.consecutive_failures_)
+    {
+        std::lock_guard<std::mutex> guard(mx_);
+        if (!state.ejected_)
+            eject(id, Clock::now(), CONSECUTIVE);
+    }
+
+    tick();
+}
+
+void OutlierDetector::observe(uint32_t id, std::chrono::nanoseconds latency)
+{
+    if (id >= MAX_BACKENDS)
+        return;
+
+    track(id);
+    auto & counters = shard().counters_[id];
+    bump(counters.successes_);
+    bump(counters.latency_[bucketOf(latency)]);
+
+    // read first, a healthy backend's line is not written by every answer
+    auto & state = states_[id];
+    if (state.consecutive_.load(std::memory_order_relaxed) != 0)
+        state.consecutive_.store(0, std::memory_order_relaxed);
+
+    tick();
+}
+
+void OutlierDetector::tick()
+{
+    auto now = Clock::now();
+    auto due = next_sweep_.load(std::memory_order_relaxed);
+    if (now.time_since_epoch().count() < due)
+        return;
+
+    // one thread wins the interval, the others go on forwarding
+    auto next = (now + options_.interval_).time_since_epoch().count();
+    if (!next_sweep_.compare_exchange_strong(due, next, std::memory_order_relaxed))
+        return;
+
+    std::lock_guard<std::mutex> guard(mx_);
+    sweep(now);
+}
+
+void OutlierDetector::setBackends(size_t count) noexcept
+{
+    backends_.store(count, std::memory_order_relaxed);
+}
+
+std::chrono::microseconds OutlierDetector::p99(uint32_t id) const noexcept
+{
+    if (id >= MAX_BACKENDS)
+        return std::chrono::microseconds(0);
+
+    return std::chrono::microseconds(states_[id].p99_us_.load(std::memory_order_relaxed));
+}
+
+OutlierStats OutlierDetector::stats() const
+{
+    std::lock_guard<std::mutex> guard(mx_);
+    auto stats = stats_;
+    stats.ejected_ = ejected_;
+
+    auto n = std::min<uint32_t>(ids_.load(std::memory_order_relaxed), MAX_BACKENDS);
+    for (auto const & shard : shards_)
+    {
+        for (uint32_t id = 0; id < n; id++)
+        {
+            auto const & counters = shard.counters_[id];
+            stats.connect_errors_ += counters.connect_errors_.load(std::memory_order_relaxed);
+            stats.resets_ += counters.resets_.load(std::memory_order_relaxed);
+        }
+    }
+
+    return stats;
+}
+
+void OutlierDetector::track(uint32_t id) noexcept
+{
+    auto seen = ids_.load(std::memory_order_relaxed);
+    while (seen <= id && !ids_.compare_exchange_weak(seen, id + 1, std::memory_order_relaxed))
+        ;
+}
+
+OutlierDetector::Shard & OutlierDetector::shard()
+{
+    // by detector, serials are never reused
+    thread_local std::unordered_map<uint64_t, Shard *> shards;
+
+    auto & slot = shards[serial_];
+    if (!slot)
+    {
+        std::lock_guard<std::mutex> guard(mx_);
+        shards_.emplace_back();
+        slot = &shards_.back();
+    }
+
+    return *slot;
+}
+
+void OutlierDetector::sweep(Clock::time_point now)
+{
+    struct Judged
+    {
+        uint32_t    id_;
+        int64_t     p99_us_;
+    };
+    std::vector<Judged> judged;
+
+    auto n = std::min<uint32_t>(ids_.load(std::memory_order_relaxed), MAX_BACKENDS);
+    for (uint32_t id = 0; id < n; id++)
+    {
+        uint64_t successes = 0;
+        uint64_t failures = 0;
+        uint64_t latency[LATENCY_BUCKETS] = {};
+        for (auto const & shard : shards_)
+        {
+            auto const & counters = shard.counters_[id];
+            successes += counters.successes_.load(std::memory_order_relaxed);
+            failures += counters.failures_.load(std::memory_order_relaxed);
+            for (size_t b = 0; b < LATENCY_BUCKETS; b++)
+                latency[b] += counters.latency_[b].load(std::memory_order_relaxed);
+        }
+
+        // what happened since the last sweep
+        auto & state = states_[id];
+        auto answers = successes - state.successes_;
+        auto failed = failures - state.failures_;
+        uint64_t window[LATENCY_BUCKETS];
+        for (size_t b = 0; b < LATENCY_BUCKETS; b++)
+        {
+            window[b] = latency[b] - state.latency_[b];
+            state.latency_[b] = latency[b];
+        }
+        state.successes_ = successes;
+        state.failures_ = failures;
+        if (answers > 0)
+            state.p99_us_.store(percentile(window, answers, 0.99), std::memory_order_relaxed);
+
+        if (state.ejected_)
+        {
+            if (now < state.until_)
+                continue;
+
+            state.ejected_ = false;
+            state.consecutive_.store(0, std::memory_order_relaxed);
+            ejected_--;
+            listener_(id, false);
+            continue;
+        }
+
+        auto requests = answers + failed;
+        if (options_.failure_ratio_ > 0 && requests > 0 && requests >= options_.min_requests_
+                && failed >= options_.failure_ratio_ * requests
+                && eject(id, now, FAILURE_RATIO))
+            continue;
+
+        // a clean interval takes one step off the back-off
+        if (failed == 0 && answers > 0 && state.times_ > 0)
+            state.times_--;
+
+        if (answers > 0 && answers >= options_.min_requests_)
+            judged.push_back(Judged{id, state.p99_us_.load(std::memory_order_relaxed)});
+    }
+
+    // slow only next to the others, it takes a few to tell
+    if (options_.latency_factor_ <= 0 || judged.size() < 3)
+        return;
+
+    std::vector<int64_t> p99s;
+    for (auto const & one : judged)
+        p99s.push_back(one.p99_us_);
+    std::nth_element(p99s.begin(), p99s.begin() + p99s.size() / 2, p99s.end());
+    auto median = p99s[p99s.size() / 2];
+    for (auto const & one : judged)
+    {
+        if (one.p99_us_ > options_.latency_factor_ * median)
+            eject(one.id_, now, LATENCY);
+    }
+}
+
+bool OutlierDetector::eject(uint32_t id, Clock::time_point now, CauseT cause)
+{
+    // rounded down, one backend of one is never ejected
+    auto backends = backends_.load(std::memory_order_relaxed);
+    if ((ejected_ + 1) * 100 > backends * options_.max_ejection_percent_)
+    {
+        stats_.refused_++;
+        return false;
+    }
+
+    auto & state = states_[id];
+    auto shift = std::min<uint32_t>(state.times_, 30);
+    auto duration = std::min<std::chrono::milliseconds>(
+            options_.base_ejection_ * (int64_t(1) << shift), options_.max_ejection_);
+    state.ejected_ = true;
+    state.until_ = now + duration;
+    state.times_++;
+    state.consecutive_.store(0, std::memory_order_relaxed);
+    ejected_++;
+
+    if (cause == CONSECUTIVE)
+        stats_.consecutive_++;
+    else if (cause == FAILURE_RATIO)
+        stats_.failure_ratio_++;
+    else
+        stats_.latency_++;
+
+    listener_(id, true);
+    return true;
+}
+
+} // namespace proxy
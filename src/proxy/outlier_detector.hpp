@@ -0,0 +1,184 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "backend.hpp"
+
+namespace proxy {
+
+struct OutlierOptions
+{
+    OutlierOptions()
+        : consecutive_failures_(5)
+        , interval_(std::chrono::seconds(1))
+        , base_ejection_(std::chrono::seconds(5))
+        , max_ejection_(std::chrono::seconds(300))
+        , max_ejection_percent_(50)
+        , min_requests_(20)
+        , failure_ratio_(0.5)
+        , latency_factor_(5.0)
+    {}
+
+    uint32_t                    consecutive_failures_;  // ejects at once, 0 turns it off
+    std::chrono::milliseconds   interval_;              // between sweeps over the counters
+    std::chrono::milliseconds   base_ejection_;         // doubled for every ejection in a row
+    std::chrono::milliseconds   max_ejection_;
+    uint32_t                    max_ejection_percent_;  // of the backends, at most
+    uint64_t                    min_requests_;          // in an interval, to be judged by it
+    double                      failure_ratio_;         // failed / all in an interval, 0 off
+    double                      latency_factor_;        // p99 over the median p99, 0 off
+};
+
+struct OutlierStats
+{
+    OutlierStats()
+        : connect_errors_(0)
+        , resets_(0)
+        , ejected_(0)
+        , consecutive_(0)
+        , failure_ratio_(0)
+        , latency_(0)
+        , refused_(0)
+    {}
+
+    size_t connect_errors_;
+    size_t resets_;
+    size_t ejected_;        // right now
+    size_t consecutive_;    // ejections so far, by cause
+    size_t failure_ratio_;
+    size_t latency_;
+    size_t refused_;        // would have ejected past max_ejection_percent_
+};
+
+/**
+ * @brief passive health from live traffic. the forwarding threads report
+ * outcomes per backend id into counters of their own, lock-free. a run
+ * of failures ejects the backend right away, failure ratio and latency
+ * outliers are found by a sweep every interval, run by whichever thread
+ * reports or picks once it is due. an ejection lasts base_ejection_,
+ * doubled each time it happens again, and ends at a later sweep.
+ */
+class OutlierDetector
+{
+public:
+    // how a backend failed, answers are reported through observe()
+    enum FailureT
+    {
+        CONNECT_ERROR,
+        RESET,
+    };
+
+    // hears of ejections and their ends, from any thread with the
+    // detector's lock held, so it must not block or call back
+    using Listener = std::function<void(uint32_t id, bool ejected)>;
+
+    // log2 of microseconds, the last one takes everything longer
+    static constexpr size_t LATENCY_BUCKETS = 24;
+
+public:
+    OutlierDetector(OutlierOptions const & options, Listener listener);
+    OutlierDetector(const OutlierDetector &) = delete;
+    OutlierDetector & operator=(const OutlierDetector &) = delete;
+
+    void report(uint32_t id, FailureT failure);
+
+    // an answer after latency, a success
+    void observe(uint32_t id, std::chrono::nanoseconds latency);
+
+    // sweeps if one is due, a clock read otherwise
+    void tick();
+
+    // how many backends ejections are limited against
+    void setBackends(size_t count) noexcept;
+
+    // the p99 of id's latency in the last interval it had answers in
+    std::chrono::microseconds p99(uint32_t id) const noexcept;
+
+    OutlierStats stats() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // one thread's counters, only that thread writes them
+    struct Shard
+    {
+        struct Counters
+        {
+            std::atomic<uint64_t> successes_;
+            std::atomic<uint64_t> failures_;    // the two below together
+            std::atomic<uint64_t> connect_errors_;
+            std::atomic<uint64_t> resets_;
+            std::atomic<uint64_t> latency_[LATENCY_BUCKETS];
+        };
+
+        Shard();
+
+        std::unique_ptr<Counters[]> counters_;
+    };
+
+    // per backend, shared
+    struct State
+    {
+        State()
+            : consecutive_(0)
+            , ejected_(false)
+            , until_()
+            , times_(0)
+            , successes_(0)
+            , failures_(0)
+            , latency_()
+            , p99_us_(0)
+        {}
+
+        std::atomic<uint32_t>   consecutive_;
+        // the rest under mx_
+        bool                    ejected_;
+        Clock::time_point       until_;
+        uint32_t                times_;         // ejections in a row, for the back-off
+        uint64_t                successes_;     // totals at the last sweep
+        uint64_t                failures_;
+        uint64_t                latency_[LATENCY_BUCKETS];
+        std::atomic<int64_t>    p99_us_;
+    };
+
+    enum CauseT
+    {
+        CONSECUTIVE,
+        FAILURE_RATIO,
+        LATENCY,
+    };
+
+    // ids_ covers id from now on
+    void track(uint32_t id) noexcept;
+
+    Shard & shard();
+
+    void sweep(Clock::time_point now);
+
+    // mx_ is held, false if max_ejection_percent_ forbids it
+    bool eject(uint32_t id, Clock::time_point now, CauseT cause);
+
+private:
+    OutlierOptions                      options_;
+    Listener                            listener_;
+    uint64_t                            serial_;        // tells detectors apart in thread_local
+    std::unique_ptr<State[]>            states_;
+    std::atomic<uint32_t>               ids_;           // one past the highest id reported
+    std::atomic<size_t>                 backends_;
+    std::atomic<int64_t>                next_sweep_;    // steady clock ticks
+
+    mutable std::mutex                  mx_;
+    std::deque<Shard>                   shards_;
+    size_t                              ejected_;
+    OutlierStats                        stats_;
+};
+
+} // namespace proxy
@@ -3,6 +3,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
@@ -17,9 +18,12 @@ struct LoadBalanceCtx : ::pubsub::Context
     LoadBalanceCtx(uint16_t event, size_t /* forward socket */ cnt = 0)
         : ::pubsub::Context(event)
         , sockes_(cnt)
+        , excluded_()
     {}
 
     std::vector<int> sockes_;
+    // [ip:port] of backends these sockets already failed to connect to
+    std::vector<std::string> excluded_;
 };
 
 struct ForwardContext : ::pubsub::Context
@@ -33,5 +37,16 @@ struct ForwardContext : ::pubsub::Context
             int, reactor::InetAddr>> sock_to_backend_;
 };
 
+// a client is gone, published before its fd is closed
+struct DisconnectContext : ::pubsub::Context
+{
+    DisconnectContext(uint16_t event, int fd = -1)
+        : ::pubsub::Context(event)
+        , fd_(fd)
+    {}
+
+    int fd_;
+};
+
 } // namespace
 } // namespace
\ No newline at end of file
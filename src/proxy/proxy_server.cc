@@ -1,53 +1,101 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 
+#include <algorithm>
+#include <future>
 #include <iostream>
+#include <thread>
+#include <tuple>
+#include <utility>
 
+#include "loader.hpp"
 #include "proxy_server.hpp"
 #include "pub_type.hpp"
-
-#ifdef MSG_ATTACH
-#   include <string.h>
-#   include <sys/mman.h>
-#   include <sys/socket.h>
-#   include "packet.hpp"
-#endif
+#include "tcp_server.hpp"
 
 namespace proxy {
 
-ProxyServer::ProxyServer(int n_thread)
+constexpr int const ProxyServer::SEND_PROPER_SIZE;
+
+namespace {
+
+// upper bound of the fd numbers this process can hold
+size_t maxFds()
+{
+    static const size_t CAP = 1 << 20;
+
+    struct rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == RLIM_INFINITY)
+        return CAP;
+
+    return std::min(static_cast<size_t>(limit.rlim_cur), CAP);
+}
+
+// timers tick in milliseconds, waking early would only find it paused
+std::chrono::milliseconds roundUp(std::chrono::nanoseconds wait) noexcept
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            wait + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1));
+}
+
+} // namespace
+
+ProxyServer::ProxyServer(int n_thread, ::reactor::Demultiplex::Backend backend,
+        UpstreamPool::Options const & upstream)
     : sub_id_(::pubsub::ID::sub_id())
     , pub_id_(::pubsub::ID::pub_id())
     , center_(::pubsub::PubSubCenter::instance())
-    , pipe_()
     , stop_(false)
     , flag_(false)
-    , sock_map_()
+    , shards_()
+    , owners_(maxFds())
+    , pipes_()
+    , connect_timeouts_(std::make_shared<ConnectTimeouts const>())
+    , upstream_options_(upstream)
+    , limiter_()
+    , shaping_()
+    , backend_shaper_()
+    , server_(nullptr)
+    , balancer_(nullptr)
+    , served_()
+    , alive_(std::make_shared<Liveness>())
     , group_()
 {
-    if (::pipe2(pipe_, O_NONBLOCK) == -1)
-        throw std::runtime_error("can't open two pipe to transfer data in kernel space");
-
-    group_.init(n_thread);
+    group_.create(n_thread, backend);
 
     auto const & dmpes = group_.dmp();
     for (auto & dmp : dmpes)
     {
+        shards_.emplace(dmp.get(), std::unique_ptr<Shard>(new Shard(upstream)));
         dmp->enableNotify(false);
-        center_->subscribe(dmp->pubID(), pubsub::DMPWAIT, this);
+        dmp->handlers<::reactor::context::DmpWaitContext>().attach(this);
+        pruneEvery(*dmp);
     }
+    group_.start();
 
     center_->registerPub(pub_id_, this);
 }
 
 ProxyServer::~ProxyServer()
 {
-    ::close(pipe_[0]);
-    ::close(pipe_[1]);
+    {
+        std::lock_guard<std::mutex> guard(alive_->mx_);
+        alive_->alive_ = false;
+    }
 
-    auto const & dmpes = group_.dmp();
-    for (auto & dmp : dmpes)
-        center_->unSubscribe(dmp->pubID(), pubsub::DMPWAIT, this);
+    if (server_)
+        center_->unSubscribe(server_->pubID(), ::pubsub::DISCONNECTED, this);
+    center_->unRegisterPub(pub_id_);
+
+    // the served loops hand backends to ours, they go first
+    teardown(served_, false);
+    teardown(group_.dmp(), true);
+
+    stop_.store(true, std::memory_order_release);
+    group_.stop();
 }
 
 uint16_t ProxyServer::subID() const
@@ -64,202 +112,1257 @@ void ProxyServer::subscribe(uint16_t pubID, ::pubsub::PubType type)
 
 void ProxyServer::notify(::pubsub::PubType type, std::shared_ptr<::pubsub::Context> ctx)
 {
-    center_->notifySubscriber(pub_id_, pubsub::FORWARD, ctx);
+    center_->notifySubscriber(pub_id_, type, ctx);
 }
 
 void ProxyServer::update(std::shared_ptr<::pubsub::Context> ctx)
 {
     switch (ctx->event_type_) {
-        case ::pubsub::DMPWAIT:
-        {
-            auto wait_ctx = std::dynamic_pointer_cast<::reactor::context::DmpWaitContext>(ctx);
-            updateForWait(wait_ctx);
-            break;
-        }
         case ::pubsub::FORWARD:
         {
             auto forward_ctx = std::dynamic_pointer_cast<context::ForwardContext>(ctx);
             updateForForward(forward_ctx);
             break;
         }
+        case ::pubsub::DISCONNECTED:
+        {
+            auto disconnect_ctx = std::dynamic_pointer_cast<context::DisconnectContext>(ctx);
+            updateForDisconnect(disconnect_ctx);
+            break;
+        }
         default:
             break;
     }
 }
 
-void ProxyServer::updateForWait(std::shared_ptr<::reactor::context::DmpWaitContext> ctx)
+void ProxyServer::handle(::reactor::context::DmpWaitContext & ctx)
 {
-#ifdef MSG_ATTACH
-    auto packet = new Packet;
+    updateForWait(ctx);
+}
+
+void ProxyServer::setConnectTimeout(std::string const & backend,
+        std::chrono::milliseconds timeout)
+{
+    std::lock_guard<std::mutex> guard(mx_);
+    auto timeouts = std::make_shared<ConnectTimeouts>(*connect_timeouts_);
+    (*timeouts)[backend] = timeout;
+    std::atomic_store(&connect_timeouts_, std::shared_ptr<ConnectTimeouts const>(std::move(timeouts)));
+}
+
+void ProxyServer::setRateLimiter(std::shared_ptr<::reactor::RateLimiter> limiter)
+{
+    std::lock_guard<std::mutex> guard(mx_);
+    limiter_ = std::move(limiter);
+}
+
+void ProxyServer::setShaping(ShapingOptions const & options)
+{
+    std::lock_guard<std::mutex> guard(mx_);
+    shaping_ = options;
+    backend_shaper_.reset();
+    if (options.backend_rate_ > 0)
+    {
+        ::reactor::RateLimitOptions limit;
+        limit.bytes_per_sec_ = options.backend_rate_;
+        limit.byte_burst_ = options.burst_;
+        limit.slots_ = 4 * 1024;
+        backend_shaper_.reset(new ::reactor::RateLimiter(limit));
+    }
+}
+
+void ProxyServer::setReadBudget(::reactor::Demultiplex::ReadBudget const & budget)
+{
+    for (auto & dmp : group_.dmp())
+    {
+        auto loop = dmp.get();
+        if (!loop->runInLoop([loop, budget] { loop->setReadBudget(budget); }))
+        {
+#ifdef Debug
+            std::cout << "loop backlogged, read budget not set on " << loop->pubID() << "\n";
 #endif
-    for (auto & resp : ctx->resp_events_)
+        }
+    }
+}
+
+void ProxyServer::serve(::reactor::TcpServer & server, LoadBalancer & balancer)
+{
+    server_ = &server;
+    balancer_ = &balancer;
+    served_ = server.loops();
+    if (!limiter_)
+        limiter_ = server.rateLimiter();
+
+    // attached after the server, its handler has seen the batch first
+    for (auto & dmp : served_)
     {
+        shards_.emplace(dmp.get(), std::unique_ptr<Shard>(new Shard(upstream_options_)));
+        dmp->handlers<::reactor::context::DmpWaitContext>().attach(this);
+        pruneEvery(*dmp);
+    }
+
+    server.enableBalance(false);
+    subscribe(server.pubID(), ::pubsub::DISCONNECTED);
+}
+
+void ProxyServer::updateForWait(::reactor::context::DmpWaitContext & ctx)
+{
+    auto & dmp = *ctx.dmp_;
+    auto & shard = shardOf(dmp);
+    for (auto & resp : ctx.resp_events_)
+    {
+        int backend = resp.fd;
+        bool fresh = false;
+        auto relay = shard.relays_.find(resp.fd);
+        if (!relay)
+        {
+            // a client end, watched here or spliced from on io_uring
+            backend = shard.backendOf(resp.fd);
+            if (backend >= 0)
+                relay = shard.relays_.find(backend);
+            // a parked backend that hung up or spoke out of turn
+            else if (shard.upstream_.evict(resp.fd))
+            {
+#ifdef Debug
+                std::cout << "evict parked backend fd: " << resp.fd << "\n";
+#endif
+            }
+            // or a served client without a session yet
+            else if (server_ && server_->ownerOf(resp.fd) == &dmp)
+                fresh = true;
+        }
+        if (fresh && (resp.events & ::reactor::Demultiplex::READABLE)
+                && !(resp.events & ::reactor::Demultiplex::CLOSABLE))
+            startSession(dmp, resp.fd);
+        if (!relay)
+            continue;
+        int client = relay->client_;
+#ifdef Debug
         std::cout << "resp.fd, " << resp.fd
-                  << ", backend fd: " << sock_map_.at(resp.fd)
+                  << ", backend fd: " << backend
                   << "\n";
-        if ((resp.events & ::reactor::Demultiplex::READABLE)
-                && !(resp.events & ::reactor::Demultiplex::CLOSABLE)
-            )
+#endif
+
+        // before anything reads SO_ERROR, which clears it
+        if (resp.fd == backend && relay->connecting_)
+        {
+            finishConnect(dmp, *relay, backend, resp.events);
+            continue;
+        }
+
+        // EPOLLERR may only announce MSG_ZEROCOPY completions
+        auto events = resp.events;
+        if (::reactor::ZeroCopySender::completionOnly(resp.fd, events)
+                && reapCompletions(shard, resp.fd))
+            events &= ~static_cast<uint32_t>(EPOLLERR);
+
+        if (resp.fd == client)
+        {
+            // nothing moved: the client ran dry, its next forward restarts it
+            if ((resp.events & ::reactor::Demultiplex::SPLICED)
+                    && !(resp.events & ::reactor::Demultiplex::CLOSABLE)
+                    && resp.res > 0)
+            {
+                charge(*relay, resp.res);
+                measure(*relay, true, resp.res);
+                // paused, the splice is started again once in budget
+                if (!throttled(dmp, *relay, backend))
+                    spliceInLoop(dmp, client, backend, relay->up_);
+            }
+            else
+            {
+                auto alive = true;
+                if ((resp.events & ::reactor::Demultiplex::WRITABLE)
+                        && !paced(dmp, *relay, backend))
+                    alive = relayDown(dmp, *relay, backend);
+                // a client sharing the loop is read right here
+                if (alive && !relay->connecting_ && relay->shared_loop_
+                        && (resp.events & ::reactor::Demultiplex::READABLE)
+                        && !(resp.events & ::reactor::Demultiplex::CLOSABLE))
+                    forwardUp(dmp, *relay, backend);
+            }
+            // the client's own loop takes care of it closing
+            continue;
+        }
+
+        // a real event on the backend stands in for the deferral as well
+        if (relay->up_deferred_ && !(events & ::reactor::Demultiplex::CLOSABLE)
+                && !forwardUp(dmp, *relay, backend))
+            continue;
+        // deferred for the client only, the backend was read dry
+        if ((events & ::reactor::Demultiplex::DEFERRED) && !relay->down_deferred_)
+            continue;
+
+        if ((events & ::reactor::Demultiplex::RECEIVED) && resp.res > 0)
+        {
+            measure(*relay, false, resp.res);
+            shape(*relay, resp.res);
+            // the receive buffer itself is handed to the send
+            if (dmp.sendReceived(client, resp) < 0)
+                ::perror("send of received buffer: ");
+        }
+        else if (events & ::reactor::Demultiplex::SPLICED)
+        {
+            measure(*relay, false, resp.res);
+            shape(*relay, resp.res);
+            if (resp.res > 0 && !(events & ::reactor::Demultiplex::CLOSABLE)
+                    && !paced(dmp, *relay, backend))
+                spliceInLoop(dmp, backend, client, relay->down_);
+        }
+        else if (events & ::reactor::Demultiplex::READABLE)
         {
 #ifdef MSG_ATTACH
-            forward(resp.fd, sock_map_.at(resp.fd), packet);
+            if (!(events & ::reactor::Demultiplex::CLOSABLE))
+                forwardDown(dmp, *relay, backend);
 #else
-            zeroCopy(resp.fd, sock_map_.at(resp.fd));
+            if (dmp.backend() == ::reactor::Demultiplex::URING)
+            {
+                if (!(events & ::reactor::Demultiplex::CLOSABLE))
+                    forwardDown(dmp, *relay, backend);
+            }
+            else if (!paced(dmp, *relay, backend) && !relayDown(dmp, *relay, backend))
+                continue;
 #endif
         }
-        if (resp.events & ::reactor::Demultiplex::CLOSABLE)
+        // a paused client's pipe is flushed when its timer reads it again
+        if ((events & ::reactor::Demultiplex::WRITABLE) && relay->up_stalled_
+                && !throttled(dmp, *relay, backend) && !relayUp(dmp, *relay, backend))
+            continue;
+
+        if (events & ::reactor::Demultiplex::CLOSABLE)
+            closeOrDrain(dmp, *relay, backend, events);
+    }
+}
+
+void ProxyServer::updateForForward(std::shared_ptr<context::ForwardContext> ctx)
+{
+    for (auto & pair : *ctx->sock_to_backend_)
+    {
+        int const & incoming = pair.first;
+        auto const & addr    = pair.second;
+        if (incoming < 0 || static_cast<size_t>(incoming) >= owners_.size())
+            continue;
+
+        // a client stays with the loop holding its relay, a new one
+        // claims the next loop of ours
+        auto loop = owners_[incoming].load(std::memory_order_acquire);
+        auto claimed = false;
+        if (!loop)
         {
-            ::close(resp.fd);
+            auto next = group_.next().get();
+            claimed = owners_[incoming].compare_exchange_strong(loop, next,
+                    std::memory_order_acq_rel);
+            if (claimed)
+                loop = next;
+        }
 
-            std::lock_guard<std::mutex> guard(mx_);
-            if (sock_map_.find(resp.fd) == sock_map_.end())
-                continue;
-            reversed_map_.erase(sock_map_.at(resp.fd));
-            sock_map_.erase(resp.fd);
-            std::cout << "remove backend fd: " << resp.fd << "\n";
+        // the pair's buffers, pipes and timers belong to that loop, so
+        // the client is read there and is accounted there
+        auto posted = loop->runInLoop([this, loop, incoming, addr] {
+            forwardInLoop(*loop, incoming, addr);
+        });
+        if (!posted)
+        {
+            // nothing of the client went to the loop, it is free again
+            if (claimed)
+                owners_[incoming].compare_exchange_strong(loop, nullptr,
+                        std::memory_order_acq_rel);
+#ifdef Debug
+            std::cout << "backend loop backlogged, deferring fd: " << incoming << "\n";
+#endif
         }
     }
 }
 
-void ProxyServer::updateForForward(std::shared_ptr<context::ForwardContext> ctx)
+void ProxyServer::forwardInLoop(::reactor::Demultiplex & dmp, int client,
+        ::reactor::InetAddr const & addr)
 {
-#ifdef MSG_ATTACH
-    auto packet = new Packet;
+    auto & shard = shardOf(dmp);
+    auto backend = shard.backendOf(client);
+    if (backend < 0)
+    {
+        backend = establishWith(dmp, addr, client, false);
+        if (backend < 0)
+        {
+            disown(shard, dmp, client);
+            return;
+        }
+    }
+
+    // the client's bytes wait in its socket until the handshake is done
+    auto relay = shard.relays_.find(backend);
+    if (relay && !relay->connecting_)
+        forwardUp(dmp, *relay, backend);
+}
+
+void ProxyServer::updateForDisconnect(std::shared_ptr<context::DisconnectContext> ctx)
+{
+    auto client = ctx->fd_;
+    if (client < 0 || static_cast<size_t>(client) >= owners_.size())
+        return;
+
+    auto loop = owners_[client].load(std::memory_order_acquire);
+    if (!loop)
+        return;
+
+    // published on the client's loop, which holds its relay as well
+    if (!loop->runInLoop([this, loop, client] { disconnectInLoop(*loop, client); }))
+    {
+#ifdef Debug
+        std::cout << "backend loop backlogged, leaving client fd: " << client << "\n";
 #endif
+    }
+}
 
-    for (auto & pair : *ctx->sock_to_backend_)
+void ProxyServer::disconnectInLoop(::reactor::Demultiplex & dmp, int client)
+{
+    auto & shard = shardOf(dmp);
+    shard.tried_.erase(client);
+    auto backend = shard.backendOf(client);
+    if (backend >= 0)
     {
-        int && sock          = -1;
-        int const & incoming = pair.first;
-        if (reversed_map_.find(incoming) == reversed_map_.end())
+        // the fd number is free for the next client from here on
+        dropBuffers(shard, client);
+        shard.pair(client, -1);
+    }
+    disown(shard, dmp, client);
+
+    if (backend >= 0)
+        detachInLoop(dmp, backend);
+}
+
+int ProxyServer::establishWith(::reactor::Demultiplex & dmp, ::reactor::InetAddr addr,
+        int incoming, bool shared)
+{
+    auto & shard = shardOf(dmp);
+    auto key = addr.toString();
+    UpstreamPool::Clock::time_point created;
+    auto sock = shard.upstream_.acquire(key, created);
+    auto connecting = sock < 0;
+    if (!connecting)
+    {
+#ifdef Debug
+        std::cout << "reuse parked connection with backend: " << sock << "\n";
+#endif
+    }
+    else
+    {
+        sock = reactor::StreamSocket::connectNonBlocking(addr);
+#ifdef Debug
+        std::cout << "connecting to backend: " << key << ", fd: " << sock << "\n";
+#endif
+        if (sock < 0)
         {
-            std::lock_guard<std::mutex> guard(mx_);
-            if (reversed_map_.find(incoming) == reversed_map_.end())
-            {
-                sock = establishWith(pair.second);
-                if (sock < 0)
-                    continue;
+            ::perror("connect(): ");
+            return sock;
+        }
 
-                sock_map_.emplace(sock, incoming);
-                reversed_map_.emplace(incoming, sock);
-                group_.registerFd(sock);
-            }
+        created = UpstreamPool::Clock::now();
+        // connectInLoop adds it to a served loop on its own
+        if (!shared)
+            group_.registerFd(sock, dmp, addr);
+    }
+
+    ::reactor::RateLimiter::Key client_key = 0;
+    if (limiter_)
+    {
+        // a served client's connection knows the peer
+        auto peer = shared && server_ ? server_->peerOf(incoming) : nullptr;
+        client_key = peer ? limiter_->keyOf(peer->sockAddr()) : limiter_->keyOf(incoming);
+    }
+    auto & relay = shard.relays_.emplace(sock, incoming, client_key, std::move(key), created);
+    relay.connecting_ = connecting;
+    relay.shared_loop_ = shared;
+    // 0 is the unknown key, never shaped
+    relay.class_key_ = std::hash<std::string>()(relay.backend_) | 1;
+    if (shaping_.client_rate_ > 0 && !(shaping_.kernel_pacing_
+                && reactor::StreamSocket::setPacingRate(incoming, shaping_.client_rate_)))
+        relay.pacer_ = ::reactor::Pacer(shaping_.client_rate_, shaping_.burst_);
+    shard.pair(incoming, sock);
+    if (static_cast<size_t>(incoming) < owners_.size())
+        owners_[incoming].store(&dmp, std::memory_order_release);
+
+    // posted, a failing connect would take the relay from under our caller
+    if (connecting)
+    {
+        auto loop = &dmp;
+        if (!loop->post([this, loop, sock] { connectInLoop(*loop, sock); }))
+        {
+#ifdef Debug
+            std::cout << "backend loop backlogged, no timeout for fd: " << sock << "\n";
+#endif
         }
-        sock = reversed_map_.at(incoming);
+    }
 
-        auto && addr        = reactor::StreamSocket::getPeerAddr(pair.first);
-        auto && addr_str = addr.toString();
+    return sock;
+}
 
-        // TODO: make strategy to prevent large traffic incoming
-        // for specified client, like closing conection or limitting traffic
-        if (center_->isLismited(addr_str))
+void ProxyServer::startSession(::reactor::Demultiplex & dmp, int client,
+        std::vector<std::string> excluded)
+{
+    ::reactor::InetAddr addr;
+    uint32_t id = 0;
+    // the client's ip, so it comes back to the same backend
+    uint64_t key = 0;
+    if (balancer_->hashing())
+    {
+        auto peer = server_ ? server_->peerOf(client) : nullptr;
+        key = peer ? LoadBalancer::keyOf(*peer) : LoadBalancer::keyOf(client);
+    }
+    auto & shard = shardOf(dmp);
+    while (excluded.size() < MAX_CONNECT_ATTEMPTS
+            && balancer_->pick(addr, excluded, &id, key))
+    {
+        auto backend = establishWith(dmp, addr, client, true);
+        if (backend < 0)
+        {
+            excluded.push_back(addr.toString());
+            shard.tried_[client] = excluded;
+            balancer_->release(id);
             continue;
+        }
+
+        auto & relay = *shard.relays_.find(backend);
+        relay.counted_ = true;
+        relay.backend_id_ = id;
+        // a parked connection takes the request right away, a new one
+        // once its handshake is done
+        if (!relay.connecting_)
+            forwardUp(dmp, relay, backend);
+        return;
+    }
+
+#ifdef Debug
+    std::cout << "no backend for fd: " << client << "\n";
+#endif
+    shard.tried_.erase(client);
+    ::shutdown(client, SHUT_RDWR);
+}
+
+void ProxyServer::measure(Relay & relay, bool up, ssize_t moved)
+{
+    if (!relay.counted_ || moved <= 0)
+        return;
+
+    // the first bytes of a request start the clock, the first of the answer stop it
+    auto unset = relay.asked_ == UpstreamPool::Clock::time_point();
+    if (up && unset)
+        relay.asked_ = UpstreamPool::Clock::now();
+    else if (!up && !unset)
+    {
+        balancer_->observe(relay.backend_id_, UpstreamPool::Clock::now() - relay.asked_);
+        relay.asked_ = UpstreamPool::Clock::time_point();
+    }
+}
+
+bool ProxyServer::forwardUp(::reactor::Demultiplex & dmp, Relay & relay, int backend)
+{
+    relay.up_deferred_ = false;
+    if (throttled(dmp, relay, backend))
+        return true;
 
 #ifdef MSG_ATTACH
-        std::string && ip   = addr.ip();
-        std::string && port = addr.port();
-        std::copy(ip.begin(), ip.end(), packet->ip_);
-        std::copy(port.begin(), port.end(), packet->port_);
-        auto total = forward(incoming, sock, packet);
-        // accounting traffic
-        if (total > 0)
-            center_->account(addr_str, total);
+    // a limited client is read a burst at a time, its budget is checked
+    // in between
+    bool more = false;
+    auto total = forward(shardOf(dmp), relay.client_, backend, budgetOf(dmp, limiter_
+                && limiter_->options().bytes_per_sec_ > 0
+                ? limiter_->options().byte_burst_ : 0), more);
+    charge(relay, total);
+    measure(relay, true, total);
+    // the client may be watched on another loop, the backend is ours
+    relay.up_deferred_ = more;
+    if (more)
+        dmp.defer(backend);
 #else
-        auto bytes = zeroCopy(incoming, sock);
-        if (bytes > 0)
-            center_->account(addr_str, bytes);
+    if (dmp.backend() == ::reactor::Demultiplex::URING)
+        spliceInLoop(dmp, relay.client_, backend, relay.up_);
+    else
+        return relayUp(dmp, relay, backend);
+#endif
+
+    return true;
+}
+
+bool ProxyServer::throttled(::reactor::Demultiplex & dmp, Relay & relay, int backend)
+{
+    if (!limiter_)
+        return false;
+    // still paused, the timer reads it
+    if (relay.resume_)
+        return true;
+
+    auto wait = limiter_->wait(relay.client_key_);
+    if (wait.count() == 0)
+        return false;
+
+    if (limiter_->options().over_limit_ == ::reactor::RateLimitOptions::REJECT)
+    {
+#ifdef Debug
+        std::cout << "client over its rate, fd: " << relay.client_ << "\n";
 #endif
+        ::shutdown(relay.client_, SHUT_RDWR);
+        return true;
     }
+
+    // edge-triggered, what the client sends meanwhile waits in its socket
+    resumeAfter(dmp, relay, backend, roundUp(wait));
+
+    return true;
 }
 
-int ProxyServer::establishWith(::reactor::InetAddr addr)
+void ProxyServer::resumeAfter(::reactor::Demultiplex & dmp, Relay & relay, int backend,
+        std::chrono::milliseconds delay, bool up)
 {
-    auto sock = reactor::StreamSocket::connectTo(addr);
-    std::cout << "establish new connection with backend: " << sock << "\n";
-    reactor::StreamSocket::setNonBlocking(sock);
-    group_.registerFd(sock);
+    // unlink() cancels it, the relay is there when it runs
+    auto id = dmp.runAfter(delay, [this, &dmp, backend, up] {
+        auto relay = shardOf(dmp).relays_.find(backend);
+        if (!relay)
+            return;
 
-    return sock;
+        if (up)
+        {
+            relay->resume_ = 0;
+            forwardUp(dmp, *relay, backend);
+        }
+        else
+        {
+            relay->pace_ = 0;
+            forwardDown(dmp, *relay, backend);
+        }
+    });
+    (up ? relay.resume_ : relay.pace_) = id;
+}
+
+void ProxyServer::charge(Relay const & relay, ssize_t moved)
+{
+    if (limiter_ && moved > 0)
+        limiter_->charge(relay.client_key_, static_cast<size_t>(moved));
 }
 
-ssize_t ProxyServer::zeroCopy(int in_fd, int out_fd)
+void ProxyServer::forwardDown(::reactor::Demultiplex & dmp, Relay & relay, int backend)
 {
-    auto len = ::splice(in_fd, nullptr, pipe_[1], nullptr, INT_MAX, SPLICE_F_MOVE);
-    if (len < 0)
+    if (paced(dmp, relay, backend))
+        return;
+
+#ifdef MSG_ATTACH
+    bool more = false;
+    auto total = forward(shardOf(dmp), backend, relay.client_,
+            budgetOf(dmp, shaped(relay) ? shaping_.burst_ : 0), more);
+    measure(relay, false, total);
+    shape(relay, total);
+    // closeOrDrain() left a hung up backend to us, it is read until
+    // nothing comes any more
+    relay.down_deferred_ = more || (total > 0 && relay.draining_);
+    if (relay.down_deferred_)
+        dmp.defer(backend);
+    else if (total <= 0 && relay.draining_)
+        closeInLoop(dmp, backend);
+#else
+    if (dmp.backend() == ::reactor::Demultiplex::URING)
+        spliceInLoop(dmp, backend, relay.client_, relay.down_);
+    else
+        relayDown(dmp, relay, backend);
+#endif
+}
+
+bool ProxyServer::paced(::reactor::Demultiplex & dmp, Relay & relay, int backend)
+{
+    // still paused, the timer writes it
+    if (relay.pace_)
+        return true;
+    if (!shaped(relay))
+        return false;
+
+    std::chrono::nanoseconds wait(0);
+    if (relay.pacer_.enabled())
+        wait = relay.pacer_.wait(::reactor::Pacer::Clock::now());
+    if (backend_shaper_)
+        wait = std::max(wait, backend_shaper_->wait(relay.class_key_));
+    if (wait.count() == 0)
+        return false;
+
+    // the backend is not read meanwhile, its window closes and it waits
+    resumeAfter(dmp, relay, backend, roundUp(wait), false);
+
+    return true;
+}
+
+bool ProxyServer::shaped(Relay const & relay) const noexcept
+{
+    return relay.pacer_.enabled() || backend_shaper_;
+}
+
+void ProxyServer::shape(Relay & relay, ssize_t moved)
+{
+    if (moved <= 0)
+        return;
+
+    if (relay.pacer_.enabled())
+        relay.pacer_.charge(static_cast<size_t>(moved), ::reactor::Pacer::Clock::now());
+    if (backend_shaper_)
+        backend_shaper_->charge(relay.class_key_, static_cast<size_t>(moved));
+}
+
+void ProxyServer::connectInLoop(::reactor::Demultiplex & dmp, int backend)
+{
+    auto relay = shardOf(dmp).relays_.find(backend);
+    if (!relay || !relay->connecting_)
+        return;
+
+    std::chrono::milliseconds timeout(CONNECT_TIMEOUT_MS);
+    auto timeouts = std::atomic_load(&connect_timeouts_);
+    auto custom = timeouts->find(relay->backend_);
+    if (custom != timeouts->end())
+        timeout = custom->second;
+
+    if (dmp.demultiplexWatch(backend,
+                ::reactor::Demultiplex::DefaultEvents | ::reactor::Demultiplex::WRITABLE) < 0)
+    {
+        connectFailed(dmp, backend, errno);
+        return;
+    }
+    // the relay only leaves on this thread, which cancels the timer then
+    relay->timer_ = dmp.runAfter(timeout, [this, &dmp, backend] {
+        connectFailed(dmp, backend, ETIMEDOUT);
+    });
+}
+
+void ProxyServer::finishConnect(::reactor::Demultiplex & dmp, Relay & relay, int backend,
+        uint32_t events)
+{
+    if (!(events & (::reactor::Demultiplex::WRITABLE | ::reactor::Demultiplex::CLOSABLE)))
+        return;
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (::getsockopt(backend, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        err = errno;
+    else if (err == 0 && (events & (EPOLLHUP | EPOLLRDHUP)))
+        err = ECONNRESET;
+    if (err != 0)
+    {
+        connectFailed(dmp, backend, err);
+        return;
+    }
+
+    if (relay.timer_)
+        dmp.cancel(relay.timer_);
+    relay.timer_ = 0;
+    relay.connecting_ = false;
+    shardOf(dmp).tried_.erase(relay.client_);
+#ifdef Debug
+    std::cout << "connected to backend: " << relay.backend_ << ", fd: " << backend << "\n";
+#endif
+
+    ::reactor::context::DmpModifyContext mod_ctx(::pubsub::DMPMODIFY);
+    mod_ctx.fd_ = backend;
+    mod_ctx.events_ = ::reactor::Demultiplex::DefaultEvents;
+    dmp.demultiplexModify(mod_ctx);
+
+#ifdef MSG_ATTACH
+    // io_uring reads the backend into its own buffers and sends from them
+    if (dmp.backend() == ::reactor::Demultiplex::URING)
+        dmp.recvMultishot(backend);
+#endif
+    forwardUp(dmp, relay, backend);
+}
+
+void ProxyServer::connectFailed(::reactor::Demultiplex & dmp, int backend, int err)
+{
+    int client = -1;
+    bool shared = false;
+    bool counted = false;
+    uint32_t id = 0;
+    std::vector<std::string> excluded;
+    {
+        auto & shard = shardOf(dmp);
+        auto relay = shard.relays_.find(backend);
+        if (!relay || !relay->connecting_)
+            return;
+
+#ifdef Debug
+        std::cout << "connect to backend " << relay->backend_
+                  << " failed: " << ::strerror(err) << "\n";
+#endif
+        client = relay->client_;
+        shared = relay->shared_loop_;
+        counted = relay->counted_;
+        id = relay->backend_id_;
+        auto & tried = shard.tried_[client];
+        tried.push_back(relay->backend_);
+        if (tried.size() < MAX_CONNECT_ATTEMPTS)
+            excluded = tried;
+        else
+            shard.tried_.erase(client);
+    }
+
+    // also cancels the timeout and forgets the pair. a client being
+    // retried stays with this loop, which knows what it tried
+    closeInLoop(dmp, backend);
+    // before the next pick, which should not get the backend again
+    if (counted)
+        balancer_->report(id, OutlierDetector::CONNECT_ERROR);
+
+    if (excluded.empty())
     {
-        ::perror("splice(): ");
-        return len;
+#ifdef Debug
+        std::cout << "no backend reachable for fd: " << client << "\n";
+#endif
+        ::shutdown(client, SHUT_RDWR);
+        return;
     }
-    if (len == 0)
-        return len;
-    
-    ssize_t slen    = 0;
-    ssize_t total   = 0;
-    while (len > 0)
+
+    // the next backend is picked right here for a session of ours
+    if (shared)
     {
-        slen = ::splice(pipe_[0], nullptr, out_fd, nullptr, len, SPLICE_F_MORE | SPLICE_F_MOVE);
-        if (slen < 0)
+        startSession(dmp, client, std::move(excluded));
+        return;
+    }
+
+    auto lb_ctx = std::make_shared<context::LoadBalanceCtx>(::pubsub::BALANCE);
+    lb_ctx->sockes_.push_back(client);
+    lb_ctx->excluded_ = std::move(excluded);
+    notify(::pubsub::BALANCE, std::move(lb_ctx));
+}
+
+ProxyServer::RelayT ProxyServer::spliceThrough(int in_fd, int out_fd,
+        ::reactor::Pipe & pipe, size_t & moved,
+        ::reactor::Demultiplex::ReadBudget const & budget)
+{
+    moved = 0;
+    size_t taken = 0;
+    size_t reads = 0;
+    // SPLICE_F_MORE corks the tail of a burst for up to 200ms, only
+    // worth it while in_fd fills the pipe
+    unsigned int more = 0;
+    for (;;)
+    {
+        while (pipe.pending_ > 0)
         {
-            ::perror("splice() to out_fd:");
-            break;
+            auto len = ::splice(pipe.r_, nullptr, out_fd, nullptr, pipe.pending_,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK | more);
+            if (len > 0)
+            {
+                pipe.pending_ -= len;
+                moved += len;
+            }
+            else if (len == -1 && errno == EINTR)
+                continue;
+            else if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return RELAY_STALLED;
+            else
+            {
+                ::perror("splice() to out_fd: ");
+                return RELAY_ERROR;
+            }
+        }
+
+        if (taken >= budget.bytes_ || reads >= budget.reads_)
+            return RELAY_LIMITED;
+
+        size_t want = pipe.size_ > 0 ? pipe.size_ : SPLICE_SIZE;
+        want = std::min(want, budget.bytes_ - taken);
+        reads++;
+        auto len = ::splice(in_fd, nullptr, pipe.w_, nullptr, want,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (len > 0)
+        {
+            pipe.pending_ += len;
+            taken += len;
+            more = static_cast<size_t>(len) == want ? SPLICE_F_MORE : 0;
+        }
+        else if (len == 0)
+            return RELAY_EOF;
+        else if (errno == EINTR)
+            continue;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return RELAY_AGAIN;
+        else
+        {
+            ::perror("splice() from in_fd: ");
+            return RELAY_ERROR;
         }
+    }
+}
 
-        len -= slen;
-        total += slen;
+bool ProxyServer::relayUp(::reactor::Demultiplex & dmp, Relay & relay, int backend)
+{
+    if (!relay.up_.valid() && !pipes_.acquire(relay.up_))
+    {
+        ::perror("pipe for client: ");
+        return true;
     }
 
-    // if (len != 0)
-    //     throw std::runtime_error("missing data for splice()");
+    // a limited client is read a burst at a time, its budget is checked
+    // in between
+    size_t moved = 0;
+    auto state = spliceThrough(relay.client_, backend, relay.up_, moved,
+            budgetOf(dmp, limiter_ && limiter_->options().bytes_per_sec_ > 0
+                ? limiter_->options().byte_burst_ : 0));
+    charge(relay, moved);
+    measure(relay, true, moved);
 
-    return total;
+    if (state == RELAY_ERROR)
+    {
+        closeInLoop(dmp, backend);
+        return false;
+    }
+    // the socket was not read dry, no edge comes for the rest. the
+    // client may be watched on another loop, the backend is ours
+    relay.up_deferred_ = state == RELAY_LIMITED;
+    if (relay.up_deferred_)
+        dmp.defer(backend);
+
+    // ask for WRITABLE on the backend only while it holds the client up
+    bool stalled = state == RELAY_STALLED;
+    if (stalled != relay.up_stalled_)
+    {
+        ::reactor::context::DmpModifyContext mod_ctx(::pubsub::DMPMODIFY);
+        mod_ctx.fd_ = backend;
+        mod_ctx.events_ = ::reactor::Demultiplex::DefaultEvents
+                | (stalled ? ::reactor::Demultiplex::WRITABLE : 0);
+        if (dmp.demultiplexModify(mod_ctx) == 0)
+            relay.up_stalled_ = stalled;
+    }
+
+    return true;
 }
 
-ssize_t ProxyServer::forward(int in_fd, int out_fd, Packet * packet)
+bool ProxyServer::relayDown(::reactor::Demultiplex & dmp, Relay & relay, int backend)
 {
-#ifdef MSG_ATTACH
-    ::memset(packet, 0, sizeof(*packet));
-#endif
-    // read from incoming request
-    auto recved = ::read(in_fd, packet->segment_, packet->MAX_PACKET_SIZE);
-    std::cout << "[forward] recv from: " << in_fd
-              << ", len: " << recved << "\n";
-    if (recved == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
-        return recved;
+    if (!relay.down_.valid() && !pipes_.acquire(relay.down_))
+    {
+        ::perror("pipe for backend: ");
+        return true;
+    }
 
-    ssize_t total = 0;
-    // TODO: send() with MSG_ZEROCOPY Suitable for data less than about 10KB
-    if (recved > SEND_PROPER_SIZE)
+    // a shaped backend is read a burst at a time, as relayUp() does
+    size_t moved = 0;
+    auto state = spliceThrough(backend, relay.client_, relay.down_, moved,
+            budgetOf(dmp, shaped(relay) ? shaping_.burst_ : 0));
+    measure(relay, false, moved);
+    shape(relay, moved);
+    if (state == RELAY_ERROR || (relay.draining_ && relay.down_.pending_ == 0
+                && state != RELAY_LIMITED))
+    {
+        closeInLoop(dmp, backend);
+        return false;
+    }
+    relay.down_deferred_ = state == RELAY_LIMITED;
+    if (relay.down_deferred_)
+        dmp.defer(backend);
+
+    // a client on its own loop keeps the edge-triggered watch, a shared
+    // one has its registration switched back once drained
+    if (state == RELAY_STALLED)
+        watchClient(dmp, relay, true);
+    else if (relay.shared_loop_)
+        watchClient(dmp, relay, false);
+
+    return true;
+}
+
+void ProxyServer::watchClient(::reactor::Demultiplex & dmp, Relay & relay, bool writable)
+{
+    if (writable == relay.client_watched_)
+        return;
+
+    int ret = 0;
+    if (relay.shared_loop_)
     {
+        // the server's registration, reading has to stay in
+        ::reactor::context::DmpModifyContext mod_ctx(::pubsub::DMPMODIFY);
+        mod_ctx.fd_ = relay.client_;
+        mod_ctx.events_ = ::reactor::Demultiplex::DefaultEvents
+                | (writable ? ::reactor::Demultiplex::WRITABLE : 0);
+        ret = dmp.demultiplexModify(mod_ctx);
     }
-    // else
+    else if (writable)
+        ret = dmp.demultiplexWatch(relay.client_, ::reactor::Demultiplex::WRITABLE | EPOLLET);
+    else
+    {
+        ::reactor::context::DmpDeleteContext del_ctx(::pubsub::DMPDELETE);
+        del_ctx.fd_ = relay.client_;
+        ret = dmp.demultiplexRemove(del_ctx);
+    }
+
+    if (ret == 0)
+        relay.client_watched_ = writable;
+    else
+        ::perror("watch client: ");
+}
+
+ssize_t ProxyServer::forward(Shard & shard, int in_fd, int out_fd,
+        ::reactor::Demultiplex::ReadBudget const & budget, bool & more)
+{
+    auto & chain = shard.pending_.emplace(out_fd);
+    // MSG_ZEROCOPY from SEND_PROPER_SIZE up, the blocks are held until
+    // the kernel reports them sent
+    auto & sender = shard.senders_.emplace(out_fd, out_fd, SEND_PROPER_SIZE);
+
+    more = false;
+    ssize_t total = 0;
+    size_t taken = 0;
+    for (size_t reads = 0; ; reads++)
     {
-        // re-packing the received data packeta with specified format
-        packet->length_ = recved;
-        ssize_t sent    = 0;
-        // BUG: the exactly size for Packet maybe more than
-        // the socket buffer size
-        while (true)
+        // edge-triggered, in_fd is read until it runs dry
+        if (reads >= budget.reads_ || taken >= budget.bytes_)
         {
-#ifdef MSG_ATTACH
-            sent = ::send(out_fd, packet->segment_ + total, packet->length_ - total, MSG_ZEROCOPY);
+            more = true;
+            break;
+        }
+
+        // read from incoming request, the blocks are handed on as they are
+        auto recved = chain.readFd(in_fd);
+#ifdef Debug
+        std::cout << "[forward] recv from: " << in_fd
+                  << ", len: " << recved << "\n";
 #endif
-            if (sent == -1)
+        if (recved == -1 && errno == EINTR)
+            continue;
+        if (recved > 0)
+            taken += recved;
+
+        while (!chain.empty())
+        {
+            auto sent = sender.send(chain, MSG_NOSIGNAL);
+            if (sent <= 0)
             {
-                ::perror("send() with MSG_ZEROCOPY: ");
+                if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+                    ::perror("send(): ");
                 break;
             }
 
             total += sent;
-            if (total == recved)
-                break;
         }
-        std::cout << "[forward] sent to: " << out_fd
-                  << ", len: " << sent << "\n";
+
+        // out_fd is full, or in_fd ran dry or hung up
+        if (recved <= 0 || !chain.empty())
+            break;
     }
-    
+    // what out_fd could not take stays queued until the next round
+#ifdef Debug
+    std::cout << "[forward] sent to: " << out_fd
+              << ", len: " << total
+              << ", queued: " << chain.readableBytes() << "\n";
+#endif
+
     return total;
 }
 
+::reactor::Demultiplex::ReadBudget ProxyServer::budgetOf(::reactor::Demultiplex const & dmp,
+        uint64_t burst)
+{
+    auto budget = dmp.readBudget();
+    if (burst > 0)
+        budget.bytes_ = std::min<size_t>(budget.bytes_, burst);
+
+    return budget;
+}
+
+ProxyServer::Shard & ProxyServer::shardOf(::reactor::Demultiplex & dmp)
+{
+    return *shards_.at(&dmp);
+}
+
+void ProxyServer::disown(Shard & shard, ::reactor::Demultiplex & dmp, int client)
+{
+    if (client < 0 || static_cast<size_t>(client) >= owners_.size()
+            || shard.tried_.count(client))
+        return;
+
+    // unless a FORWARD round handed it elsewhere meanwhile
+    auto loop = &dmp;
+    owners_[client].compare_exchange_strong(loop, nullptr, std::memory_order_acq_rel);
+}
+
+bool ProxyServer::reapCompletions(Shard & shard, int fd)
+{
+    auto sender = shard.senders_.find(fd);
+    if (!sender)
+        return true;
+
+    return sender->reap() >= 0;
+}
+
+void ProxyServer::dropBuffers(Shard & shard, int fd)
+{
+    shard.pending_.erase(fd);
+
+    auto sender = shard.senders_.find(fd);
+    if (!sender)
+        return;
+
+    sender->reap();
+    shard.senders_.erase(fd);
+}
+
+void ProxyServer::spliceInLoop(::reactor::Demultiplex & dmp, int in_fd, int out_fd,
+        ::reactor::Pipe & pipe)
+{
+    if (!pipe.valid() && !pipes_.acquire(pipe))
+    {
+        ::perror("pipe for splice: ");
+        return;
+    }
+
+    // EBUSY: the splice in flight picks the new data up
+    if (dmp.spliceLinked(in_fd, out_fd, pipe.r_, pipe.w_, SPLICE_SIZE) < 0
+            && errno != EBUSY)
+        ::perror("linked splice: ");
+}
+
+void ProxyServer::closeOrDrain(::reactor::Demultiplex & dmp, Relay & relay,
+        int backend, uint32_t events)
+{
+    if (events & EPOLLERR)
+    {
+        // reset, or gone without a FIN
+        if (relay.counted_)
+            balancer_->report(relay.backend_id_, OutlierDetector::RESET);
+        closeInLoop(dmp, backend);
+        return;
+    }
+
+#ifndef MSG_ATTACH
+    // on io_uring the chain runs until it reaches the EOF itself
+    if (dmp.backend() == ::reactor::Demultiplex::URING)
+    {
+        if (events & ::reactor::Demultiplex::SPLICED)
+            closeInLoop(dmp, backend);
+        else
+        {
+            relay.draining_ = true;
+            // a paused chain is started again by its timer
+            if (!relay.pace_)
+                spliceInLoop(dmp, backend, relay.client_, relay.down_);
+        }
+        return;
+    }
+#else
+    // the hangup may come with the last bytes, the backend is read to
+    // its end first
+    if (dmp.backend() == ::reactor::Demultiplex::EPOLL)
+    {
+        relay.draining_ = true;
+        if (!relay.pace_)
+            forwardDown(dmp, relay, backend);
+        return;
+    }
+#endif
+
+    // paused or deferred, the backend may not have been read to its end yet
+    if (relay.down_.pending_ > 0 || relay.pace_ || relay.down_deferred_)
+        relay.draining_ = true;
+    else
+        closeInLoop(dmp, backend);
+}
+
+void ProxyServer::closeInLoop(::reactor::Demultiplex & dmp, int fd)
+{
+    // io_uring keeps the socket alive while requests on it are armed
+    ::reactor::context::DmpDeleteContext del_ctx(::pubsub::DMPDELETE);
+    del_ctx.fd_ = fd;
+    dmp.demultiplexRemove(del_ctx);
+
+    auto & shard = shardOf(dmp);
+    // completions are read from the socket, so before it goes
+    dropBuffers(shard, fd);
+    ::close(fd);
+
+    if (!shard.relays_.find(fd))
+        return;
+
+    unlink(dmp, shard, fd);
+#ifdef Debug
+    std::cout << "remove backend fd: " << fd << "\n";
+#endif
+}
+
+void ProxyServer::detachInLoop(::reactor::Demultiplex & dmp, int backend)
+{
+    auto & shard = shardOf(dmp);
+    auto relay = shard.relays_.find(backend);
+    if (!relay)
+        return;
+
+    if (parkable(dmp, shard, *relay, backend))
+    {
+        auto key = relay->backend_;
+        auto created = relay->created_;
+        unlink(dmp, shard, backend);
+        dropBuffers(shard, backend);
+        if (shard.upstream_.release(key, backend, created))
+        {
+#ifdef Debug
+            std::cout << "park backend fd: " << backend << "\n";
+#endif
+            return;
+        }
+    }
+
+    closeInLoop(dmp, backend);
+}
+
+void ProxyServer::pruneEvery(::reactor::Demultiplex & dmp)
+{
+    std::chrono::milliseconds interval(PRUNE_INTERVAL_MS);
+    auto alive = alive_;
+    auto posted = dmp.runInLoop([this, &dmp, alive, interval] {
+        // the lock is alive's own, our destructor waits for whoever holds it
+        std::lock_guard<std::mutex> guard(alive->mx_);
+        if (!alive->alive_)
+            return;
+
+        auto id = std::make_shared<::reactor::Demultiplex::TimerId>(0);
+        *id = dmp.runEvery(interval, [this, &dmp, alive, id] {
+            std::lock_guard<std::mutex> guard(alive->mx_);
+            if (!alive->alive_)
+            {
+                dmp.cancel(*id);
+                return;
+            }
+
+            auto count = shardOf(dmp).upstream_.prune(UpstreamPool::Clock::now());
+#ifdef Debug
+            if (count > 0)
+                std::cout << "closed idle backend connections: " << count << "\n";
+#else
+            (void)count;
+#endif
+        });
+        shardOf(dmp).prune_ = *id;
+    });
+    if (!posted)
+    {
+#ifdef Debug
+        std::cout << "loop backlogged, parked connections expire when used\n";
+#endif
+    }
+}
+
+void ProxyServer::teardown(std::vector<std::shared_ptr<::reactor::Demultiplex>> const & loops,
+        bool running)
+{
+    std::vector<std::future<void>> done;
+    for (auto & dmp : loops)
+    {
+        auto loop = dmp.get();
+        // nothing dispatches on a server's loop that never ran
+        if (!running && !loop->started())
+        {
+            teardownInLoop(*loop);
+            continue;
+        }
+
+        auto task = std::make_shared<std::packaged_task<void()>>([this, loop] {
+            teardownInLoop(*loop);
+        });
+        done.push_back(task->get_future());
+        // only a full queue refuses, the loop is draining it
+        while (!loop->runInLoop([task] { (*task)(); }))
+            std::this_thread::yield();
+    }
+
+    for (auto & one : done)
+        one.wait();
+}
+
+void ProxyServer::teardownInLoop(::reactor::Demultiplex & dmp)
+{
+    auto & shard = shardOf(dmp);
+    if (shard.prune_)
+        dmp.cancel(shard.prune_);
+
+    std::vector<int> backends;
+    shard.relays_.forEach([&backends](int backend, Relay &) { backends.push_back(backend); });
+    // closing unlinks the pair, which cancels its timers and returns its pipes
+    for (auto backend : backends)
+    {
+        auto relay = shard.relays_.find(backend);
+        if (!relay)
+            continue;
+
+        auto client = relay->client_;
+        auto paired = shard.backendOf(client) == backend;
+        closeInLoop(dmp, backend);
+        // its server closes the client then
+        if (paired)
+            ::shutdown(client, SHUT_RDWR);
+    }
+
+    dmp.handlers<::reactor::context::DmpWaitContext>().detach(this);
+}
+
+bool ProxyServer::parkable(::reactor::Demultiplex & dmp, Shard & shard, Relay const & relay,
+        int backend)
+{
+    // io_uring keeps requests armed on the socket, those are not reused.
+    // a request with no answer yet means the backend is not idle, the
+    // rest of an answer cannot be seen from here, hence Options::reuse_
+    if (!upstream_options_.reuse_ || dmp.backend() != ::reactor::Demultiplex::EPOLL
+            || relay.asked_ != UpstreamPool::Clock::time_point()
+            || relay.connecting_ || relay.draining_ || relay.up_stalled_
+            || relay.up_deferred_ || relay.down_deferred_
+            || relay.up_.pending_ > 0 || relay.down_.pending_ > 0)
+        return false;
+
+    auto chain = shard.pending_.find(backend);
+    if (chain && !chain->empty())
+        return false;
+
+    auto sender = shard.senders_.find(backend);
+    return !sender || (sender->reap() >= 0 && sender->inFlight() == 0);
+}
+
+void ProxyServer::unlink(::reactor::Demultiplex & dmp, Shard & shard, int backend)
+{
+    auto & relay = *shard.relays_.find(backend);
+    auto uring = dmp.backend() == ::reactor::Demultiplex::URING;
+    if (relay.timer_)
+        dmp.cancel(relay.timer_);
+    if (relay.resume_)
+        dmp.cancel(relay.resume_);
+    if (relay.pace_)
+        dmp.cancel(relay.pace_);
+    if (relay.counted_)
+        balancer_->release(relay.backend_id_);
+    // the client stays with its own loop, only our watch on it goes
+    if (relay.shared_loop_)
+    {
+        // unless the server closed the client already
+        if (server_->ownerOf(relay.client_) == &dmp)
+            watchClient(dmp, relay, false);
+    }
+    else if (relay.client_watched_ || (uring && relay.up_.valid()))
+    {
+        ::reactor::context::DmpDeleteContext client_ctx(::pubsub::DMPDELETE);
+        client_ctx.fd_ = relay.client_;
+        dmp.demultiplexRemove(client_ctx);
+    }
+    // a cancelled io_uring splice may still write into its pipe
+    pipes_.release(relay.up_, !uring);
+    pipes_.release(relay.down_, !uring);
+
+    // a disconnected client's entry is gone, its fd may be someone else's
+    if (shard.backendOf(relay.client_) == backend)
+    {
+        dropBuffers(shard, relay.client_);
+        shard.pair(relay.client_, -1);
+        disown(shard, dmp, relay.client_);
+    }
+    shard.relays_.erase(backend);
+}
+
+UpstreamStats ProxyServer::upstreamStats()
+{
+    UpstreamStats stats;
+    for (auto & pair : shards_)
+        stats += pair.second->upstream_.stats();
+
+    return stats;
+}
+
 void ProxyServer::stop()
 {
     stop_.store(true, std::memory_order_release);
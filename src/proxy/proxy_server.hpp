@@ -2,30 +2,78 @@
 
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
+#include "chain_buffer.hpp"
+#include "zerocopy_sender.hpp"
+#include "dispatcher.hpp"
+#include "fd_table.hpp"
 #include "group.hpp"
 #include "nw_ctx.hpp"
-#include "packet.hpp"
+#include "pacer.hpp"
+#include "pipe_pool.hpp"
 #include "proxy_ctx.hpp"
 #include "pub_type.hpp"
 #include "publisher.hpp"
+#include "rate_limiter.hpp"
+#include "upstream_pool.hpp"
+
+namespace reactor {
+class TcpServer;
+} // namespace reactor
 
 namespace proxy {
 
+class LoadBalancer;
+
+// what is written to clients, paced down to a rate
+struct ShapingOptions
+{
+    ShapingOptions()
+        : client_rate_(0)
+        , backend_rate_(0)
+        , burst_(256 * 1024)
+        , kernel_pacing_(true)
+    {}
+
+    // bytes a second to one client, 0 leaves it alone
+    uint64_t    client_rate_;
+    // bytes a second to all the clients of one backend together
+    uint64_t    backend_rate_;
+    // written at once before the pacing sets in
+    uint64_t    burst_;
+    // client_rate_ is left to SO_MAX_PACING_RATE where the kernel has it
+    bool        kernel_pacing_;
+};
+
 class ProxyServer : public ::pubsub::Subscriber,
-                      public ::pubsub::Publisher
+                      public ::pubsub::Publisher,
+                      public ::pubsub::Handler<::reactor::context::DmpWaitContext>
 {
 public:
-    // for send() wtih MSG_ZEROCOPY option
+    // smaller sends are copied, MSG_ZEROCOPY only pays off above it
     constexpr static int const SEND_PROPER_SIZE = 10 * 1024;
+    // bytes asked for by one linked splice on io_uring
+    constexpr static size_t const SPLICE_SIZE = 64 * 1024;
+    // backends tried for one client before it is given up on
+    constexpr static size_t const MAX_CONNECT_ATTEMPTS = 3;
+    constexpr static std::chrono::milliseconds::rep const CONNECT_TIMEOUT_MS = 3000;
+    // how often parked connections past their timeouts are closed
+    constexpr static std::chrono::milliseconds::rep const PRUNE_INTERVAL_MS = 1000;
 
 public:
-    ProxyServer(int n_thread = 1);
+    ProxyServer(int n_thread = 1,
+            ::reactor::Demultiplex::Backend backend = ::reactor::Demultiplex::defaultBackend(),
+            UpstreamPool::Options const & upstream = UpstreamPool::Options());
     ProxyServer(const ProxyServer &) = delete;
     ProxyServer & operator=(const ProxyServer &) = delete;
     ProxyServer(ProxyServer &&) = delete;
@@ -42,56 +90,409 @@ public:
 
     virtual void update(std::shared_ptr<::pubsub::Context> ctx) override;
 
+    virtual void handle(::reactor::context::DmpWaitContext & ctx) override;
+
+    // connect timeout for backend [ip:port], CONNECT_TIMEOUT_MS otherwise.
+    // connections started afterwards take it
+    void setConnectTimeout(std::string const & backend, std::chrono::milliseconds timeout);
+
+    /**
+     * @brief proxy server's connections on its own loops. a client gets
+     * its backend from `balancer` once, at its first readable event, and
+     * the backend socket joins the client's loop. everything after that
+     * is forwarded right there, without BALANCE and FORWARD rounds.
+     * call it before server.start(). the server outlives us, with its
+     * loops running or never started: our destructor waits on them.
+     */
+    void serve(::reactor::TcpServer & server, LoadBalancer & balancer);
+
+    /**
+     * @brief limit the bytes read from every client by `limiter`'s
+     * budget, a client past it is paused or shut down as the limiter's
+     * options say. serve() takes the server's limiter unless one is set.
+     * call it before any client comes in.
+     */
+    void setRateLimiter(std::shared_ptr<::reactor::RateLimiter> limiter);
+
+    /**
+     * @brief pace what goes out to clients. a connection or backend past
+     * its rate is not read from until a loop timer finds it in budget
+     * again, so one large download does not hold up the rest of its
+     * loop. io_uring's multishot receive is only paced by the kernel.
+     * call it before any client comes in.
+     */
+    void setShaping(ShapingOptions const & options);
+
+    /**
+     * @brief what a relay reads from one side per event on our loops
+     * before the next one gets its turn. served loops keep the server's
+     * LoopOptions::read_budget_. call it before any client comes in.
+     */
+    void setReadBudget(::reactor::Demultiplex::ReadBudget const & budget);
+
 private:
-    void updateForWait(std::shared_ptr<::reactor::context::DmpWaitContext> ctx);
+    void updateForWait(::reactor::context::DmpWaitContext & ctx);
 
     /**
      * @brief if the cached connection establish with backend gather than
      * the incoming client. don't create new connection, otherwise
      * establish new connection and then assign to the rest
-     * incoming client.
+     * incoming client. each client is handed to the loop holding its
+     * relay, a new one to the next loop of ours.
      * 
      * @param ctx context that contain all data for forwarding request
      */
     void updateForForward(std::shared_ptr<context::ForwardContext> ctx);
 
+    // the client left, its backend is parked or closed on its own loop
+    void updateForDisconnect(std::shared_ptr<context::DisconnectContext> ctx);
+
+    // a FORWARDed client on the loop it was handed to
+    void forwardInLoop(::reactor::Demultiplex & dmp, int client,
+            ::reactor::InetAddr const & addr);
+
+    void disconnectInLoop(::reactor::Demultiplex & dmp, int client);
+
 private:
-    int establishWith(::reactor::InetAddr addr);
+    // how a relay round ended
+    enum RelayT
+    {
+        RELAY_AGAIN,        // in_fd has nothing more for now
+        RELAY_STALLED,      // out_fd is full, the rest waits in the pipe
+        RELAY_LIMITED,      // read up to the limit, in_fd may have more
+        RELAY_EOF,          // in_fd's peer closed
+        RELAY_ERROR
+    };
 
     /**
-     * @brief zero-copy to forward buffer in kernel space 
-     * forward data from back-end side to cient
-     * 
-     * @param in_fd     input fd
+     * @brief the session of one proxied client: its backend, chosen once,
+     * and the state of both directions. keyed by the backend fd in the
+     * Shard of the backend's loop, everything on it runs there.
+     */
+    struct Relay
+    {
+        Relay(int client, ::reactor::RateLimiter::Key client_key,
+                std::string backend, UpstreamPool::Clock::time_point created)
+            : client_(client)
+            , client_key_(client_key)
+            , class_key_(0)
+            , backend_(std::move(backend))
+            , created_(created)
+            , connecting_(false)
+            , shared_loop_(false)
+            , counted_(false)
+            , backend_id_(0)
+            , asked_()
+            , timer_(0)
+            , resume_(0)
+            , pacer_()
+            , pace_(0)
+            , up_()
+            , down_()
+            , up_stalled_(false)
+            , client_watched_(false)
+            , draining_(false)
+            , down_deferred_(false)
+            , up_deferred_(false)
+        {}
+
+        int                         client_;
+        ::reactor::RateLimiter::Key client_key_;        // what the client is limited by
+        ::reactor::RateLimiter::Key class_key_;         // what the backend is shaped by
+        std::string                 backend_;           // [ip:port], the upstream pool key
+        UpstreamPool::Clock::time_point created_;       // when the backend was connected
+        bool                        connecting_;        // handshake in flight
+        bool                        shared_loop_;       // the backend joined the client's loop
+        bool                        counted_;           // a session of balancer_'s backend_id_
+        uint32_t                    backend_id_;
+        UpstreamPool::Clock::time_point asked_;         // client bytes sent, no answer yet
+        ::reactor::Demultiplex::TimerId timer_;         // its connect timeout
+        ::reactor::Demultiplex::TimerId resume_;        // reads the client again once in budget
+        ::reactor::Pacer            pacer_;             // writes to the client, unless the kernel paces
+        ::reactor::Demultiplex::TimerId pace_;          // reads the backend again once in budget
+        ::reactor::Pipe             up_;                // client -> backend
+        ::reactor::Pipe             down_;              // backend -> client
+        bool                        up_stalled_;        // backend watched for WRITABLE
+        bool                        client_watched_;    // client watched for WRITABLE
+        bool                        draining_;          // backend gone, pipe still flushing
+        bool                        down_deferred_;     // backend left unread at its budget
+        bool                        up_deferred_;       // client left unread, the backend is deferred for it
+    };
+
+    struct Liveness
+    {
+        Liveness()
+            : mx_()
+            , alive_(true)
+        {}
+
+        std::mutex  mx_;
+        bool        alive_;     // cleared by our destructor, read under mx_
+    };
+
+    // one per loop, only that loop's thread touches it
+    struct Shard
+    {
+        explicit Shard(UpstreamPool::Options const & upstream)
+            : relays_()
+            , backends_(FdTable<Relay>::INITIAL_SLOTS, -1)
+            , pending_()
+            , senders_()
+            , upstream_(upstream)
+            , tried_()
+            , prune_(0)
+        {}
+
+        // client's backend on this loop, -1 if it has none
+        int backendOf(int client) const noexcept
+        {
+            if (client < 0 || static_cast<size_t>(client) >= backends_.size())
+                return -1;
+
+            return backends_[client];
+        }
+
+        void pair(int client, int backend)
+        {
+            if (static_cast<size_t>(client) >= backends_.size())
+                backends_.resize(std::max(static_cast<size_t>(client) + 1,
+                            backends_.size() * 2), -1);
+            backends_[client] = backend;
+        }
+
+        // keyed by the backend fd
+        FdTable<Relay>                      relays_;
+        // client fd -> its backend fd, -1 if none
+        std::vector<int>                    backends_;
+        // bytes waiting to be written, keyed by the fd they are written to
+        FdTable<reactor::ChainBuffer>       pending_;
+        // blocks the kernel still reads, keyed by the fd they were sent to
+        FdTable<reactor::ZeroCopySender>    senders_;
+        // idle backend connections registered with this loop
+        UpstreamPool                        upstream_;
+        // backends a client failed to connect to, until one succeeds
+        std::unordered_map<int,
+            std::vector<std::string>>       tried_;
+        // pruneEvery()'s timer on this loop
+        ::reactor::Demultiplex::TimerId     prune_;
+    };
+
+    // the loop's shard, there is one for each of ours and each served one
+    Shard & shardOf(::reactor::Demultiplex & dmp);
+
+    /**
+     * @brief the client's relay left dmp. unless it is still being
+     * retried, the client may be handed to any loop again.
+     */
+    void disown(Shard & shard, ::reactor::Demultiplex & dmp, int client);
+
+private:
+    /**
+     * @brief take a parked connection to addr from the pool of `dmp`,
+     * or start connecting and register the socket with it. the pair
+     * with `incoming` is recorded in its shard. `shared` when the client
+     * is one of dmp's own, served connections. loop thread of dmp only.
+     */
+    int establishWith(::reactor::Demultiplex & dmp, ::reactor::InetAddr addr,
+            int incoming, bool shared);
+
+    /**
+     * @brief first readable event of a served client: pick its backend,
+     * skipping `excluded`, and connect on the client's loop.
+     */
+    void startSession(::reactor::Demultiplex & dmp, int client,
+            std::vector<std::string> excluded = std::vector<std::string>());
+
+    // latency from the client's bytes to the backend's answer, for the balancer
+    void measure(Relay & relay, bool up, ssize_t moved);
+
+    /**
+     * @brief client -> backend on the relay's loop, however the build
+     * moves data. a client left unread at its budget has the backend
+     * deferred in its place, the client may not be registered here.
+     * @return false if the relay is gone
+     */
+    bool forwardUp(::reactor::Demultiplex & dmp, Relay & relay, int backend);
+
+    /**
+     * @brief true if the client is over its byte budget and not read now.
+     * paused, it is read again by a timer once back in budget, rejected
+     * it is shut down. loop thread of the relay only.
+     */
+    bool throttled(::reactor::Demultiplex & dmp, Relay & relay, int backend);
+
+    // forwardUp(), or forwardDown(), the relay again after delay unless
+    // it is gone by then
+    void resumeAfter(::reactor::Demultiplex & dmp, Relay & relay, int backend,
+            std::chrono::milliseconds delay, bool up = true);
+
+    // what the client sent counts against its budget
+    void charge(Relay const & relay, ssize_t moved);
+
+    // backend -> client on the relay's loop, paced by setShaping()
+    void forwardDown(::reactor::Demultiplex & dmp, Relay & relay, int backend);
+
+    // throttled() for writes to the client. paused, the timer calls forwardDown()
+    bool paced(::reactor::Demultiplex & dmp, Relay & relay, int backend);
+
+    // paced in userspace, by the client's rate or its backend's
+    bool shaped(Relay const & relay) const noexcept;
+
+    // what reached the client counts against the rates
+    void shape(Relay & relay, ssize_t moved);
+
+    // watch the handshake of backend and arm its connect timeout
+    void connectInLoop(::reactor::Demultiplex & dmp, int backend);
+
+    /**
+     * @brief the handshake of backend finished one way or the other.
+     * what the client sent meanwhile waited in its socket and is
+     * forwarded now.
+     */
+    void finishConnect(::reactor::Demultiplex & dmp, Relay & relay, int backend,
+            uint32_t events);
+
+    /**
+     * @brief drop the backend and hand the client back to the balancer,
+     * published as BALANCE, to pick another one. MAX_CONNECT_ATTEMPTS
+     * backends are tried in all, then the client is shut down.
+     */
+    void connectFailed(::reactor::Demultiplex & dmp, int backend, int err);
+
+    /**
+     * @brief move in_fd -> pipe -> out_fd in kernel space until in_fd
+     * runs dry, out_fd is full or the budget is used up. bytes out_fd
+     * did not take stay in the pipe and go first next round, in_fd is
+     * not read while they wait.
+     *
+     * @param moved     bytes that reached out_fd
+     * @param budget    what is read from in_fd at most
+     */
+    RelayT spliceThrough(int in_fd, int out_fd, ::reactor::Pipe & pipe, size_t & moved,
+            ::reactor::Demultiplex::ReadBudget const & budget);
+
+    // client -> backend on the backend's loop. false once the pair is closed
+    bool relayUp(::reactor::Demultiplex & dmp, Relay & relay, int backend);
+
+    bool relayDown(::reactor::Demultiplex & dmp, Relay & relay, int backend);
+
+    // report WRITABLE of the client to this loop, or stop it
+    void watchClient(::reactor::Demultiplex & dmp, Relay & relay, bool writable);
+
+    /**
+     * @brief buffered forwarding. data is read into refcounted blocks
+     * and written to out_fd from the same blocks, the part out_fd can
+     * not take yet stays queued for it.
+     *
+     * @param in_fd     input fd, read until it runs dry or out_fd fills
      * @param out_fd    output fd
+     * @param budget    what is read from in_fd at most
+     * @param more      set if the budget ran out first, in_fd is not
+     *                  reported again for the rest
      * @return ssize_t  transferred size
      */
-    ssize_t zeroCopy(int in_fd, int out_fd);
+    ssize_t forward(Shard & shard, int in_fd, int out_fd,
+            ::reactor::Demultiplex::ReadBudget const & budget, bool & more);
+
+    // the loop's budget, cut down to `burst` bytes if that is set
+    static ::reactor::Demultiplex::ReadBudget budgetOf(::reactor::Demultiplex const & dmp,
+            uint64_t burst);
+
+    // false if fd's error queue held a real error
+    bool reapCompletions(Shard & shard, int fd);
+
+    // reap fd's last completions and forget its buffers before it is closed
+    void dropBuffers(Shard & shard, int fd);
+
+    /**
+     * @brief start moving in_fd to out_fd with linked splices, the loop
+     * keeps resubmitting on SPLICED until either side closes. a splice
+     * in flight owns `pipe`.
+     */
+    void spliceInLoop(::reactor::Demultiplex & dmp, int in_fd, int out_fd,
+            ::reactor::Pipe & pipe);
+
+    /**
+     * @brief the backend hung up. what it sent last may still sit in the
+     * down pipe or its socket, the pair is closed once that reached the
+     * client.
+     */
+    void closeOrDrain(::reactor::Demultiplex & dmp, Relay & relay, int backend,
+            uint32_t events);
+
+    void closeInLoop(::reactor::Demultiplex & dmp, int fd);
 
-    ssize_t forward(int in_fd, int out_fd, Packet * packet);
+    // park the backend if nothing of the old client is left on it
+    void detachInLoop(::reactor::Demultiplex & dmp, int backend);
+
+    /**
+     * @brief close dmp's parked connections past their timeouts every
+     * PRUNE_INTERVAL_MS, rather than when the pool is next used. should
+     * the timer outlive us on a server's loop, it cancels itself then.
+     */
+    void pruneEvery(::reactor::Demultiplex & dmp);
+
+    /**
+     * @brief run teardownInLoop() on each of `loops` and wait for all of
+     * them. unless `running`, a loop that never ran is torn down here.
+     */
+    void teardown(std::vector<std::shared_ptr<::reactor::Demultiplex>> const & loops,
+            bool running);
+
+    // close dmp's pairs and stop its timers, then our handler leaves it
+    void teardownInLoop(::reactor::Demultiplex & dmp);
+
+    bool parkable(::reactor::Demultiplex & dmp, Shard & shard, Relay const & relay,
+            int backend);
+
+    // forget the pair, the backend socket is left alone
+    void unlink(::reactor::Demultiplex & dmp, Shard & shard, int backend);
 
 public:
     void stop();
 
     void pooling();
 
+    // aggregated over the per-loop upstream pools, from any thread
+    UpstreamStats upstreamStats();
+
 private:
     using SocketSet = std::unordered_set<int>;
     using AllSocket = std::unordered_map<std::string, SocketSet>;
     using SocketMap = std::unordered_map<int, int>;
 
 private:
+    using ConnectTimeouts = std::unordered_map<std::string, std::chrono::milliseconds>;
+
+private:
+    // writers of the settings
     std::mutex                                      mx_;
     std::condition_variable                         cv_;
     uint16_t                                        sub_id_;
     uint16_t                                        pub_id_;
     std::shared_ptr<::pubsub::PubSubCenter>         center_;
 
-    int                                             pipe_[2];
     std::atomic_bool                                stop_;
     std::atomic_bool                                flag_;
-    std::unordered_map<int, int>                    sock_map_;
-    std::unordered_map<int, int>                    reversed_map_;
+    // filled by the constructor and serve(), read-only afterwards
+    std::unordered_map<::reactor::Demultiplex *,
+        std::unique_ptr<Shard>>                     shards_;
+    // client fd -> the loop holding its relay, claimed by FORWARD rounds
+    std::vector<std::atomic<::reactor::Demultiplex *>> owners_;
+    reactor::PipePool                               pipes_;
+    // replaced as a whole, loops read whichever copy they load
+    std::shared_ptr<ConnectTimeouts const>          connect_timeouts_;
+    UpstreamPool::Options                           upstream_options_;
+    std::shared_ptr<::reactor::RateLimiter>         limiter_;
+    ShapingOptions                                  shaping_;
+    // keyed by backend, shared by every loop
+    std::unique_ptr<::reactor::RateLimiter>         backend_shaper_;
+    // set by serve(), the server's loops carry our backends as well
+    ::reactor::TcpServer *                          server_;
+    LoadBalancer *                                  balancer_;
+    std::vector<std::shared_ptr<::reactor::Demultiplex>> served_;
+    // shared with the pruning timers, a server's loop may run one after us
+    std::shared_ptr<Liveness>                       alive_;
     reactor::LoopThreadGroup                        group_;
 };
 
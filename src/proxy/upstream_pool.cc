@@ -0,0 +1,160 @@
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "upstream_pool.hpp"
+
+namespace proxy {
+
+UpstreamPool::UpstreamPool(Options const & options)
+    : options_(options)
+    , idle_()
+    , backend_of_()
+    , stats_()
+{}
+
+UpstreamPool::~UpstreamPool()
+{
+    for (auto & pair : backend_of_)
+        ::close(pair.first);
+}
+
+int UpstreamPool::acquire(std::string const & backend, Clock::time_point & created)
+{
+    if (!options_.reuse_)
+        return -1;
+
+    auto iter = idle_.find(backend);
+    if (iter != idle_.end())
+    {
+        auto now = Clock::now();
+        auto & list = iter->second;
+        while (!list.empty())
+        {
+            auto idle = list.back();
+            if (expired(idle, now))
+                stats_.expired_.fetch_add(1, std::memory_order_relaxed);
+            else if (!alive(idle.fd_))
+                stats_.stale_.fetch_add(1, std::memory_order_relaxed);
+            else
+            {
+                backend_of_.erase(idle.fd_);
+                stats_.idle_.store(backend_of_.size(), std::memory_order_relaxed);
+                list.pop_back();
+                created = idle.created_;
+                stats_.hits_.fetch_add(1, std::memory_order_relaxed);
+                return idle.fd_;
+            }
+            drop(list, list.size() - 1);
+        }
+    }
+
+    stats_.misses_.fetch_add(1, std::memory_order_relaxed);
+    return -1;
+}
+
+bool UpstreamPool::release(std::string const & backend, int fd, Clock::time_point created)
+{
+    if (!options_.reuse_)
+        return false;
+
+    auto now = Clock::now();
+    auto & list = idle_[backend];
+
+    // the oldest are at the front, expired ones go before counting
+    while (!list.empty() && expired(list.front(), now))
+    {
+        stats_.expired_.fetch_add(1, std::memory_order_relaxed);
+        drop(list, 0);
+    }
+
+    if (now - created >= options_.max_age_
+            || list.size() >= options_.max_idle_per_backend_
+            || backend_of_.size() >= options_.max_idle_)
+        return false;
+
+    list.push_back(Idle{ fd, created, now });
+    backend_of_.emplace(fd, backend);
+    stats_.idle_.store(backend_of_.size(), std::memory_order_relaxed);
+
+    return true;
+}
+
+bool UpstreamPool::evict(int fd)
+{
+    auto iter = backend_of_.find(fd);
+    if (iter == backend_of_.end())
+        return false;
+
+    auto & list = idle_[iter->second];
+    for (size_t i = 0; i < list.size(); i++)
+    {
+        if (list[i].fd_ == fd)
+        {
+            stats_.stale_.fetch_add(1, std::memory_order_relaxed);
+            drop(list, i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+size_t UpstreamPool::prune(Clock::time_point now)
+{
+    size_t count = 0;
+    for (auto & pair : idle_)
+    {
+        auto & list = pair.second;
+        for (size_t i = list.size(); i-- > 0; )
+        {
+            if (!expired(list[i], now))
+                continue;
+
+            stats_.expired_.fetch_add(1, std::memory_order_relaxed);
+            drop(list, i);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+UpstreamStats UpstreamPool::stats() const noexcept
+{
+    UpstreamStats stats;
+    stats.hits_ = stats_.hits_.load(std::memory_order_relaxed);
+    stats.misses_ = stats_.misses_.load(std::memory_order_relaxed);
+    stats.stale_ = stats_.stale_.load(std::memory_order_relaxed);
+    stats.expired_ = stats_.expired_.load(std::memory_order_relaxed);
+    stats.idle_ = stats_.idle_.load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+bool UpstreamPool::expired(Idle const & idle, Clock::time_point now) const noexcept
+{
+    return now - idle.created_ >= options_.max_age_
+            || now - idle.since_ >= options_.idle_timeout_;
+}
+
+bool UpstreamPool::alive(int fd) noexcept
+{
+    char byte;
+    ssize_t n;
+    while ((n = ::recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT)) == -1 && errno == EINTR)
+        ;
+
+    return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void UpstreamPool::drop(std::deque<Idle> & list, size_t pos)
+{
+    auto fd = list[pos].fd_;
+    list.erase(list.begin() + pos);
+    backend_of_.erase(fd);
+    stats_.idle_.store(backend_of_.size(), std::memory_order_relaxed);
+    ::close(fd);
+}
+
+} // namespace proxy
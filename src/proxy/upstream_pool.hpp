@@ -0,0 +1,143 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+namespace proxy {
+
+struct UpstreamStats
+{
+    UpstreamStats()
+        : hits_(0)
+        , misses_(0)
+        , stale_(0)
+        , expired_(0)
+        , idle_(0)
+    {}
+
+    UpstreamStats & operator+=(UpstreamStats const & other)
+    {
+        hits_ += other.hits_;
+        misses_ += other.misses_;
+        stale_ += other.stale_;
+        expired_ += other.expired_;
+        idle_ += other.idle_;
+        return *this;
+    }
+
+    size_t hits_;       // warm connections handed out, each a handshake avoided
+    size_t misses_;     // nothing idle, a new connection was needed
+    size_t stale_;      // idle ones found closed or talking when picked
+    size_t expired_;    // dropped for age or idleness
+    size_t idle_;
+};
+
+/**
+ * @brief idle backend connections of one loop, keyed by the backend's
+ * [ip:port]. a connection whose client left with nothing in flight is
+ * parked here and handed to the next client of the same backend.
+ * the proxy does not parse what it relays, so it cannot tell whether a
+ * backend still owes the old client bytes: reuse is off unless
+ * Options::reuse_ is set, which is only safe for request/response
+ * protocols whose backends are idle once the answer is read.
+ * parked sockets stay registered with their loop, epoll forgets them
+ * once they are closed. not locked, the owner serializes access,
+ * stats() may be read from any thread.
+ */
+class UpstreamPool
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Options
+    {
+        Options()
+            : reuse_(false)
+            , max_idle_per_backend_(16)
+            , max_idle_(256)
+            , max_age_(std::chrono::seconds(60))
+            , idle_timeout_(std::chrono::seconds(15))
+        {}
+
+        bool                reuse_;             // off, nothing is parked
+        size_t              max_idle_per_backend_;
+        size_t              max_idle_;
+        Clock::duration     max_age_;           // since the connect
+        Clock::duration     idle_timeout_;      // since it was parked
+    };
+
+public:
+    explicit UpstreamPool(Options const & options = Options());
+    UpstreamPool(const UpstreamPool &) = delete;
+    UpstreamPool & operator=(const UpstreamPool &) = delete;
+    UpstreamPool(UpstreamPool &&) = delete;
+    ~UpstreamPool();
+
+    /**
+     * @brief the most recently parked live connection to backend.
+     *
+     * @param created   set to when that connection was established
+     * @return int      the socket, -1 on a miss
+     */
+    int acquire(std::string const & backend, Clock::time_point & created);
+
+    /**
+     * @brief park fd. false if it is too old or the caps are reached,
+     * the caller closes it then.
+     */
+    bool release(std::string const & backend, int fd, Clock::time_point created);
+
+    // drop fd if it is parked here, true if it was. it is closed
+    bool evict(int fd);
+
+    // close every connection past its age or idle timeout, returns how many
+    size_t prune(Clock::time_point now);
+
+    UpstreamStats stats() const noexcept;
+
+private:
+    struct Idle
+    {
+        int                 fd_;
+        Clock::time_point   created_;
+        Clock::time_point   since_;
+    };
+
+    // written by the owner only, relaxed is enough
+    struct Counters
+    {
+        Counters()
+            : hits_(0)
+            , misses_(0)
+            , stale_(0)
+            , expired_(0)
+            , idle_(0)
+        {}
+
+        std::atomic<size_t> hits_;
+        std::atomic<size_t> misses_;
+        std::atomic<size_t> stale_;
+        std::atomic<size_t> expired_;
+        std::atomic<size_t> idle_;
+    };
+
+    bool expired(Idle const & idle, Clock::time_point now) const noexcept;
+
+    // nothing to read and no hangup, as a parked connection should be
+    static bool alive(int fd) noexcept;
+
+    void drop(std::deque<Idle> & list, size_t pos);
+
+private:
+    Options                                         options_;
+    // most recently parked at the back
+    std::unordered_map<std::string, std::deque<Idle>> idle_;
+    std::unordered_map<int, std::string>            backend_of_;
+    Counters                                        stats_;
+};
+
+} // namespace proxy
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+namespace pubsub {
+
+/**
+ * @brief statically typed subscriber used by the hot event path.
+ * the context arrives as its concrete type, so there is neither
+ * dynamic_pointer_cast nor shared_ptr refcounting per event.
+ */
+template<typename Ctx>
+class Handler
+{
+public:
+    Handler() = default;
+    virtual ~Handler() = default;
+
+    virtual void handle(Ctx & ctx) =0;
+};
+
+/**
+ * @brief handler table for one event type. handlers are resolved
+ * once at registration time, dispatching is a loop over a flat array.
+ * attach/detach are expected to happen before the loop starts.
+ */
+template<typename Ctx>
+class Dispatcher
+{
+public:
+    Dispatcher()
+        : handlers_()
+    {}
+    Dispatcher(const Dispatcher &) = delete;
+    Dispatcher & operator=(const Dispatcher &) = delete;
+
+    void attach(Handler<Ctx> * const h)
+    {
+        if (!h)
+            return;
+
+        if (std::find(handlers_.begin(), handlers_.end(), h) == handlers_.end())
+            handlers_.push_back(h);
+    }
+
+    void detach(Handler<Ctx> * const h)
+    {
+        auto iter = std::find(handlers_.begin(), handlers_.end(), h);
+        if (iter != handlers_.end())
+            handlers_.erase(iter);
+    }
+
+    bool empty() const noexcept
+    {
+        return handlers_.empty();
+    }
+
+    void dispatch(Ctx & ctx) const
+    {
+        for (auto h : handlers_)
+            h->handle(ctx);
+    }
+
+private:
+    std::vector<Handler<Ctx> *> handlers_;
+};
+
+} // namespace
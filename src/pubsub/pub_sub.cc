@@ -7,9 +7,7 @@
 
 namespace pubsub {
 
-PubSubCenter::PubSubCenter()
-    : traffic_()
-    {}
+PubSubCenter::PubSubCenter() {}
 
 PubSubCenter::~PubSubCenter() {}
 
@@ -73,28 +71,6 @@ void PubSubCenter::notifySubscriber(uint16_t pubID, PubType type, std::shared_pt
     }
 }
 
-void PubSubCenter::account(std::string const & addr, size_t traffic)
-{
-    if (traffic_.find(addr) == traffic_.end())
-        traffic_.emplace(addr, traffic);
-
-    traffic_.at(addr) += traffic;
-
-}
-
-size_t PubSubCenter::traffic(std::string const & addr)
-{
-    if (traffic_.find(addr) == traffic_.end())
-        return -1;
-
-    return traffic_.at(addr);
-}
-
-bool PubSubCenter::isLismited(std::string const & addr)
-{
-    return traffic(addr) > MAX_TRAFFIC;
-}
-
 std::shared_ptr<PubSubCenter> PubSubCenter::instance()
 {
     static std::mutex mx;
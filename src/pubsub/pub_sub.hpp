@@ -40,7 +40,6 @@ static uint16_t pub_id()
 }
 
 } // namespace ID
-constexpr static const auto MAX_TRAFFIC= LONG_LONG_MAX;
 
 class PubSubCenter
 {
@@ -58,12 +57,6 @@ public:
 
     void notifySubscriber(uint16_t pubID, PubType type, std::shared_ptr<Context> ctx);
 
-    void account(std::string const & addr, size_t traffic);
-
-    size_t traffic(std::string const & addr);
-
-    bool isLismited(std::string const & addr);
-
     static std::shared_ptr<PubSubCenter> instance();
 
 private:
@@ -72,8 +65,6 @@ private:
     std::unordered_map<uint16_t,
         std::unordered_map<PubType,
             std::unordered_set<Subscriber *>>>  subcribers_;
-
-    std::unordered_map<std::string, size_t>  traffic_;
 };
 
 } // namespace ::pubsub
\ No newline at end of file
@@ -14,6 +14,7 @@ enum PubType : uint16_t
 
     // proxy
     FORWARD,
-    BALANCE
+    BALANCE,
+    DISCONNECTED
 };
 } // namespace
\ No newline at end of file